@@ -6,6 +6,13 @@ static tui_str_t tui_ena_dis[] = {
     TSTR "enabled"
 };
 
+static tui_str_t tui_isolate[] = {
+    TSTR "none",
+    TSTR "last 1",
+    TSTR "last 2",
+    TSTR "last 4"
+};
+
 static tui_menu_item_t tui_menu[] = {
     {
         TSTR "kernel debugger",
@@ -16,6 +23,11 @@ static tui_menu_item_t tui_menu[] = {
         TSTR "serial debug output",
         tui_ena_dis,
         0
+    },
+    {
+        TSTR "isolated CPUs",
+        tui_isolate,
+        0
     }
 };
 
@@ -29,4 +41,7 @@ void boot_menu_show(kernel_params_t &params)
     boot_menu.interact_timeout(1000);
     params.wait_gdb = tui_menu[0].index != 0;
     params.serial_debugout = tui_menu[1].index != 0;
+    params.isolated_cpus = tui_menu[2].index
+            ? 1 << (tui_menu[2].index - 1)
+            : 0;
 }
@@ -109,6 +109,7 @@ static void enter_kernel_initial(uint64_t entry_point)
     PRINT("    serial_debugout: 0x%llx\n",
                uint64_t(params->serial_debugout));
     PRINT("           wait_gdb: 0x%x\n", params->wait_gdb);
+    PRINT("      isolated_cpus: 0x%x\n", params->isolated_cpus);
 
     ELF64_TRACE("Entry point: 0x%llx\n", entry_point);
 
@@ -91,7 +91,9 @@ struct alignas(8) kernel_params_t {
     uint64_t boot_drv_serial;
     uint8_t wait_gdb;
     uint8_t serial_debugout;
-    uint8_t reserved[6];
+    // Number of highest numbered CPUs to isolate
+    uint8_t isolated_cpus;
+    uint8_t reserved[5];
 } _packed;
 
 // Ensure that all of the architectures have the same layout
@@ -28,10 +28,13 @@
 #include "nano_time.h"
 #include "cmos.h"
 #include "apicbits.h"
+#include "hpet.h"
+#include "tsc.h"
 #include "mutex.h"
 #include "bootinfo.h"
 #include "boottable.h"
 #include "inttypes.h"
+#include "irq_balance.h"
 
 #define ENABLE_ACPI 1
 
@@ -259,6 +262,18 @@ static int16_t intr_to_irq[256];
 static int16_t irq_to_intr[256];
 static int16_t intr_to_ioapic[256];
 
+// Rewrites the device's MSI message, to move an MSI IRQ
+struct apic_msi_writer_ent_t {
+    apic_msi_writer_t writer;
+    void *arg;
+
+    // CPU the message targets, -1 for lowest priority
+    int cpu;
+};
+
+static apic_msi_writer_ent_t apic_msi_writers[
+        INTR_APIC_IRQ_END - INTR_APIC_IRQ_BASE];
+
 static uint8_t topo_thread_bits;
 static uint8_t topo_thread_count;
 static uint8_t topo_core_bits;
@@ -266,6 +281,9 @@ static uint8_t topo_core_count;
 
 static uint8_t topo_cpu_count;
 
+// APIC ID bits below the package ID
+static uint8_t topo_package_shift;
+
 static uintptr_t apic_base;
 static uint32_t volatile *apic_ptr;
 
@@ -374,6 +392,11 @@ static uint32_t volatile *apic_ptr;
 #define APIC_CMD_DEST_TYPE_ALL      APIC_CMD_DEST_TYPE_n(2)
 #define APIC_CMD_DEST_TYPE_OTHER    APIC_CMD_DEST_TYPE_n(3)
 
+// x2APIC logical destination, fixed by hardware: cluster in bits 31:16
+// from x2APIC ID bits 31:4, one bit per CPU from x2APIC ID bits 3:0
+#define APIC_X2_LDR_n(id) \
+    ((((id) >> 4) << 16) | (1U << ((id) & 0xF)))
+
 // Divide configuration register
 #define APIC_LVT_DCR_BY_2           0
 #define APIC_LVT_DCR_BY_4           1
@@ -473,6 +496,10 @@ class lapic_x_t : public lapic_t {
 class lapic_x2_t : public lapic_t {
     void command(uint32_t dest, uint32_t cmd) const override final
     {
+        // WRMSR to x2APIC registers is not serializing, make prior
+        // stores visible before the IPI can be taken. There is no
+        // delivery status to poll, the single write sends it
+        __asm__ __volatile__ ("mfence\n\tlfence" : : : "memory");
         write64(APIC_REG_ICR_LO, (uint64_t(dest) << 32) | cmd);
     }
 
@@ -855,7 +882,7 @@ struct acpi_hpet_t {
     uint8_t number;
     uint16_t min_tick_count;
     uint8_t page_prot;
-};
+} _packed;
 
 #define ACPI_HPET_BLKID_PCI_VEN_BIT     16
 #define ACPI_HPET_BLKID_LEGACY_CAP_BIT  15
@@ -1058,9 +1085,18 @@ static void acpi_process_madt(acpi_madt_t *madt_hdr)
         {
             ACPI_TRACE("Got X2APIC\n");
 
-            if (apic_id_count < countof(apic_id_list)) {
-                if (ent->lapic.flags == 1)
-                    apic_id_list[apic_id_count++] = ent->x2apic.x2apic_id;
+            // Firmware may list a CPU with an LAPIC entry too
+            uint32_t x2apic_id = ent->x2apic.x2apic_id;
+            bool dup = false;
+            for (size_t i = 0; i < apic_id_count && !dup; ++i)
+                dup = (apic_id_list[i] == x2apic_id);
+
+            if (dup || !(ent->x2apic.flags & 1)) {
+                ACPI_TRACE("Duplicate or disabled X2APIC, ID=%u\n",
+                           x2apic_id);
+            } else if (apic_id_count < countof(apic_id_list)) {
+                ACPI_TRACE("Found X2APIC, ID=%u\n", x2apic_id);
+                apic_id_list[apic_id_count++] = x2apic_id;
             } else {
                 ACPI_ERROR("Too many CPUs! Dropped one\n");
             }
@@ -1078,7 +1114,12 @@ static void acpi_process_madt(acpi_madt_t *madt_hdr)
 
 static void acpi_process_hpet(acpi_hpet_t *acpi_hdr)
 {
-    acpi_hpet_list.push_back(acpi_hdr->addr);
+    acpi_gas_t gas = acpi_hdr->addr;
+
+    acpi_hpet_list.push_back(gas);
+
+    if (gas.addr_space == ACPI_GAS_ADDR_SYSMEM)
+        hpet_init((uint64_t(gas.addr_hi) << 32) | gas.addr_lo);
 }
 
 static _always_inline uint8_t acpi_chk_hdr(acpi_sdt_hdr_t *hdr)
@@ -1559,9 +1600,12 @@ static isr_context_t *apic_err_handler(int intr, isr_context_t *ctx)
 
 unsigned apic_get_id(void)
 {
-    if (likely(apic))
+    if (likely(apic == &apic_x2))
         return apic->read32(APIC_REG_ID);
 
+    if (likely(apic))
+        return APIC_DEST_GET(apic->read32(APIC_REG_ID));
+
     cpuid_t cpuid_info;
     cpuid(&cpuid_info, CPUID_INFO_FEATURES, 0);
     unsigned apic_id = cpuid_info.ebx >> 24;
@@ -1590,7 +1634,7 @@ void apic_send_ipi(int target_apic_id, uint8_t intr)
 
     uint32_t dest = (target_apic_id >= 0) ? target_apic_id : 0;
 
-    if (intr != INTR_TLB_SHOOTDOWN) {
+    if (intr != INTR_CPU_CALL) {
         APIC_TRACE("IPI: intr=%x dest_type=%x dest_mode=%x cmd=%x\n",
                    intr, dest_type, dest_mode,
                    APIC_CMD_VECTOR_n(intr) | dest_type | dest_mode);
@@ -1599,6 +1643,54 @@ void apic_send_ipi(int target_apic_id, uint8_t intr)
     apic_send_command(dest, APIC_CMD_VECTOR_n(intr) | dest_type | dest_mode);
 }
 
+void apic_send_ipi_multi(uint32_t const *apic_ids, size_t count, uint8_t intr)
+{
+    if (unlikely(!apic))
+        return;
+
+    assert(count <= MAX_CPUS);
+
+    uint32_t cmd = APIC_CMD_VECTOR_n(intr) |
+            ((intr != INTR_EX_NMI)
+             ? APIC_CMD_DELIVERY_NORMAL
+             : APIC_CMD_DELIVERY_NMI);
+
+    if (apic != &apic_x2) {
+        // Flat logical mode only reaches 8 CPUs, send them one by one
+        for (size_t i = 0; i < count; ++i) {
+            apic_send_command(apic_ids[i], cmd |
+                              APIC_CMD_DEST_TYPE_BYID |
+                              APIC_CMD_DEST_MODE_PHYSICAL);
+        }
+        return;
+    }
+
+    // Merge the targets into one logical destination per cluster
+    uint32_t dests[MAX_CPUS];
+    size_t dest_count = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t ldr = APIC_X2_LDR_n(apic_ids[i]);
+
+        size_t d;
+        for (d = 0; d < dest_count; ++d) {
+            if ((dests[d] ^ ldr) < (1U << 16))
+                break;
+        }
+
+        if (d < dest_count)
+            dests[d] |= ldr;
+        else
+            dests[dest_count++] = ldr;
+    }
+
+    for (size_t d = 0; d < dest_count; ++d) {
+        apic_send_command(dests[d], cmd |
+                          APIC_CMD_DEST_TYPE_BYID |
+                          APIC_CMD_DEST_MODE_LOGICAL);
+    }
+}
+
 void apic_eoi(int intr)
 {
     apic->write32(APIC_REG_EOI, intr & 0);
@@ -1621,9 +1713,12 @@ static void apic_online(int enabled, int spurious_intr, int err_intr)
     if (spurious_intr >= 32)
         APIC_SIR_VECTOR_SET(sir, spurious_intr);
 
-    // LDR is read only in x2APIC mode
+    // LDR is read only in x2APIC mode, multicast relies on its layout
     if (apic != &apic_x2)
         apic->write32(APIC_REG_LDR, 0xFFFFFFFF);
+    else
+        assert(apic->read32(APIC_REG_LDR) ==
+               APIC_X2_LDR_n(apic->read32(APIC_REG_ID)));
 
     apic->write32(APIC_REG_SIR, sir);
 
@@ -1681,6 +1776,17 @@ static void apic_configure_timer(
     apic->write32(APIC_REG_LVT_ICR, icr);
 }
 
+void apic_timer_tick(bool enable)
+{
+    // A periodic timer keeps counting while it is masked
+    uint32_t lvt = apic->read32(APIC_REG_LVT_TR);
+    if (enable)
+        lvt &= ~APIC_LVT_MASK;
+    else
+        lvt |= APIC_LVT_MASK;
+    apic->write32(APIC_REG_LVT_TR, lvt);
+}
+
 int apic_init(int ap)
 {
     uint64_t apic_base_msr = cpu_msr_get(CPU_APIC_BASE_MSR);
@@ -1845,6 +1951,47 @@ static void apic_detect_topology_intel(void)
     topo_cpu_count = apic_id_count * topo_core_count * topo_thread_count;
 }
 
+// Needs no MP table, so it works when ACPI lists every CPU
+static void apic_detect_package_shift(void)
+{
+    cpuid_t info;
+
+    static uint32_t const leaves[] = { CPUID_TOPOLOGY3, CPUID_TOPOLOGY2 };
+
+    // Each subleaf is a level, its shift moves the APIC ID past that
+    // level. The last level's shift is where the package ID starts
+    for (uint32_t leaf : leaves) {
+        if (!cpuid(&info, leaf, 0) || !info.ebx)
+            continue;
+
+        uint8_t shift = 0;
+
+        for (uint32_t level = 0; cpuid(&info, leaf, level) &&
+             ((info.ecx >> 8) & 0xFF); ++level)
+            shift = info.eax & 0x1F;
+
+        topo_package_shift = shift;
+        return;
+    }
+
+    // Older CPUs only report the logical CPUs per package
+    topo_package_shift = 0;
+
+    if (cpuid(&info, CPUID_INFO_FEATURES, 0) && ((info.edx >> 28) & 1)) {
+        uint8_t logical_count = (info.ebx >> 16) & 0xFF;
+        if (logical_count > 1)
+            topo_package_shift = bit_log2(logical_count);
+    }
+}
+
+// The APIC ID bits above the cores and threads
+uint32_t apic_cpu_package(int cpu)
+{
+    assert(unsigned(cpu) < apic_id_count);
+
+    return apic_id_list[cpu] >> topo_package_shift;
+}
+
 __aligned(16) char const vendor_intel[16] = "GenuineIntel";
 __aligned(16) char const vendor_amd[16] = "AuthenticAMD";
 
@@ -1903,6 +2050,8 @@ void apic_start_smp(void)
         topo_thread_count = 1;
     }
 
+    apic_detect_package_shift();
+
     gdt_init_tss(topo_cpu_count);
     gdt_load_tr(0);
 
@@ -1956,7 +2105,7 @@ void apic_start_smp(void)
         for (unsigned thread = 0;
              thread < topo_thread_count; ++thread) {
             for (unsigned core = 0; core < topo_core_count; ++core) {
-                uint8_t target = apic_id_list[pkg] +
+                uint32_t target = apic_id_list[pkg] +
                         (thread | (core << topo_thread_bits));
 
                 // Don't try to start BSP
@@ -2108,28 +2257,58 @@ constexpr T gcd(T a, T b)
 
 static uint64_t apic_rdtsc_time_ns_handler()
 {
-    uint64_t now = cpu_rdtsc();
-    return now * clk_to_ns_numer/ clk_to_ns_denom;
+    return nano_time_clock_ns();
 }
 
 static uint64_t apic_rdtsc_nsleep_handler(uint64_t nanosec)
 {
-    assert(clk_to_ns_denom != 0);
-    assert(clk_to_ns_numer != 0);
-
     uint64_t begin = cpu_rdtsc();
-    uint64_t then = nanosec * clk_to_ns_denom / clk_to_ns_numer + begin;
+    uint64_t then = nano_time_add(begin, nanosec);
     uint64_t now;
 
     for (now = begin; now < then; now = cpu_rdtsc())
         pause();
 
-    return (now - begin) * clk_to_ns_numer / clk_to_ns_denom;
+    return nano_time_ns(begin, now);
 }
 
 static void apic_calibrate()
 {
-    if (acpi_pm_timer_raw() >= 0) {
+    if (hpet_available()) {
+        //
+        // Have HPET, reading it is one uncached load
+
+        apic_configure_timer(APIC_LVT_DCR_BY_1, 0xFFFFFFF0U,
+                             APIC_LVT_TR_MODE_n(APIC_LVT_TR_MODE_ONESHOT),
+                             INTR_APIC_TIMER, true);
+
+        uint64_t hpet_st = hpet_time_ns();
+        uint32_t ccr_st = apic->read32(APIC_REG_LVT_CCR);
+        uint64_t tsc_st = cpu_rdtsc();
+        uint64_t hpet_en;
+
+        // Wait for about 1ms
+        do {
+            pause();
+            hpet_en = hpet_time_ns();
+        } while (hpet_en - hpet_st < 1000000);
+
+        uint32_t ccr_en = apic->read32(APIC_REG_LVT_CCR);
+        uint64_t tsc_en = cpu_rdtsc();
+
+        uint64_t tsc_elap = tsc_en - tsc_st;
+        uint32_t ccr_elap = ccr_st - ccr_en;
+        uint64_t tmr_nsec = hpet_en - hpet_st;
+
+        uint64_t cpu_freq = (tsc_elap * 1000000000) / tmr_nsec;
+        uint64_t ccr_freq = (uint64_t(ccr_elap) * 1000000000) / tmr_nsec;
+
+        // Precise enough to use without rounding
+        apic_timer_freq = ccr_freq;
+
+        // Round CPU frequency to nearest multiple of 1MHz
+        rdtsc_mhz = (cpu_freq + 500000) / 1000000;
+    } else if (acpi_pm_timer_raw() >= 0) {
         //
         // Have PM timer
 
@@ -2159,7 +2338,7 @@ static void apic_calibrate()
         uint64_t tmr_nsec = acpi_pm_timer_ns(tmr_diff);
 
         uint64_t cpu_freq = (tsc_elap * 1000000000) / tmr_nsec;
-        uint64_t ccr_freq = (ccr_elap * 1000000000) / tmr_nsec;
+        uint64_t ccr_freq = (uint64_t(ccr_elap) * 1000000000) / tmr_nsec;
 
         apic_timer_freq = ccr_freq;
 
@@ -2189,7 +2368,7 @@ static void apic_calibrate()
         uint32_t ccr_elap = ccr_st - ccr_en;
 
         uint64_t cpu_freq = (tsc_elap * 1000000000) / tmr_nsec;
-        uint64_t ccr_freq = (ccr_elap * 1000000000) / tmr_nsec;
+        uint64_t ccr_freq = (uint64_t(ccr_elap) * 1000000000) / tmr_nsec;
 
         apic_timer_freq = ccr_freq;
         rdtsc_mhz = (cpu_freq + 500000) / 1000000;
@@ -2202,16 +2381,30 @@ static void apic_calibrate()
     // clk_to_ns: let clks = 2500000000
     //  2500000000 * 2 / 5 = 1000000000ns
 
-    uint64_t clk_to_ns_gcd = gcd(uint64_t(1000), rdtsc_mhz);
+    // The frequency CPUID reports is exact, use it in Hz when it has one
+    uint64_t tsc_hz = tsc_cpuid_hz();
+    uint64_t ns_per_sec = 1000;
+    uint64_t tsc_rate = rdtsc_mhz;
+
+    if (tsc_hz) {
+        APIC_TRACE("CPUID TSC frequency: %" PRIu64 "Hz\n", tsc_hz);
+        rdtsc_mhz = (tsc_hz + 500000) / 1000000;
+        ns_per_sec = 1000000000;
+        tsc_rate = tsc_hz;
+    }
+
+    uint64_t clk_to_ns_gcd = gcd(ns_per_sec, tsc_rate);
 
     APIC_TRACE("CPU MHz GCD: %" PRId64 "\n", clk_to_ns_gcd);
 
-    clk_to_ns_numer = 1000 / clk_to_ns_gcd;
-    clk_to_ns_denom = rdtsc_mhz / clk_to_ns_gcd;
+    uint64_t clk_to_ns_numer = ns_per_sec / clk_to_ns_gcd;
+    uint64_t clk_to_ns_denom = tsc_rate / clk_to_ns_gcd;
 
     APIC_TRACE("clk_to_ns_numer: %" PRId64 "\n", clk_to_ns_numer);
     APIC_TRACE("clk_to_ns_denom: %" PRId64 "\n", clk_to_ns_denom);
 
+    nano_time_set_rate(clk_to_ns_numer, clk_to_ns_denom);
+
     if (cpuid_has_inrdtsc()) {
         APIC_TRACE("Using RDTSC for precision timing\n");
         time_ns_set_handler(apic_rdtsc_time_ns_handler, nullptr, true);
@@ -2412,6 +2605,8 @@ isr_context_t *apic_dispatcher(int intr, isr_context_t *ctx)
 
     assert(irq < INTR_APIC_IRQ_END - INTR_APIC_IRQ_BASE);
 
+    irq_balance_count(thread_cpu_number(), irq);
+
     ctx = irq_invoke(intr, irq, ctx);
     apic_eoi(intr);
 
@@ -2472,14 +2667,40 @@ static void ioapic_map_all(void)
     ioapic_msi_base_irq = ioapic->irq_base + ioapic->vector_count;
 }
 
+// MSI IRQs without a writer stay on the CPU they were allocated on
+static bool apic_msi_irq_setcpu(int irq, int intr, int cpu)
+{
+    apic_msi_writer_t writer = atomic_ld_acq(&apic_msi_writers[irq].writer);
+
+    if (!writer)
+        return false;
+
+    msi_irq_mem_t mem;
+    apic_msi_target(&mem, cpu, intr);
+
+    ioapic_msi_alloc_scoped_lock lock(ioapic_msi_alloc_lock);
+    writer(apic_msi_writers[irq].arg, &mem);
+
+    return true;
+}
+
 // Returns 0 on failure, 1 on success
 bool ioapic_irq_setcpu(int irq, int cpu)
 {
     if (unsigned(cpu) >= apic_id_count)
         return false;
 
+    // Device IRQs stay off isolated CPUs
+    cpu = thread_cpu_irq_target(cpu);
+
     int irq_intr = irq_to_intr[irq];
+    if (irq_intr < 0)
+        return false;
+
     int ioapic_index = intr_to_ioapic[irq_intr];
+    if (ioapic_index < 0)
+        return apic_msi_irq_setcpu(irq, irq_intr, cpu);
+
     mp_ioapic_t *ioapic = ioapic_list + ioapic_index;
     mp_ioapic_t::scoped_lock lock(ioapic->lock);
     unsigned intin = irq_intr - ioapic->base_intr;
@@ -2512,6 +2733,49 @@ bool ioapic_irq_setcpu(int irq, int cpu)
     return true;
 }
 
+void apic_irq_reroute_isolated()
+{
+    for (unsigned i = 0; i < ioapic_count; ++i) {
+        mp_ioapic_t *ioapic = ioapic_list + i;
+
+        for (unsigned intin = 0; intin < ioapic->vector_count; ++intin) {
+            int irq = intr_to_irq[ioapic->base_intr + intin];
+            if (irq < 0)
+                continue;
+
+            mp_ioapic_t::scoped_lock lock(ioapic->lock);
+            uint32_t lo = ioapic_read(ioapic, IOAPIC_RED_LO_n(intin), lock);
+            uint32_t hi = ioapic_read(ioapic, IOAPIC_RED_HI_n(intin), lock);
+            lock.unlock();
+
+            // Only physical destinations name one CPU
+            if (IOAPIC_REDLO_DESTMODE_GET(lo) ==
+                    IOAPIC_REDLO_DESTMODE_LOGICAL)
+                continue;
+
+            uint32_t dest = IOAPIC_REDHI_DEST_GET(hi);
+            for (unsigned cpu = 0; cpu < apic_id_count; ++cpu) {
+                if (apic_id_list[cpu] == dest &&
+                        thread_cpu_is_isolated(cpu)) {
+                    ioapic_irq_setcpu(irq, cpu);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int irq = 0; irq < INTR_APIC_IRQ_END - INTR_APIC_IRQ_BASE; ++irq) {
+        apic_msi_writer_ent_t const &ent = apic_msi_writers[irq];
+
+        // Lowest priority delivery may pick an isolated CPU too
+        if (!atomic_ld_acq(&ent.writer) ||
+                (ent.cpu >= 0 && !thread_cpu_is_isolated(ent.cpu)))
+            continue;
+
+        apic_msi_irq_setcpu(irq, irq_to_intr[irq], ent.cpu);
+    }
+}
+
 int apic_enable(void)
 {
     if (ioapic_count == 0)
@@ -2538,6 +2802,10 @@ void apic_msi_target(msi_irq_mem_t *result, int cpu, int vector)
     assert(vector >= INTR_APIC_IRQ_BASE);
     assert(vector < INTR_APIC_IRQ_END);
 
+    // Device IRQs stay off isolated CPUs
+    cpu = thread_cpu_irq_target(cpu);
+    apic_msi_writers[vector - INTR_APIC_IRQ_BASE].cpu = cpu;
+
     // Intel's ridiculous documentation for DM and RH fields:
     ///  This bit indicates whether the Destination ID field should be
     ///  interpreted as logical or physical APIC ID for delivery of the
@@ -2578,7 +2846,7 @@ void apic_msi_target(msi_irq_mem_t *result, int cpu, int vector)
     if (cpu >= 0) {
         // Specific CPU
         result->addr = (0xFEEU << 20) |
-                ((apic_id_list[cpu % cpu_count] << 12) & 0xFF);
+                ((apic_id_list[cpu % cpu_count] & 0xFF) << 12);
     } else {
         // Lowest priority
         result->addr = (0xFEEU << 20) | (1 << 2) | (1 << 3) |
@@ -2657,6 +2925,14 @@ int apic_msi_irq_alloc(msi_irq_mem_t *results, int count,
     return vector_base - INTR_APIC_IRQ_BASE;
 }
 
+void apic_msi_irq_set_writer(int irq, apic_msi_writer_t writer, void *arg)
+{
+    assert(irq >= 0 && irq < INTR_APIC_IRQ_END - INTR_APIC_IRQ_BASE);
+
+    apic_msi_writers[irq].arg = arg;
+    atomic_st_rel(&apic_msi_writers[irq].writer, writer);
+}
+
 uint32_t acpi_cpu_count()
 {
     return apic_id_count;
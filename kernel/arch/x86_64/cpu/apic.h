@@ -12,8 +12,15 @@ unsigned apic_get_id(void);
 // if target_apid_id is >= 0, sends to specific APIC ID
 void apic_send_ipi(int target_apic_id, uint8_t intr);
 
+// Send to each APIC ID in the list. In x2APIC mode, sends one logical
+// cluster IPI per cluster, otherwise one physical IPI per target
+void apic_send_ipi_multi(uint32_t const *apic_ids, size_t count, uint8_t intr);
+
 void apic_eoi(int intr);
 uint32_t apic_timer_count(void);
+
+// Stop or restart the timer interrupt on the calling CPU
+void apic_timer_tick(bool enable);
 void apic_dump_regs(int ap);
 
 int apic_enable(void);
@@ -26,8 +33,22 @@ int apic_msi_irq_alloc(msi_irq_mem_t *results, int count,
                        char const *name, int const *target_cpus = nullptr,
                        int const *vector_offsets = nullptr);
 
+// Rewrites the address and data a device sends for one MSI IRQ
+typedef void (*apic_msi_writer_t)(void *arg, msi_irq_mem_t const *mem);
+
+// Lets ioapic_irq_setcpu move the MSI IRQ, by having writer update
+// the device with the message for the new CPU
+void apic_msi_irq_set_writer(int irq, apic_msi_writer_t writer, void *arg);
+
+// Move device IRQs off CPUs that became isolated. MSI IRQs without
+// a writer cannot be moved and stay where they are
+void apic_irq_reroute_isolated();
+
 void apic_config_cpu();
 
+// CPUs with the same package ID share a physical processor
+uint32_t apic_cpu_package(int cpu);
+
 int acpi_have8259pic(void);
 
 uint32_t acpi_cpu_count();
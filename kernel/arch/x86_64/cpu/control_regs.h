@@ -533,6 +533,14 @@ static _always_inline void cpu_breakpoint()
     );
 }
 
+// Clear CR0.TS, permit FPU instructions without #NM trap
+static _always_inline void cpu_clts()
+{
+    __asm__ __volatile__ (
+        "clts\n\t"
+    );
+}
+
 static _always_inline void cpu_fninit()
 {
     __asm__ __volatile__ (
@@ -680,6 +688,21 @@ static _always_inline uint64_t cpu_rdtsc()
     return tsc_lo | ((uint64_t)tsc_hi << 32);
 }
 
+// Does not read the TSC until earlier instructions complete
+static _always_inline uint64_t cpu_rdtsc_ordered()
+{
+    uint32_t tsc_lo;
+    uint32_t tsc_hi;
+    __asm__ __volatile__ (
+        "lfence\n\t"
+        "rdtsc\n\t"
+        : "=a" (tsc_lo), "=d" (tsc_hi)
+        :
+        : "memory"
+    );
+    return tsc_lo | ((uint64_t)tsc_hi << 32);
+}
+
 //
 // C++ utilities
 
@@ -9,6 +9,7 @@
 #define CPU_MSR_KGSBASE         0xC0000102U
 #define CPU_MSR_EFER            0xC0000080U
 #define CPU_MSR_TSC_AUX         0xC0000103U
+#define CPU_MSR_TSC_ADJUST      0x3BU
 
 #define CPU_MSR_EFER_SCE_BIT    0
 #define CPU_MSR_EFER_LME_BIT    8
@@ -471,6 +472,9 @@
 #define CPUID_INFO_EXT_FEATURES 0x7
 #define CPUID_TOPOLOGY2         0xB
 #define CPUID_INFO_XSAVE        0xD
+#define CPUID_TSC_FREQ          0x15
+#define CPUID_PROC_FREQ         0x16
+#define CPUID_TOPOLOGY3         0x1F
 #define CPUID_EXTHIGHESTFUNC    0x80000000
 #define CPUID_EXTINFO_FEATURES  0x80000001
 #define CPUID_BRANDSTR1         0x80000002
@@ -18,6 +18,8 @@
 #include "interrupts.h"
 #include "syscall.h"
 #include "string.h"
+#include "thread.h"
+#include "bootinfo.h"
 
 uint32_t default_mxcsr_mask;
 
@@ -226,6 +228,18 @@ void cpu_hw_init(int ap)
 
     pit8254_enable();
 
+    // Isolate the highest numbered CPUs selected in the boot menu,
+    // before any IRQs are routed to them
+    size_t isolate = bootinfo_parameter(bootparam_t::boot_isolated_cpus);
+    if (isolate) {
+        size_t total = acpi_cpu_count();
+        thread_cpu_mask_t isolated;
+        for (size_t cpu = total > isolate ? total - isolate : 1;
+             cpu < total; ++cpu)
+            isolated.set(cpu);
+        thread_set_isolated(isolated);
+    }
+
     printk("Starting SMP\n");
 
     apic_start_smp();
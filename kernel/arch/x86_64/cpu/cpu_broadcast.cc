@@ -1,131 +1,204 @@
 #include "cpu_broadcast.h"
 #include "string.h"
-#include "stdlib.h"
-#include "mutex.h"
+#include "ring.h"
 #include "thread_impl.h"
+#include "interrupts.h"
 #include "apic.h"
-#include "printk.h"
-#include "hash_table.h"
-
-// Queued work item
-struct cpu_broadcast_work_t {
-    struct cpu_broadcast_work_t *next;
-    cpu_broadcast_handler_t handler;
-    void *data;
-    int intr;
-    int unique;
+#include "irq.h"
+#include "assert.h"
+#include "likely.h"
+#include "cpu/atomic.h"
+#include "cpu/control_regs.h"
+
+// One request is shared by every target CPU
+struct cpu_call_req_t {
+    cpu_call_fn_t fn;
+    void *arg;
+
+    // Targets that have not returned from fn yet
+    int volatile refs;
+
+    // Broadcast messages are copied here, arg points to it
+    char data[CPU_BROADCAST_DATA_MAX];
 };
 
-// Per-CPU message queue
-struct cpu_broadcast_queue_t {
-    cpu_broadcast_work_t *head;
-    cpu_broadcast_work_t *tail;
-    cpu_broadcast_work_t *free;
+struct alignas(64) cpu_call_cpu_t {
+    // Any CPU pushes, only the owning CPU pops
+    mpsc_ring<cpu_call_req_t *, CPU_CALL_QUEUE_SIZE> ring;
 
-    using lock_type = mcslock;
-    using scoped_lock = unique_lock<lock_type>;
-    lock_type lock;
+    // Set by the sender that owes the IPI, cleared by the receiver
+    // before it drains the ring
+    alignas(64) bool volatile pending;
+
+    // Requests sent without waiting, reusable when refs is zero.
+    // Only the owning CPU claims them, with interrupts disabled
+    cpu_call_req_t pool[CPU_CALL_POOL_SIZE];
 };
 
-void cpu_broadcast_service(int intr, size_t slot)
-{
-    cpu_broadcast_queue_t *queue =
-            (cpu_broadcast_queue_t *)thread_cls_get(slot);
-    cpu_broadcast_work_t *work;
-    int eoi_done = 0;
+static cpu_call_cpu_t cpu_call_cpus[MAX_CPUS];
 
-    cpu_broadcast_queue_t::scoped_lock lock(queue->lock);
-    for (;;) {
-        // Take whole list and release lock ASAP
-        cpu_broadcast_work_t *head = queue->head;
-        cpu_broadcast_work_t *tail = queue->head;
-        if (!eoi_done) {
-            eoi_done = 1;
-            apic_eoi(intr);
-        }
-        queue->head = nullptr;
-        queue->tail = nullptr;
-        lock.unlock();
+// Only called on the owning CPU with interrupts disabled
+static void cpu_call_service(int cpu_nr)
+{
+    cpu_call_cpu_t *cpu = cpu_call_cpus + cpu_nr;
 
-        // End loop when no
-        if (!head)
-            break;
+    // The fence orders the clear before the ring reads, a sender
+    // that pushes after the last pop sends another IPI
+    cpu->pending = false;
+    atomic_fence();
 
-        for (work = head; work; work = work->next)
-            work->handler(work->data);
+    cpu_call_req_t *req;
+    while (cpu->ring.pop(req)) {
+        req->fn(req->arg);
 
-        // Insert into free list
-        lock.lock();
-        tail->next = queue->free;
-        queue->free = head;
+        // The sender may reuse it as soon as this reaches zero
+        atomic_dec(&req->refs);
     }
 }
 
-static void *cpu_broadcast_init_cpu(void *arg)
+static isr_context_t *cpu_call_handler(int intr, isr_context_t *ctx)
 {
-    (void)arg;
+    apic_eoi(intr);
 
-    cpu_broadcast_queue_t *queue;
-    void *mem = calloc(1, sizeof(*queue));
-    queue = new (mem) cpu_broadcast_queue_t();
+    cpu_call_service(thread_cpu_number());
+
+    return ctx;
+}
+
+void cpu_call_init(void)
+{
+    intr_hook(INTR_CPU_CALL, cpu_call_handler, "sw_call");
+}
 
-    return queue;
+// Another CPU may be spinning with interrupts disabled waiting for
+// this one, so run what was sent here while waiting
+static void cpu_call_poll(int self)
+{
+    cpu_call_service(self);
+    pause();
 }
 
-size_t cpu_broadcast_create(void)
+static cpu_call_req_t *cpu_call_claim(int self)
 {
-    // Allocate a CPU-local storage slot
-    size_t slot = thread_cls_alloc();
+    cpu_call_cpu_t *cpu = cpu_call_cpus + self;
 
-    thread_cls_init_each_cpu(slot, cpu_broadcast_init_cpu, nullptr);
+    for (;;) {
+        for (cpu_call_req_t &req : cpu->pool) {
+            if (atomic_ld_acq(&req.refs) == 0)
+                return &req;
+        }
 
-    return slot;
+        cpu_call_poll(self);
+    }
 }
 
-static void cpu_broadcast_add_work(
-        int cpu, void *slot_data, void *arg, size_t size)
+static void cpu_call_queue(int self, thread_cpu_mask_t const& cpus,
+                           cpu_call_req_t *req, bool unique)
 {
-    cpu_broadcast_queue_t *queue = (cpu_broadcast_queue_t *)slot_data;
+    int cpu_count = thread_cpu_count();
 
-    cpu_broadcast_queue_t::scoped_lock lock(queue->lock);
+    // Count every target before queueing, a fast target may finish
+    // before the request reaches the others
+    thread_cpu_mask_t targets;
+    int target_count = 0;
+
+    for (int c = 0; c < cpu_count; ++c) {
+        if (c == self || !cpus.test(c))
+            continue;
+
+        if (unique && !cpu_call_cpus[c].ring.empty())
+            continue;
+
+        targets.set(c);
+        ++target_count;
+    }
 
-    cpu_broadcast_work_t *incoming_work = (cpu_broadcast_work_t *)arg;
+    req->refs = target_count;
 
-    if (incoming_work->unique && queue->head)
+    if (!target_count)
         return;
 
-    cpu_broadcast_work_t *queued_work;
-    void *mem = malloc(sizeof(*queued_work) + size);
+    uint32_t apic_ids[MAX_CPUS];
+    size_t ipi_count = 0;
 
-    queued_work = new (mem) cpu_broadcast_work_t();
-    memcpy(queued_work, arg, sizeof(*queued_work));
-    memcpy(queued_work + 1, queued_work->data, size);
-    queued_work->data = queued_work + 1;
+    for (int c = 0; c < cpu_count; ++c) {
+        if (!targets.test(c))
+            continue;
 
-    while (queue->free) {
-        cpu_broadcast_work_t *next = queue->free->next;
-        free(queue->free);
-        queue->free = next;
+        cpu_call_cpu_t *cpu = cpu_call_cpus + c;
+
+        while (unlikely(!cpu->ring.push(req)))
+            cpu_call_poll(self);
+
+        if (!atomic_xchg(&cpu->pending, true))
+            apic_ids[ipi_count++] = thread_get_cpu_apic_id(c);
     }
-    if (!queue->head) {
-        queue->head = queue->tail = queued_work;
-        thread_send_ipi(cpu, queued_work->intr);
-    } else {
-        queue->tail->next = queued_work;
-        queue->tail = queued_work;
+
+    if (target_count == cpu_count - 1) {
+        // One ICR write reaches all of them, an extra IPI to a CPU
+        // that already had one pending finds its ring empty
+        apic_send_ipi(-1, INTR_CPU_CALL);
+    } else if (ipi_count) {
+        apic_send_ipi_multi(apic_ids, ipi_count, INTR_CPU_CALL);
+    }
+}
+
+void cpu_call_mask(thread_cpu_mask_t const& cpus,
+                   cpu_call_fn_t fn, void *arg, bool wait)
+{
+    cpu_scoped_irq_disable intr_was_enabled;
+    int self = thread_cpu_number();
+
+    // A waiting caller keeps the request on its stack
+    cpu_call_req_t stack_req;
+    cpu_call_req_t *req = wait ? &stack_req : cpu_call_claim(self);
+
+    req->fn = fn;
+    req->arg = arg;
+
+    cpu_call_queue(self, cpus, req, false);
+
+    if (cpus.test(self))
+        fn(arg);
+
+    if (wait) {
+        while (atomic_ld_acq(&req->refs))
+            cpu_call_poll(self);
     }
-    queued_work->next = nullptr;
 }
 
-void cpu_broadcast_message(int intr, size_t slot, int other_only,
-                           cpu_broadcast_handler_t handler,
-                           void *data, size_t size, int unique)
+thread_cpu_mask_t cpu_broadcast_message(
+        int other_only, cpu_broadcast_handler_t handler,
+        void const *data, size_t size, int unique)
 {
-    cpu_broadcast_work_t work;
-    work.handler = handler;
-    work.data = data;
-    work.intr = intr;
-    work.unique = unique;
-    thread_cls_for_each_cpu(slot, other_only,
-                            cpu_broadcast_add_work, &work, size);
+    assert(size <= CPU_BROADCAST_DATA_MAX);
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    int self = thread_cpu_number();
+    int cpu_count = thread_cpu_count();
+
+    thread_cpu_mask_t cpus;
+    thread_cpu_mask_t skipped;
+    for (int c = 0; c < cpu_count; ++c) {
+        if (other_only && c == self)
+            continue;
+
+        if (thread_cpu_is_isolated(c))
+            skipped.set(c);
+        else
+            cpus.set(c);
+    }
+
+    cpu_call_req_t *req = cpu_call_claim(self);
+
+    req->fn = handler;
+    req->arg = req->data;
+    memcpy(req->data, data, size);
+
+    cpu_call_queue(self, cpus, req, unique);
+
+    if (cpus.test(self))
+        handler(req->data);
+
+    return skipped;
 }
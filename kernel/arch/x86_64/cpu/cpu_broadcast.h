@@ -1,11 +1,37 @@
 #pragma once
 #include "types.h"
+#include "thread.h"
+
+// Largest broadcast message, it is copied into the shared request
+#define CPU_BROADCAST_DATA_MAX      48
+
+// Requests that can be queued for one CPU, a sender waits when full
+#define CPU_CALL_QUEUE_SIZE         64
+
+// Requests one CPU can have in flight without waiting for them
+#define CPU_CALL_POOL_SIZE          16
+
+typedef void (*cpu_call_fn_t)(void *arg);
 
 // Callback function pointer
-typedef void (*cpu_broadcast_handler_t)(void *);
+typedef cpu_call_fn_t cpu_broadcast_handler_t;
+
+void cpu_call_init(void);
+
+// Run fn(arg) on each CPU in the set, from its IPI handler with
+// interrupts disabled. The calling CPU runs it directly. All targets
+// share one request and are sent one IPI with the all-but-self
+// shorthand, or with as few logical destinations as the APIC allows.
+// If wait is false, returns after queueing it and arg must outlive
+// every target's call
+void cpu_call_mask(thread_cpu_mask_t const& cpus,
+                   cpu_call_fn_t fn, void *arg, bool wait);
 
-size_t cpu_broadcast_create(void);
-void cpu_broadcast_service(int intr, size_t slot);
-void cpu_broadcast_message(int intr, size_t slot, int other_only,
-                           cpu_broadcast_handler_t handler,
-                           void *data, size_t size, int unique);
+// Copy the data into one shared request and run the handler on it on
+// every CPU that is not isolated, without waiting. If unique, CPUs
+// that still have requests queued are skipped. Returns the isolated
+// CPUs that were left out, the caller must use cpu_call_mask if the
+// work has to reach them
+thread_cpu_mask_t cpu_broadcast_message(
+        int other_only, cpu_broadcast_handler_t handler,
+        void const *data, size_t size, int unique);
@@ -49,6 +49,7 @@ void cpuid_init(void)
 
     if (cpuid(&info, CPUID_INFO_EXT_FEATURES, 0)) {
         cpuid_cache.has_fsgsbase= info.ebx & (1U << 0);
+        cpuid_cache.has_tsc_adjust = info.ebx & (1U << 1);
         cpuid_cache.has_umip    = info.ecx & (1U << 2);
         cpuid_cache.has_smep    = info.ebx & (1U << 7);
         cpuid_cache.has_erms    = info.ebx & (1U << 9);
@@ -62,6 +62,7 @@ struct cpuid_cache_t {
     bool has_avx512f    :1;
     bool has_smap       :1;
     bool has_inrdtsc    :1;
+    bool has_tsc_adjust :1;
 
     uint16_t min_monitor_line;
     uint16_t max_monitor_line;
@@ -200,6 +201,12 @@ CPUID_CONST_INLINE bool cpuid_has_inrdtsc(void)
     return cpuid_cache.has_inrdtsc;
 }
 
+// IA32_TSC_ADJUST MSR
+CPUID_CONST_INLINE bool cpuid_has_tsc_adjust(void)
+{
+    return cpuid_cache.has_tsc_adjust;
+}
+
 // Avx-512 Foundation
 CPUID_CONST_INLINE bool cpuid_has_avx512f(void)
 {
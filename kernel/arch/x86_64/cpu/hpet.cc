@@ -0,0 +1,285 @@
+#include "hpet.h"
+#include "apic.h"
+#include "mm.h"
+#include "time.h"
+#include "errno.h"
+#include "assert.h"
+#include "likely.h"
+#include "printk.h"
+#include "inttypes.h"
+#include "cpu/atomic.h"
+#include "cpu/control_regs.h"
+
+#define DEBUG_HPET  0
+#if DEBUG_HPET
+#define HPET_TRACE(...) printdbg("hpet: " __VA_ARGS__)
+#else
+#define HPET_TRACE(...) ((void)0)
+#endif
+
+//
+// Registers, byte offsets, all 64 bits wide
+
+#define HPET_REG_CAP                0x000
+#define HPET_REG_CONFIG             0x010
+#define HPET_REG_INTR_STATUS        0x020
+#define HPET_REG_COUNTER            0x0F0
+#define HPET_REG_TMR_CONFIG(n)      (0x100 + 0x20 * (n))
+#define HPET_REG_TMR_CMP(n)         (0x108 + 0x20 * (n))
+#define HPET_REG_TMR_FSB(n)         (0x110 + 0x20 * (n))
+
+#define HPET_MMIO_SIZE              0x400
+
+// Capabilities
+#define HPET_CAP_PERIOD_FS_GET(n)   ((n) >> 32)
+#define HPET_CAP_NUM_TIMERS_GET(n)  ((((n) >> 8) & 0x1F) + 1)
+#define HPET_CAP_COUNT_64           (UINT64_C(1) << 13)
+
+// Largest period the specification allows, 100ns
+#define HPET_PERIOD_FS_MAX          UINT64_C(100000000)
+
+// General configuration
+#define HPET_CONFIG_ENABLE          (UINT64_C(1) << 0)
+#define HPET_CONFIG_LEGACY          (UINT64_C(1) << 1)
+
+// Timer configuration and capabilities
+#define HPET_TMR_LEVEL              (UINT64_C(1) << 1)
+#define HPET_TMR_INTR_ENABLE        (UINT64_C(1) << 2)
+#define HPET_TMR_PERIODIC           (UINT64_C(1) << 3)
+#define HPET_TMR_CMP_64             (UINT64_C(1) << 5)
+#define HPET_TMR_32BIT_MODE         (UINT64_C(1) << 8)
+#define HPET_TMR_FSB_ENABLE         (UINT64_C(1) << 14)
+#define HPET_TMR_FSB_CAP            (UINT64_C(1) << 15)
+
+#define HPET_TIMERS_MAX             32
+
+static uint64_t volatile *hpet_regs;
+
+// Nanoseconds per tick, 32.32 fixed point
+static uint64_t hpet_ns_mult;
+
+static uint64_t hpet_period_fs;
+
+// Added to the counter when the HPET is time_ns, so that taking over
+// from another clock does not move time backwards
+static uint64_t hpet_clock_base;
+static uint64_t hpet_counter_mask;
+static unsigned hpet_timer_count;
+
+// Bit set for each comparator handed out by hpet_timer_alloc
+static uint32_t volatile hpet_timers_used;
+
+static _always_inline uint64_t hpet_read(uint32_t reg)
+{
+    return hpet_regs[reg >> 3];
+}
+
+static _always_inline void hpet_write(uint32_t reg, uint64_t value)
+{
+    hpet_regs[reg >> 3] = value;
+}
+
+static _always_inline uint64_t hpet_ticks_to_ns(uint64_t ticks)
+{
+    return uint64_t((__uint128_t(ticks) * hpet_ns_mult) >> 32);
+}
+
+uint64_t hpet_time_ns()
+{
+    return hpet_ticks_to_ns(hpet_read(HPET_REG_COUNTER));
+}
+
+static uint64_t hpet_clock_ns()
+{
+    return hpet_time_ns() + hpet_clock_base;
+}
+
+// Works across a wrap of a 32 bit counter
+static uint64_t hpet_nsleep(uint64_t ns)
+{
+    uint64_t st = hpet_read(HPET_REG_COUNTER);
+    uint64_t elapsed_ns;
+
+    do {
+        pause();
+        uint64_t now = hpet_read(HPET_REG_COUNTER);
+        elapsed_ns = hpet_ticks_to_ns((now - st) & hpet_counter_mask);
+    } while (elapsed_ns < ns);
+
+    return elapsed_ns;
+}
+
+bool hpet_available()
+{
+    return hpet_regs != nullptr;
+}
+
+bool hpet_init(uint64_t phys_addr)
+{
+    // Only the first one is used
+    if (hpet_regs)
+        return true;
+
+    uint64_t volatile *regs = (uint64_t volatile *)mmap(
+                (void*)phys_addr, HPET_MMIO_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PHYSICAL | MAP_NOCACHE | MAP_WRITETHRU, -1, 0);
+
+    if (regs == MAP_FAILED)
+        return false;
+
+    uint64_t cap = regs[HPET_REG_CAP >> 3];
+    uint64_t period_fs = HPET_CAP_PERIOD_FS_GET(cap);
+
+    if (period_fs == 0 || period_fs > HPET_PERIOD_FS_MAX) {
+        HPET_TRACE("Invalid period %" PRIu64 "fs, not using HPET\n",
+                   period_fs);
+        munmap((void*)regs, HPET_MMIO_SIZE);
+        return false;
+    }
+
+    hpet_regs = regs;
+    hpet_period_fs = period_fs;
+    hpet_ns_mult = (period_fs << 32) / 1000000;
+    hpet_timer_count = HPET_CAP_NUM_TIMERS_GET(cap);
+    hpet_counter_mask = (cap & HPET_CAP_COUNT_64) ? ~UINT64_C(0) : 0xFFFFFFFF;
+
+    // Stop it to reset the counter, and leave legacy replacement
+    // routing off so the PIT and RTC keep their IRQs
+    uint64_t config = hpet_read(HPET_REG_CONFIG);
+    config &= ~(HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY);
+    hpet_write(HPET_REG_CONFIG, config);
+
+    for (unsigned i = 0; i < hpet_timer_count; ++i) {
+        uint64_t tmr = hpet_read(HPET_REG_TMR_CONFIG(i));
+        tmr &= ~(HPET_TMR_INTR_ENABLE | HPET_TMR_PERIODIC |
+                 HPET_TMR_FSB_ENABLE);
+        hpet_write(HPET_REG_TMR_CONFIG(i), tmr);
+    }
+
+    hpet_write(HPET_REG_COUNTER, 0);
+    hpet_write(HPET_REG_CONFIG, config | HPET_CONFIG_ENABLE);
+
+    HPET_TRACE("HPET at %#" PRIx64 ", %" PRIu64 "fs period, %u timers,"
+               " %d bit counter\n", phys_addr, period_fs,
+               hpet_timer_count, cap & HPET_CAP_COUNT_64 ? 64 : 32);
+
+    hpet_use_as_clock();
+
+    return true;
+}
+
+bool hpet_use_as_clock(uint64_t now_ns)
+{
+    if (!hpet_regs)
+        return false;
+
+    nsleep_set_handler(hpet_nsleep, nullptr, true);
+
+    // A 32 bit counter wraps too soon to be a clock
+    if (hpet_counter_mask != ~UINT64_C(0))
+        return false;
+
+    // Wraps when now_ns is behind the counter, the sum is still right
+    hpet_clock_base = now_ns - hpet_time_ns();
+    time_ns_set_handler(hpet_clock_ns, nullptr, true);
+
+    return true;
+}
+
+int hpet_timer_alloc(int cpu, intr_handler_t handler, char const *name)
+{
+    if (!hpet_regs)
+        return -int(errno_t::ENODEV);
+
+    for (unsigned i = 0; i < hpet_timer_count && i < HPET_TIMERS_MAX; ++i) {
+        uint64_t tmr = hpet_read(HPET_REG_TMR_CONFIG(i));
+
+        // Only timers that can send an MSI, no IOAPIC routing
+        if (!(tmr & HPET_TMR_FSB_CAP))
+            continue;
+
+        uint32_t bit = UINT32_C(1) << i;
+        uint32_t used = hpet_timers_used;
+        uint32_t seen;
+
+        while (!(used & bit) &&
+               (seen = atomic_cmpxchg(&hpet_timers_used,
+                                      used, used | bit)) != used)
+            used = seen;
+
+        // Someone else has it
+        if (used & bit)
+            continue;
+
+        msi_irq_mem_t msi;
+        if (!apic_msi_irq_alloc(&msi, 1, cpu, false, handler, name)) {
+            atomic_and(&hpet_timers_used, ~bit);
+            return -int(errno_t::ENOSPC);
+        }
+
+        hpet_write(HPET_REG_TMR_FSB(i),
+                   (msi.addr << 32) | uint32_t(msi.data));
+
+        // Edge triggered one-shot, full width comparator if it has one
+        tmr &= ~(HPET_TMR_LEVEL | HPET_TMR_PERIODIC |
+                 HPET_TMR_32BIT_MODE | HPET_TMR_INTR_ENABLE);
+        tmr |= HPET_TMR_FSB_ENABLE;
+        hpet_write(HPET_REG_TMR_CONFIG(i), tmr);
+
+        HPET_TRACE("Timer %u allocated for %s\n", i, name);
+
+        return i;
+    }
+
+    return -int(errno_t::EBUSY);
+}
+
+int hpet_timer_oneshot(int timer, uint64_t ns)
+{
+    assert(timer >= 0 && unsigned(timer) < hpet_timer_count);
+
+    // 128 bit product, ns * 1000000 overflows after about 5 hours
+    uint64_t ticks = uint64_t(__uint128_t(ns) * 1000000 / hpet_period_fs);
+    uint64_t tmr = hpet_read(HPET_REG_TMR_CONFIG(timer));
+
+    // Still armed from the last call, the old comparator value
+    // could match before the new one is written
+    if (tmr & HPET_TMR_INTR_ENABLE) {
+        tmr &= ~HPET_TMR_INTR_ENABLE;
+        hpet_write(HPET_REG_TMR_CONFIG(timer), tmr);
+    }
+
+    uint64_t now = hpet_read(HPET_REG_COUNTER);
+    uint64_t deadline = now + ticks;
+
+    if (!(tmr & HPET_TMR_CMP_64))
+        deadline = uint32_t(deadline);
+
+    hpet_write(HPET_REG_TMR_CMP(timer), deadline);
+    hpet_write(HPET_REG_TMR_CONFIG(timer), tmr | HPET_TMR_INTR_ENABLE);
+
+    // The comparator only matches on equality, if the counter passed
+    // it before the interrupt was enabled, it would not fire until
+    // the counter wraps. Reaching it after enabling fires normally
+    now = hpet_read(HPET_REG_COUNTER);
+
+    bool late = (tmr & HPET_TMR_CMP_64)
+            ? int64_t(now - deadline) > 0
+            : int32_t(uint32_t(now) - uint32_t(deadline)) > 0;
+
+    if (late) {
+        // Or the caller gets a spurious interrupt when it wraps
+        hpet_write(HPET_REG_TMR_CONFIG(timer), tmr);
+        return -int(errno_t::ETIME);
+    }
+
+    return 0;
+}
+
+void hpet_timer_cancel(int timer)
+{
+    assert(timer >= 0 && unsigned(timer) < hpet_timer_count);
+
+    uint64_t tmr = hpet_read(HPET_REG_TMR_CONFIG(timer));
+    hpet_write(HPET_REG_TMR_CONFIG(timer), tmr & ~HPET_TMR_INTR_ENABLE);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "types.h"
+#include "irq.h"
+
+// Map and start the HPET at the given physical address, and use it for
+// nsleep, and for time_ns if its main counter is 64 bits.
+// Returns false if there is no usable HPET there
+bool hpet_init(uint64_t phys_addr);
+
+bool hpet_available();
+
+// Use the HPET for nsleep, and for time_ns if its main counter is
+// 64 bits. time_ns continues from now_ns. Returns false if it is not
+// used for time_ns
+bool hpet_use_as_clock(uint64_t now_ns = 0);
+
+// Nanoseconds since the HPET was started, one MMIO read
+uint64_t hpet_time_ns();
+
+// Allocate a comparator that can deliver an MSI, as a one-shot event
+// timer that interrupts the given CPU. The handler is called with the
+// IRQ number. Returns the timer number, or a negative errno
+int hpet_timer_alloc(int cpu, intr_handler_t handler, char const *name);
+
+// Interrupt once, ns nanoseconds from now. Returns -ETIME, with the
+// timer disabled, if the counter passed the comparator before it was
+// armed. The handler can still run once if it passed just after
+int hpet_timer_oneshot(int timer, uint64_t ns);
+
+void hpet_timer_cancel(int timer);
@@ -33,6 +33,15 @@ static idt_unhandled_exception_handler_t unhandled_exception_handler_vec;
 uint32_t xsave_supported_states;
 uint32_t xsave_enabled_states;
 
+struct xsave_hdr_t {
+    uint64_t xstate_bv;
+    uint64_t xcomp_bv;
+};
+
+// Header for new save areas, valid when an xsave variant is in use
+static xsave_hdr_t xsave_initial_hdr;
+static bool xsave_initial_hdr_valid;
+
 static format_flag_info_t const cpu_eflags_info[] = {
     { "ID",   1,                    nullptr, CPU_EFLAGS_ID_BIT   },
     { "VIP",  1,                    nullptr, CPU_EFLAGS_VIP_BIT  },
@@ -279,6 +288,11 @@ void idt_xsave_detect(int ap)
                                uintptr_t(isr_restore_xrstors) -
                                uintptr_t(sse_context_restore),
                                sizeof(*sse_context_restore));
+
+                // xrstors requires the compacted format
+                xsave_initial_hdr.xcomp_bv = (uint64_t(1) << 63) |
+                        xsave_enabled_states;
+                xsave_initial_hdr_valid = true;
 			} else if (info.eax & (1 << 0)) {
 				// xsaveopt available
 
@@ -291,6 +305,7 @@ void idt_xsave_detect(int ap)
                                uintptr_t(isr_restore_xrstor) -
                                uintptr_t(sse_context_restore),
                                sizeof(*sse_context_restore));
+                xsave_initial_hdr_valid = true;
                 //printk("Using xsaveopt\n");
             } else if (info.eax & 2) {
                 // Patch jmp instruction
@@ -302,6 +317,7 @@ void idt_xsave_detect(int ap)
                                uintptr_t(isr_restore_xrstor) -
                                uintptr_t(sse_context_restore),
                                sizeof(*sse_context_restore));
+                xsave_initial_hdr_valid = true;
                 //printk("Using xsavec\n");
             }
         }
@@ -370,6 +386,32 @@ void idt_xsave_detect(int ap)
         sse_context_size = 512;
 }
 
+void idt_xsave_area_init(void *area)
+{
+    isr_fxsave_context_t *fpr = (isr_fxsave_context_t*)area;
+
+    fpr->mxcsr = (CPU_MXCSR_MASK_ALL |
+            CPU_MXCSR_RC_n(CPU_MXCSR_RC_NEAREST)) &
+            default_mxcsr_mask;
+    fpr->mxcsr_mask = default_mxcsr_mask;
+
+    // All FPU registers empty
+    fpr->fsw = CPU_FPUSW_TOP_n(7);
+
+    // 53 bit FPU precision
+    fpr->fcw = CPU_FPUCW_PC_n(CPU_FPUCW_PC_53) | CPU_FPUCW_IM |
+            CPU_FPUCW_DM | CPU_FPUCW_ZM | CPU_FPUCW_OM |
+            CPU_FPUCW_UM | CPU_FPUCW_PM;
+
+    if (xsave_initial_hdr_valid) {
+        // x87 and SSE state come from the legacy area,
+        // everything else starts in its initial configuration
+        xsave_hdr_t *hdr = (xsave_hdr_t*)((char*)area + 512);
+        hdr->xstate_bv = XCR0_X87 | XCR0_SSE;
+        hdr->xcomp_bv = xsave_initial_hdr.xcomp_bv;
+    }
+}
+
 isr_context_t *debug_exception_handler(int intr, isr_context_t *ctx)
 {
     assert(intr == INTR_EX_DEBUG);
@@ -442,11 +484,6 @@ size_t cpu_describe_fpusw(char *buf, size_t buf_size, uint16_t fpusw)
 }
 
 
-struct xsave_hdr_t {
-    uint64_t xstate_bv;
-    uint64_t xcomp_bv;
-};
-
 // NOTE: need separate get/set to handle modifying compact format in place
 static uint64_t const *cpu_get_fpr_reg(isr_context_t *ctx, uint8_t reg)
 {
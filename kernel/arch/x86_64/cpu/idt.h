@@ -53,6 +53,9 @@ extern "C" isr_context_t *debug_exception_handler(int intr, isr_context_t *ctx);
 
 extern "C" void idt_xsave_detect(int ap);
 
+// Prepare a newly allocated, zeroed FPU save area for its first restore
+void idt_xsave_area_init(void *area);
+
 extern "C" isr_context_t *unhandled_exception_handler(isr_context_t *ctx);
 
 void idt_set_unhandled_exception_handler(
@@ -42,10 +42,12 @@
 // 35-38 reserved
 #define INTR_APIC_TIMER     39
 
-#define INTR_TLB_SHOOTDOWN  40
+// Runs requests queued by cpu_call_mask, including TLB shootdowns
+#define INTR_CPU_CALL       40
 #define INTR_THREAD_YIELD   41
+#define INTR_THREAD_RESCHED 42
 
-// 42-47 reserved
+// 43-47 reserved
 
 // Vectors >= 48 go through apic_dispatcher codepath
 // 192 vectors for IOAPIC and MSI
@@ -0,0 +1,245 @@
+#include "irq_balance.h"
+#include "irq.h"
+#include "thread_impl.h"
+#include "apic.h"
+#include "callout.h"
+#include "mutex.h"
+#include "errno.h"
+#include "assert.h"
+#include "printk.h"
+#include "control_regs.h"
+#include "cpu/atomic.h"
+
+#define DEBUG_IRQ_BALANCE  0
+#if DEBUG_IRQ_BALANCE
+#define IRQ_BALANCE_TRACE(...) printdbg("irq_balance: " __VA_ARGS__)
+#else
+#define IRQ_BALANCE_TRACE(...) ((void)0)
+#endif
+
+irq_balance_cpu_t irq_balance_cpus[MAX_CPUS];
+
+struct irq_balance_irq_t {
+    // Set by irq_set_affinity, the balancer leaves it alone
+    int16_t pinned_cpu;
+    bool pinned;
+
+    // The IRQ stays on this CPU's package
+    bool has_consumer;
+    int16_t consumer_cpu;
+
+    // The interrupt controller could not route it, for example
+    // MSI timers that must fire on a specific CPU
+    bool immovable;
+};
+
+static irq_balance_irq_t irq_balance_irqs[IRQ_BALANCE_IRQ_COUNT];
+
+// Counts at the previous sample, only the balancer thread uses it
+static uint32_t irq_balance_prev[MAX_CPUS][IRQ_BALANCE_IRQ_COUNT];
+
+// Package ID of each CPU
+static uint32_t irq_balance_package[MAX_CPUS];
+
+using irq_balance_lock_type = mcslock;
+using irq_balance_scoped_lock = unique_lock<irq_balance_lock_type>;
+static irq_balance_lock_type irq_balance_lock;
+
+static bool irq_balance_cpu_usable(int cpu)
+{
+    return !thread_cpu_is_isolated(cpu);
+}
+
+// Least loaded usable CPU in package, other than exclude
+static int irq_balance_pick(uint32_t package, int exclude,
+                            uint64_t const *cpu_load, int cpu_count)
+{
+    int best = -1;
+
+    for (int c = 0; c < cpu_count; ++c) {
+        if (c == exclude || irq_balance_package[c] != package ||
+                !irq_balance_cpu_usable(c))
+            continue;
+
+        if (best < 0 || cpu_load[c] < cpu_load[best])
+            best = c;
+    }
+
+    return best;
+}
+
+static void irq_balance_run()
+{
+    int cpu_count = thread_cpu_count();
+
+    // Interrupts per interval, and the CPU taking most of them
+    uint32_t irq_rate[IRQ_BALANCE_IRQ_COUNT];
+    int16_t irq_cpu[IRQ_BALANCE_IRQ_COUNT];
+    uint64_t cpu_load[MAX_CPUS] = {};
+
+    for (int irq = 0; irq < IRQ_BALANCE_IRQ_COUNT; ++irq) {
+        uint32_t total = 0;
+        uint32_t most = 0;
+        int most_cpu = -1;
+
+        for (int c = 0; c < cpu_count; ++c) {
+            uint32_t now = atomic_ld_acq(&irq_balance_cpus[c].counts[irq]);
+            uint32_t delta = now - irq_balance_prev[c][irq];
+            irq_balance_prev[c][irq] = now;
+
+            total += delta;
+            cpu_load[c] += delta;
+
+            if (delta > most) {
+                most = delta;
+                most_cpu = c;
+            }
+        }
+
+        irq_rate[irq] = total;
+        irq_cpu[irq] = most_cpu;
+    }
+
+    irq_balance_scoped_lock lock(irq_balance_lock);
+
+    for (int irq = 0; irq < IRQ_BALANCE_IRQ_COUNT; ++irq) {
+        irq_balance_irq_t &state = irq_balance_irqs[irq];
+
+        // Until told otherwise, the driver put it near its consumer
+        if (!state.has_consumer && irq_cpu[irq] >= 0) {
+            state.consumer_cpu = irq_cpu[irq];
+            state.has_consumer = true;
+        }
+    }
+
+    for (int move = 0; move < IRQ_BALANCE_MAX_MOVES; ++move) {
+        int busy = -1;
+        for (int c = 0; c < cpu_count; ++c) {
+            if (busy < 0 || cpu_load[c] > cpu_load[busy])
+                busy = c;
+        }
+
+        if (busy < 0)
+            break;
+
+        // Its busiest IRQ that leaves the target less loaded than the
+        // busy CPU was, so the next interval cannot move it back
+        int best_irq = -1;
+        int best_target = -1;
+
+        for (int irq = 0; irq < IRQ_BALANCE_IRQ_COUNT; ++irq) {
+            irq_balance_irq_t const &state = irq_balance_irqs[irq];
+
+            if (irq_cpu[irq] != busy || state.immovable ||
+                    state.pinned || !state.has_consumer ||
+                    irq_rate[irq] < IRQ_BALANCE_MIN_RATE)
+                continue;
+
+            if (best_irq >= 0 && irq_rate[irq] <= irq_rate[best_irq])
+                continue;
+
+            int target = irq_balance_pick(
+                        irq_balance_package[state.consumer_cpu],
+                        busy, cpu_load, cpu_count);
+
+            if (target < 0 || cpu_load[target] + irq_rate[irq] >=
+                    cpu_load[busy])
+                continue;
+
+            best_irq = irq;
+            best_target = target;
+        }
+
+        if (best_irq < 0)
+            break;
+
+        if (!irq_setcpu(best_irq, best_target)) {
+            irq_balance_irqs[best_irq].immovable = true;
+            IRQ_BALANCE_TRACE("IRQ %d cannot be moved\n", best_irq);
+            continue;
+        }
+
+        IRQ_BALANCE_TRACE("IRQ %d, %u/interval, moved from CPU %d to %d\n",
+                          best_irq, irq_rate[best_irq], busy, best_target);
+
+        cpu_load[busy] -= irq_rate[best_irq];
+        cpu_load[best_target] += irq_rate[best_irq];
+        irq_cpu[best_irq] = best_target;
+    }
+}
+
+static int irq_balance_thread(void *)
+{
+    for (;;) {
+        thread_sleep_for(IRQ_BALANCE_INTERVAL_MS);
+        irq_balance_run();
+    }
+}
+
+int irq_set_affinity(int irq, int cpu)
+{
+    if (unsigned(irq) >= IRQ_BALANCE_IRQ_COUNT ||
+            cpu < -1 || cpu >= thread_cpu_count())
+        return -int(errno_t::EINVAL);
+
+    irq_balance_scoped_lock lock(irq_balance_lock);
+
+    if (cpu >= 0 && !irq_setcpu(irq, cpu))
+        return -int(errno_t::ENOTSUP);
+
+    irq_balance_irqs[irq].pinned_cpu = cpu;
+    irq_balance_irqs[irq].pinned = cpu >= 0;
+
+    return 0;
+}
+
+int irq_get_affinity(int irq)
+{
+    if (unsigned(irq) >= IRQ_BALANCE_IRQ_COUNT)
+        return -int(errno_t::EINVAL);
+
+    irq_balance_irq_t const &state = irq_balance_irqs[irq];
+
+    return state.pinned ? state.pinned_cpu : -1;
+}
+
+int irq_set_consumer(int irq, int cpu)
+{
+    if (unsigned(irq) >= IRQ_BALANCE_IRQ_COUNT ||
+            cpu < 0 || cpu >= thread_cpu_count())
+        return -int(errno_t::EINVAL);
+
+    irq_balance_scoped_lock lock(irq_balance_lock);
+
+    irq_balance_irqs[irq].consumer_cpu = cpu;
+    irq_balance_irqs[irq].has_consumer = true;
+
+    return 0;
+}
+
+uint32_t irq_get_count(int irq, int cpu)
+{
+    assert(unsigned(irq) < IRQ_BALANCE_IRQ_COUNT);
+    assert(unsigned(cpu) < MAX_CPUS);
+
+    return atomic_ld_acq(&irq_balance_cpus[cpu].counts[irq]);
+}
+
+static void irq_balance_start(void *)
+{
+    int cpu_count = thread_cpu_count();
+
+    if (cpu_count < 2)
+        return;
+
+    for (int c = 0; c < cpu_count; ++c)
+        irq_balance_package[c] = apic_cpu_package(c);
+
+    IRQ_BALANCE_TRACE("Balancing across %d CPUs\n", cpu_count);
+
+    thread_t tid = thread_create(irq_balance_thread, nullptr, 0, false);
+    thread_close(tid);
+}
+
+REGISTER_CALLOUT(irq_balance_start, nullptr,
+                 callout_type_t::smp_online, "060");
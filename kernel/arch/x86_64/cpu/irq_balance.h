@@ -0,0 +1,45 @@
+#pragma once
+#include "types.h"
+#include "interrupts.h"
+#include "thread.h"
+
+// Spreads device IRQ load across CPUs. Every interval it compares the
+// interrupts each CPU took and moves busy IRQs off the busiest CPU,
+// to the least loaded CPU in the same package as the IRQ's consumer
+#define IRQ_BALANCE_INTERVAL_MS     1000
+
+// IRQs slower than this per interval are left where they are
+#define IRQ_BALANCE_MIN_RATE        64
+
+// Most IRQs moved per interval
+#define IRQ_BALANCE_MAX_MOVES       4
+
+#define IRQ_BALANCE_IRQ_COUNT       (INTR_APIC_IRQ_END - INTR_APIC_IRQ_BASE)
+
+// Only the owning CPU writes its row
+struct alignas(64) irq_balance_cpu_t {
+    uint32_t counts[IRQ_BALANCE_IRQ_COUNT];
+};
+
+extern irq_balance_cpu_t irq_balance_cpus[MAX_CPUS];
+
+// Called by the dispatcher, with interrupts disabled
+static _always_inline void irq_balance_count(int cpu, int irq)
+{
+    ++irq_balance_cpus[cpu].counts[irq];
+}
+
+// Route the IRQ to cpu and stop balancing it. A cpu of -1 hands
+// it back to the balancer. Returns negative errno
+int irq_set_affinity(int irq, int cpu);
+
+// Returns the CPU the IRQ is pinned to, or -1 if it is balanced
+int irq_get_affinity(int irq);
+
+// The IRQ completes work for threads running on cpu, the balancer
+// keeps it on that CPU's package. Defaults to the CPU the IRQ was
+// first seen on
+int irq_set_consumer(int irq, int cpu);
+
+// Interrupts cpu has taken on the IRQ, wraps at 32 bits
+uint32_t irq_get_count(int irq, int cpu);
@@ -1,6 +1,8 @@
 #pragma once
 #include "types.h"
 
+struct thread_info_t;
+
 __BEGIN_DECLS
 
 #define ISR_CTX_REG_GPR_n(ctx, i)       ((ctx)->gpr.r.r[(i)])
@@ -464,7 +466,8 @@ extern void isr_entry_255(void);
 _noreturn
 void isr_sysret64(uintptr_t rip, uintptr_t rsp);
 
-void isr_save_fpu_ctx(isr_context_t *outgoing_ctx);
-void isr_restore_fpu_ctx(isr_context_t *incoming_ctx);
+// Save or restore the FPU state at the thread's xsave_ptr
+void isr_save_fpu_ctx(thread_info_t *outgoing);
+void isr_restore_fpu_ctx(thread_info_t *incoming);
 
 __END_DECLS
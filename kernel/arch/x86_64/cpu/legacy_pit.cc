@@ -210,11 +210,18 @@ void pit8253_init()
     nsleep_set_handler(pit8254_nsleep, nullptr, false);
 }
 
-void pit8254_enable()
+void pit8254_enable(bool override, uint64_t now_ns)
 {
-    if (!time_ns_set_handler(pit8254_time_ns, pit8254_time_ns_stop, false))
+    // Before it can be read through time_ns
+    if (override)
+        atomic_st_rel(&timer_ns, now_ns);
+
+    if (!time_ns_set_handler(pit8254_time_ns, pit8254_time_ns_stop, override))
         return;
 
+    if (override)
+        nsleep_set_handler(pit8254_nsleep, nullptr, true);
+
     PIT_TRACE("Starting PIT timer\n");
 
     pit8254_set_rate(20);
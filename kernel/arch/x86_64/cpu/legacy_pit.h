@@ -2,5 +2,7 @@
 #include "types.h"
 
 void pit8253_init();
-void pit8254_enable();
+// Start the PIT as the time_ns clock if nothing else is, or if override.
+// When overriding, time_ns continues from now_ns
+void pit8254_enable(bool override = false, uint64_t now_ns = 0);
 uint32_t pit8253_nsleep(uint16_t us);
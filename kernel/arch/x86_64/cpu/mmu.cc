@@ -25,6 +25,7 @@
 #include "main.h"
 #include "inttypes.h"
 #include "except.h"
+#include "rcu.h"
 
 // Allow G bit set in PDPT and PD in recursive page table mapping
 // This causes KVM to throw #PF(reserved_bit_set|present)
@@ -346,7 +347,18 @@ struct mmap_device_mapping_t {
 
 static int mm_dev_map_search(void const *v, void const *k, void *s);
 
-static vector<mmap_device_mapping_t*> mm_dev_mappings;
+// Sorted by address. Registering a device publishes a new copy, and
+// the old copy is freed after a grace period, so the page fault path
+// looks up mappings without taking any lock
+struct mm_dev_table_t {
+    rcu_head_t rcu;
+    size_t count;
+    mmap_device_mapping_t **items;
+};
+
+static mm_dev_table_t *mm_dev_table;
+
+// Serializes writers only
 using mm_dev_mapping_lock_type = mcslock;
 using mm_dev_mapping_scoped_lock = unique_lock<mm_dev_mapping_lock_type>;
 static mm_dev_mapping_lock_type mm_dev_mapping_lock;
@@ -1177,22 +1189,16 @@ static void mmu_tlb_perform_shootdown(void)
     thread_shootdown_notify();
 }
 
-// TLB shootdown IPI
-static isr_context_t *mmu_tlb_shootdown_handler(int intr, isr_context_t *ctx)
+// Runs on each target CPU from its cross-CPU call IPI
+static void mmu_tlb_shootdown_handler(void *)
 {
-    (void)intr;
-    assert(intr == INTR_TLB_SHOOTDOWN);
-
-    apic_eoi(intr);
-
     int cpu_number = thread_cpu_number();
 
-    // Clear pending
-    atomic_and(&shootdown_pending, ~(1 << cpu_number));
+    // Clear pending before flushing, a change made after this
+    // sends another shootdown
+    atomic_and(&shootdown_pending, ~(UINT64_C(1) << cpu_number));
 
     mmu_tlb_perform_shootdown();
-
-    return ctx;
 }
 
 static void mmu_send_tlb_shootdown(bool synchronous = false)
@@ -1203,53 +1209,39 @@ static void mmu_send_tlb_shootdown(bool synchronous = false)
 
     cpu_scoped_irq_disable irq_was_enabled;
     int cur_cpu = thread_cpu_number();
-    int all_cpu_mask = (1 << cpu_count) - 1;
-    int cur_cpu_mask = 1 << cur_cpu;
-    int other_cpu_mask = all_cpu_mask & ~cur_cpu_mask;
-    int old_pending = atomic_or(&shootdown_pending, other_cpu_mask);
-    int need_ipi_mask = old_pending & other_cpu_mask;
-
-    vector<uint64_t> shootdown_counts;
-    if (synchronous) {
-        shootdown_counts.reserve(thread_cpu_count());
-        for (int i = 0; i < cpu_count; ++i) {
-            shootdown_counts.push_back((i != cur_cpu)
-                                       ? thread_shootdown_count(i)
-                                       : -1);
-        }
-    }
+    uint64_t all_cpu_mask = (cpu_count < 64)
+            ? (UINT64_C(1) << cpu_count) - 1
+            : ~UINT64_C(0);
+    uint64_t other_cpu_mask = all_cpu_mask & ~(UINT64_C(1) << cur_cpu);
+
+    uint64_t old_pending = shootdown_pending;
+    while (!atomic_cmpxchg_upd(&shootdown_pending, &old_pending,
+                               old_pending | other_cpu_mask))
+        pause();
+
+    // A CPU that is still pending has not flushed yet, it will see
+    // this change. A synchronous shootdown waits for every CPU
+    uint64_t need_ipi_mask = synchronous
+            ? other_cpu_mask
+            : other_cpu_mask & ~old_pending;
+
+    if (!need_ipi_mask)
+        return;
 
-    if (other_cpu_mask) {
-        if (need_ipi_mask == other_cpu_mask) {
-            // Send to all other CPUs
-            apic_send_ipi(-1, INTR_TLB_SHOOTDOWN);
-        } else {
-            int cpu_mask = 1;
-            for (int cpu = 0; cpu < cpu_count; ++cpu, cpu_mask <<= 1) {
-                if (!(old_pending & cpu_mask) && (need_ipi_mask & cpu_mask))
-                    thread_send_ipi(cpu, INTR_TLB_SHOOTDOWN);
-            }
-        }
+    thread_cpu_mask_t targets;
+    for (int cpu = 0; cpu < cpu_count; ++cpu) {
+        if (need_ipi_mask & (UINT64_C(1) << cpu))
+            targets.set(cpu);
     }
 
+    uint64_t wait_st = synchronous ? nano_time() : 0;
+
+    cpu_call_mask(targets, mmu_tlb_shootdown_handler, nullptr, synchronous);
+
     if (unlikely(synchronous)) {
-        uint64_t wait_st = nano_time();
-        uint64_t loops = 0;
-        for (int wait_count = cpu_count - 1; wait_count > 0; pause()) {
-            for (int i = 0; i < cpu_count; ++i) {
-                uint64_t &count = shootdown_counts[i];
-                if (count != uint64_t(-1) &&
-                        thread_shootdown_count(i) > count) {
-                    count = -1;
-                    --wait_count;
-                }
-            }
-            ++loops;
-        }
         uint64_t wait_en = nano_time();
 
-        printdbg("TLB shootdown waited for "
-                 "%" PRIu64 "u loops, %" PRIu64 " cycles\n", loops,
+        printdbg("TLB shootdown waited %" PRIu64 " ns\n",
                  wait_en - wait_st);
     }
 }
@@ -1263,17 +1255,24 @@ static isr_context_t *mmu_lazy_tlb_shootdown(isr_context_t *ctx)
     return ctx;
 }
 
-static intptr_t mmu_device_from_addr(linaddr_t rounded_addr)
+// Mappings are never unregistered, the returned mapping
+// remains valid after the read side section
+static mmap_device_mapping_t *mmu_device_from_addr(linaddr_t rounded_addr)
 {
-    mm_dev_mapping_scoped_lock lock(mm_dev_mapping_lock);
+    rcu_scoped_read_lock lock;
+
+    mm_dev_table_t const *table = atomic_ld_acq(&mm_dev_table);
+
+    if (unlikely(!table))
+        return nullptr;
 
     intptr_t device = binary_search(
-                mm_dev_mappings.data(), mm_dev_mappings.size(),
-                sizeof(*mm_dev_mappings.data()),
+                table->items, table->count,
+                sizeof(*table->items),
                 (void*)rounded_addr,
                 mm_dev_map_search, nullptr, 1);
 
-    return device;
+    return device >= 0 ? table->items[device] : nullptr;
 }
 
 // Page fault
@@ -1352,12 +1351,11 @@ isr_context_t *mmu_page_fault_handler(int intr, isr_context_t *ctx)
             linaddr_t rounded_addr = fault_addr & -(intptr_t)PAGE_SIZE;
 
             // Lookup the device mapping
-            intptr_t device = mmu_device_from_addr(rounded_addr);
-            if (unlikely(device < 0))
+            mmap_device_mapping_t *mapping =
+                    mmu_device_from_addr(rounded_addr);
+            if (unlikely(!mapping))
                 return nullptr;
 
-            mmap_device_mapping_t *mapping = mm_dev_mappings[device];
-
             uint64_t mapping_offset = (char*)rounded_addr -
                     (char*)mapping->base_addr;
 
@@ -1500,10 +1498,10 @@ static void mmu_configure_pat(void)
 
 void mmu_init()
 {
-    TRACE_INIT("Hooking TLB shootdown\n");
+    TRACE_INIT("Hooking cross-CPU calls\n");
 
-    // Hook IPI for TLB shootdown
-    intr_hook(INTR_TLB_SHOOTDOWN, mmu_tlb_shootdown_handler, "sw_tlbshoot");
+    // TLB shootdowns are sent as cross-CPU calls
+    cpu_call_init();
 
     memcpy(phys_mem_map, kernel_params->phys_mem_table,
            sizeof(*phys_mem_map) * kernel_params->phys_mem_table_size);
@@ -2939,13 +2937,11 @@ int msync(void const *addr, size_t len, int flags)
     if (unlikely(len == 0))
         return 0;
 
-    intptr_t device = mmu_device_from_addr(rounded_addr);
+    mmap_device_mapping_t *mapping = mmu_device_from_addr(rounded_addr);
 
-    if (unlikely(device < 0))
+    if (unlikely(!mapping))
         return -int(errno_t::EFAULT);
 
-    mmap_device_mapping_t *mapping = mm_dev_mappings[device];
-
     unique_lock<mutex> lock(mapping->lock);
 
     while (mapping->active_read >= 0)
@@ -3148,13 +3144,22 @@ void *mmap_register_device(void *context,
 {
     mm_dev_mapping_scoped_lock lock(mm_dev_mapping_lock);
 
-    auto ins = find(mm_dev_mappings.begin(), mm_dev_mappings.end(), nullptr);
+    mm_dev_table_t *old_table = mm_dev_table;
+    size_t old_count = old_table ? old_table->count : 0;
+
+    // Copy the table with room for one more
+    mm_dev_table_t *table = (mm_dev_table_t*)malloc(
+                sizeof(*table) + (old_count + 1) * sizeof(*table->items));
+
+    if (unlikely(!table))
+        return nullptr;
+
+    table->count = old_count + 1;
+    table->items = (mmap_device_mapping_t**)(table + 1);
 
     mmap_device_mapping_t *mapping = new mmap_device_mapping_t{};
     mapping->base_addr = mmap(addr, block_size * block_count,
-                              prot, MAP_DEVICE,
-                              int(ins - mm_dev_mappings.begin()),
-                              0);
+                              prot, MAP_DEVICE, int(old_count), 0);
 
     mapping->context = context;
     mapping->len = block_size * block_count;
@@ -3162,12 +3167,32 @@ void *mmap_register_device(void *context,
 
     mapping->active_read = -1;
 
-    if (ins == mm_dev_mappings.end())
-        mm_dev_mappings.push_back(mapping);
-    else
-        *ins = mapping;
+    // Insert it in address order, lookups binary search the table
+    size_t index = 0;
+    while (index < old_count &&
+           old_table->items[index]->base_addr < mapping->base_addr)
+        ++index;
+
+    if (index)
+        memcpy(table->items, old_table->items,
+               index * sizeof(*table->items));
+
+    table->items[index] = mapping;
+
+    if (index < old_count)
+        memcpy(table->items + index + 1, old_table->items + index,
+               (old_count - index) * sizeof(*table->items));
 
-    return likely(mapping) ? mapping->base_addr : nullptr;
+    // Fully initialized before readers can see it
+    atomic_st_rel(&mm_dev_table, table);
+
+    if (old_table) {
+        call_rcu(&old_table->rcu, [](rcu_head_t *head) {
+            free(head);
+        });
+    }
+
+    return mapping->base_addr;
 }
 
 static int mm_dev_map_search(void const *v, void const *k, void *s)
@@ -3456,6 +3481,36 @@ int alias_window(void *addr, size_t size,
     return 1;
 }
 
+bool mmap_phys_user(void *addr, uintptr_t physaddr, size_t len, int prot)
+{
+    linaddr_t linear_addr = linaddr_t(addr);
+
+    assert(!(linear_addr & PAGE_MASK) && !(physaddr & PAGE_MASK));
+
+    len = round_up(len);
+
+    if (unlikely(linear_addr >= 0x7FFFFFFFF000 ||
+                 linear_addr + len > 0x7FFFFFFFF000))
+        return false;
+
+    contiguous_allocator_t *allocator = (contiguous_allocator_t*)
+            thread_current_process()->get_allocator();
+
+    if (unlikely(!allocator->take_linear(linear_addr, len, true)))
+        return false;
+
+    pte_t page_flags = PTE_PRESENT | PTE_USER | PTE_EX_PHYSICAL;
+    page_flags |= zero_if_false(prot & PROT_WRITE, PTE_WRITABLE);
+    page_flags |= zero_if_false(!(prot & PROT_EXEC), PTE_NX & cpuid_nx_mask);
+
+    pte_t *base_pte = mm_create_pagetables_aligned(linear_addr, len);
+
+    for (size_t ofs = 0; ofs < len; ofs += PAGE_SIZE)
+        base_pte[ofs >> PAGE_SCALE] = (physaddr + ofs) | page_flags;
+
+    return true;
+}
+
 int mlock(const void *addr, size_t len)
 {
     linaddr_t staddr = linaddr_t(addr);
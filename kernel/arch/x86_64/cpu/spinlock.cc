@@ -4,6 +4,7 @@
 #include "control_regs.h"
 #include "thread.h"
 #include "printk.h"
+#include "lockstat.h"
 
 #define DEBUG_MCSLOCK 0
 #if DEBUG_MCSLOCK
@@ -19,16 +20,22 @@
 spinlock_value_t spinlock_unlock_save(spinlock_t *lock)
 {
     assert(atomic_ld_acq(lock) & 1);
+    LOCKSTAT_RELEASED(lock);
     return atomic_xchg(lock, 0);
 }
 
 void spinlock_lock_restore(spinlock_t *lock, spinlock_value_t saved_lock)
 {
+    LOCKSTAT_WAIT(spinlock);
+
     for (;;) {
         if (atomic_ld_acq(lock) == 0 &&
-                atomic_cmpxchg(lock, 0, saved_lock) == 0)
+                atomic_cmpxchg(lock, 0, saved_lock) == 0) {
+            LOCKSTAT_ACQUIRED(lock);
             return;
+        }
 
+        LOCKSTAT_CONTENDED();
         cpu_wait_value(lock, 0);
     }
 }
@@ -36,23 +43,31 @@ void spinlock_lock_restore(spinlock_t *lock, spinlock_value_t saved_lock)
 // Spin to acquire lock, return with IRQs disabled
 void spinlock_lock(spinlock_t *lock)
 {
+    LOCKSTAT_WAIT(spinlock);
+
     if (cpu_irq_is_enabled()) {
         for (;;) {
             // Test and test and set
             if (atomic_ld_acq(lock) == 0) {
                 // Make sure we can't get preempted while holding the lock
                 cpu_irq_disable();
-                if (atomic_cmpxchg(lock, 0, 3) == 0)
+                if (atomic_cmpxchg(lock, 0, 3) == 0) {
+                    LOCKSTAT_ACQUIRED(lock);
                     return;
+                }
                 cpu_irq_enable();
             }
 
+            LOCKSTAT_CONTENDED();
             cpu_wait_value(lock, 0);
         }
     } else {
-        while (atomic_ld_acq(lock) != 0 || atomic_cmpxchg(lock, 0, 1) != 0)
+        while (atomic_ld_acq(lock) != 0 || atomic_cmpxchg(lock, 0, 1) != 0) {
+            LOCKSTAT_CONTENDED();
             cpu_wait_value(lock, 0);
+        }
 
+        LOCKSTAT_ACQUIRED(lock);
     }
 }
 
@@ -60,6 +75,8 @@ void spinlock_lock(spinlock_t *lock)
 // Returns 0 with interrupts preserved if lock was not acquired
 bool spinlock_try_lock(spinlock_t *lock)
 {
+    LOCKSTAT_WAIT(spinlock);
+
     int intr_enabled = cpu_irq_save_disable() << 1;
 
     if (*lock != 0 || atomic_cmpxchg(lock, 0, 1 | intr_enabled) != 0) {
@@ -68,11 +85,13 @@ bool spinlock_try_lock(spinlock_t *lock)
         return false;
     }
 
+    LOCKSTAT_ACQUIRED(lock);
     return true;
 }
 
 void spinlock_unlock(spinlock_t *lock)
 {
+    LOCKSTAT_RELEASED(lock);
     bool intr_enabled = *lock & 2;
     assert(*lock & 1);
     atomic_st_rel(lock, 0);
@@ -215,6 +234,8 @@ bool rwspinlock_sh_try_lock(rwspinlock_t *lock)
 
 void ticketlock_lock(ticketlock_t *lock)
 {
+    LOCKSTAT_WAIT(ticketlock);
+
     ticketlock_value_t intr_enabled = cpu_irq_save_disable();
 
     ticketlock_value_t my_ticket = atomic_xadd(&lock->next_ticket, 2);
@@ -225,15 +246,19 @@ void ticketlock_lock(ticketlock_t *lock)
         if (likely(my_ticket == (serving & -2))) {
             // Store the interrupt flag in bit 0
             atomic_st_rel(&lock->now_serving, (serving & -2) | intr_enabled);
+            LOCKSTAT_ACQUIRED(lock);
             return;
         }
 
+        LOCKSTAT_CONTENDED();
         cpu_wait_value(&lock->now_serving, my_ticket);
     }
 }
 
 void ticketlock_lock_restore(ticketlock_t *lock, ticketlock_value_t saved_lock)
 {
+    LOCKSTAT_WAIT(ticketlock);
+
     ticketlock_value_t my_ticket = atomic_xadd(&lock->next_ticket, 2);
 
     for (;;) {
@@ -242,15 +267,19 @@ void ticketlock_lock_restore(ticketlock_t *lock, ticketlock_value_t saved_lock)
         if (likely(my_ticket == (serving & -2))) {
             // Store the interrupt flag in bit 0
             atomic_st_rel(&lock->now_serving, (serving & -2) | saved_lock);
+            LOCKSTAT_ACQUIRED(lock);
             return;
         }
 
+        LOCKSTAT_CONTENDED();
         cpu_wait_value(&lock->now_serving, my_ticket);
     }
 }
 
 bool ticketlock_try_lock(ticketlock_t *lock)
 {
+    LOCKSTAT_WAIT(ticketlock);
+
     ticketlock_value_t intr_enabled = cpu_irq_save_disable();
 
     ticketlock_value_t old_next = lock->next_ticket;
@@ -266,6 +295,7 @@ bool ticketlock_try_lock(ticketlock_t *lock)
             atomic_st_rel(&lock->now_serving,
                           (serving & -2) | intr_enabled);
 
+            LOCKSTAT_ACQUIRED(lock);
             return true;
         }
 
@@ -279,6 +309,7 @@ bool ticketlock_try_lock(ticketlock_t *lock)
 
 void ticketlock_unlock(ticketlock_t *lock)
 {
+    LOCKSTAT_RELEASED(lock);
     ticketlock_value_t serving = lock->now_serving;
     lock->now_serving = (serving + 2) & -2;
     cpu_irq_toggle(serving & 1);
@@ -286,6 +317,7 @@ void ticketlock_unlock(ticketlock_t *lock)
 
 ticketlock_value_t ticketlock_unlock_save(ticketlock_t *lock)
 {
+    LOCKSTAT_RELEASED(lock);
     ticketlock_value_t intr_state = lock->now_serving & 1;
     ticketlock_value_t serving = lock->now_serving;
     lock->now_serving = (serving + 2) & -2;
@@ -294,20 +326,24 @@ ticketlock_value_t ticketlock_unlock_save(ticketlock_t *lock)
 
 bool mcslock_try_lock(mcs_queue_ent_t * volatile*lock, mcs_queue_ent_t *node)
 {
+    LOCKSTAT_WAIT(mcslock);
+
     node->irq_enabled = cpu_irq_save_disable();
 
     atomic_st_rel(&node->next, nullptr);
 
-    if (atomic_cmpxchg(lock, nullptr, node) == nullptr)
+    if (atomic_cmpxchg(lock, nullptr, node) == nullptr) {
+        LOCKSTAT_ACQUIRED(lock);
         return true;
+    }
 
     cpu_irq_toggle(node->irq_enabled);
     return false;
 }
 
-// Lock mcslock without restoring/disabling interrupts
-void mcslock_lock_nodis(mcs_queue_ent_t * volatile *lock,
-                          mcs_queue_ent_t *node)
+// Returns true if it had to wait for a predecessor
+static _always_inline bool mcslock_acquire(mcs_queue_ent_t * volatile *lock,
+                                           mcs_queue_ent_t *node)
 {
     node->next = nullptr;
 
@@ -325,7 +361,23 @@ void mcslock_lock_nodis(mcs_queue_ent_t * volatile *lock,
 
         // The predecessor will set locked to false when they unlock it
         cpu_wait_value(&node->locked, false);
+
+        return true;
     }
+
+    return false;
+}
+
+// Lock mcslock without restoring/disabling interrupts
+void mcslock_lock_nodis(mcs_queue_ent_t * volatile *lock,
+                          mcs_queue_ent_t *node)
+{
+    LOCKSTAT_WAIT(mcslock);
+
+    if (mcslock_acquire(lock, node))
+        LOCKSTAT_CONTENDED();
+
+    LOCKSTAT_ACQUIRED(lock);
 }
 
 void mcslock_lock(mcs_queue_ent_t * volatile *lock, mcs_queue_ent_t *node)
@@ -333,15 +385,28 @@ void mcslock_lock(mcs_queue_ent_t * volatile *lock, mcs_queue_ent_t *node)
     MCSLOCK_TRACE("Acquiring lock @ %p threadid=%d\n",
                   (void*)lock, thread_get_id());
 
+    LOCKSTAT_WAIT(mcslock);
+
     node->thread_id = thread_get_id();
     node->irq_enabled = cpu_irq_save_disable();
+
+#if ENABLE_LOCKSTAT
+    // Not a tail call, so the caller is recorded as the call site
+    if (mcslock_acquire(lock, node))
+        LOCKSTAT_CONTENDED();
+
+    LOCKSTAT_ACQUIRED(lock);
+#else
     mcslock_lock_nodis(lock, node);
+#endif
 }
 
 // Unlock mcslock without saving+enabling interrupts
 void mcslock_unlock_noena(mcs_queue_ent_t * volatile *lock,
                          mcs_queue_ent_t *node)
 {
+    LOCKSTAT_RELEASED(lock);
+
     if (!atomic_ld_acq(&node->next)) {
         // no known successor
 
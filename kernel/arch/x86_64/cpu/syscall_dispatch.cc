@@ -7,6 +7,8 @@
 #include "syscall/sys_fd.h"
 #include "syscall/sys_mem.h"
 #include "syscall/sys_time.h"
+#include "syscall/sys_futex.h"
+#include "syscall/sys_sched.h"
 #include "syscall/sys_process.h"
 
 long sys_unimplemented()
@@ -111,7 +113,7 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_fchown,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_lchown,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_umask,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_gettimeofday,
+    (syscall_handler_t*)(void*)sys_gettimeofday,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_getrlimit,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_getrusage,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sysinfo,
@@ -159,10 +161,10 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_setpriority,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_setparam,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_getparam,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_setscheduler,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_getscheduler,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_get_priority_max,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_get_priority_min,
+    (syscall_handler_t*)(void*)sys_sched_setscheduler,
+    (syscall_handler_t*)(void*)sys_sched_getscheduler,
+    (syscall_handler_t*)(void*)sys_sched_get_priority_max,
+    (syscall_handler_t*)(void*)sys_sched_get_priority_min,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_rr_get_interval,
     (syscall_handler_t*)(void*)sys_mlock,
     (syscall_handler_t*)(void*)sys_munlock,
@@ -217,7 +219,7 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_fremovexattr,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_tkill,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_time,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_futex,
+    (syscall_handler_t*)(void*)sys_futex,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_setaffinity,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_getaffinity,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_set_thread_area,
@@ -243,7 +245,7 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_timer_getoverrun,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_timer_delete,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_clock_settime,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_clock_gettime,
+    (syscall_handler_t*)(void*)sys_clock_gettime,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_clock_getres,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_clock_nanosleep,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_exit_group,
@@ -21,6 +21,10 @@
 #include "callout.h"
 #include "vector.h"
 #include "mutex.h"
+#include "bitsearch.h"
+#include "idt.h"
+#include "inttypes.h"
+#include "rcu.h"
 
 // Implements platform independent thread.h
 
@@ -77,20 +81,21 @@ struct alignas(256) thread_info_t {
     isr_context_t * volatile ctx;
 
     char * volatile xsave_ptr;
-    uint64_t volatile cpu_affinity;
+    uint64_t volatile wake_time;
 
     void * volatile fsbase;
     void * volatile gsbase;
 
     char * volatile syscall_stack;
 
-    uint64_t volatile wake_time;
-
     // Higher numbers are higher priority
     thread_priority_t volatile priority;
     thread_priority_t volatile priority_boost;
     thread_state_t volatile state;
 
+    // One reference held by the running thread, one by the creator
+    int volatile ref_count;
+
     // --- cache line ---
     char *xsave_stack;
 
@@ -122,6 +127,44 @@ struct alignas(256) thread_info_t {
     uint64_t sched_timestamp;
 
     int thread_id;
+
+    // CPU that most recently loaded this thread's FPU state, or -1
+    int fpu_cpu;
+
+    thread_cpu_mask_t cpu_affinity;
+
+    // TSC when the thread last became ready, and when it was last
+    // switched in, for the scheduler latency histograms
+    uint64_t volatile ready_timestamp;
+    uint64_t run_timestamp;
+
+    // CPU the thread most recently ran on, or -1
+    int last_cpu;
+
+    // CPU a woken thread was placed on, other CPUs leave it
+    // alone for a short while. -1 if any CPU may take it
+    int volatile wake_cpu;
+
+    // Scheduling class, one of SCHED_*
+    int volatile sched_policy;
+
+    // SCHED_FIFO and SCHED_RR priority, higher runs first
+    int volatile rt_priority;
+
+    // SCHED_DEADLINE parameters and state, in time_ns units
+    uint64_t dl_runtime;
+    uint64_t dl_deadline;
+    uint64_t dl_period;
+    uint64_t volatile dl_abs_deadline;
+    int64_t volatile dl_budget;
+    uint64_t dl_run_start;
+
+    // Decaying sums of TSC cycles spent running and sleeping
+    uint64_t interact_run;
+    uint64_t interact_sleep;
+
+    // TSC when the thread blocked, 0 if it is not blocked
+    uint64_t volatile block_timestamp;
 };
 
 C_ASSERT_ISPO2(sizeof(thread_info_t));
@@ -139,10 +182,33 @@ C_ASSERT(offsetof(thread_info_t, thread_id) == THREAD_THREAD_ID_OFS);
 
 #define THREAD_FLAGS_USES_FPU   (1U<<0)
 
-// Store in a big array, for now
-#define MAX_THREADS 512
-static thread_info_t threads[MAX_THREADS];
+// Thread records are allocated in chunks on demand, and found
+// through a two level table indexed by thread id
+#define MAX_THREADS         (1 << 16)
+#define THREAD_CHUNK_LOG2   6
+#define THREAD_CHUNK_SIZE   (1 << THREAD_CHUNK_LOG2)
+#define THREAD_CHUNK_COUNT  (MAX_THREADS >> THREAD_CHUNK_LOG2)
+
+// The idle threads live in the statically allocated first chunk
+C_ASSERT(THREAD_CHUNK_SIZE >= MAX_CPUS);
+
+static thread_info_t thread_boot_chunk[THREAD_CHUNK_SIZE];
+static thread_info_t * volatile thread_chunks[THREAD_CHUNK_COUNT] = {
+    thread_boot_chunk
+};
+
+// One past the highest thread id ever allocated
 static size_t volatile thread_count;
+
+// Two level bitmap of allocated thread ids. A set bit in the top
+// level indicates that the corresponding second level word is full
+static uint64_t thread_tid_top[MAX_THREADS >> 12];
+static uint64_t thread_tid_map[MAX_THREADS >> 6];
+
+using thread_tid_lock_type = spinlock;
+using thread_tid_scoped_lock = unique_lock<thread_tid_lock_type>;
+static thread_tid_lock_type thread_tid_lock;
+
 uint32_t volatile thread_smp_running;
 int thread_idle_ready;
 int spincount_mask;
@@ -150,7 +216,40 @@ size_t storage_next_slot;
 bool thread_cls_ready;
 
 static size_t constexpr syscall_stack_size = (size_t(8) << 10);
-static size_t constexpr xsave_stack_size = (size_t(64) << 10);
+
+// The stacks of a thread, each pointer points to the end of the stack.
+// The syscall and xsave stacks are null for kernel threads
+struct thread_stacks_t {
+    char *stack;
+    char *syscall_stack;
+    char *xsave_stack;
+    size_t stack_size;
+};
+
+// Per-CPU cache of the stacks of released threads, so creating a
+// thread usually does not map anything. Only accessed by the owning
+// CPU with interrupts disabled
+#define THREAD_STACK_CACHE_SIZE 16
+
+struct alignas(64) thread_stack_cache_t {
+    thread_stacks_t entries[THREAD_STACK_CACHE_SIZE];
+    size_t count;
+};
+
+static thread_stack_cache_t thread_stack_caches[MAX_CPUS];
+
+// Stacks that did not fit in a cache are unmapped by the reaper thread,
+// never on the context switch path. The list node is stored at the
+// top of the kernel stack it describes
+struct thread_reap_t {
+    thread_reap_t *next;
+    thread_stacks_t stacks;
+};
+
+static spinlock_t thread_reap_lock;
+static thread_reap_t *thread_reap_list;
+static thread_t thread_reap_tid;
+static bool thread_reap_sleeping;
 
 struct alignas(128) cpu_info_t {
     cpu_info_t *self;
@@ -174,6 +273,18 @@ struct alignas(128) cpu_info_t {
 
     lock_type queue_lock;
 
+    // Thread whose FPU state was most recently loaded on this CPU
+    thread_info_t *fpu_owner;
+
+    // CR0.TS is set, the next FPU instruction raises #NM
+    bool fpu_trap;
+
+    // Only runs threads whose affinity is confined to isolated CPUs
+    bool isolated;
+
+    // The timer tick is stopped while a single thread can run here
+    bool tickless;
+
     void *storage[8];
 };
 C_ASSERT_ISPO2(sizeof(cpu_info_t));
@@ -183,9 +294,72 @@ C_ASSERT(offsetof(cpu_info_t, self) == CPU_INFO_SELF_OFS);
 C_ASSERT(offsetof(cpu_info_t, cur_thread) == CPU_INFO_CURTHREAD_OFS);
 C_ASSERT(offsetof(cpu_info_t, tss_ptr) == CPU_INFO_TSS_PTR_OFS);
 
+// Per-CPU scheduler histograms, bucket 0 counts zero and bucket n
+// counts durations of [2^(n-1), 2^n) TSC cycles, up to n = 64
+#define THREAD_SCHED_HIST_BUCKETS   65
+
+struct alignas(64) thread_sched_stats_t {
+    // Ready to running
+    uint64_t wake_latency[THREAD_SCHED_HIST_BUCKETS];
+
+    // Switched in to switched out
+    uint64_t slice_length[THREAD_SCHED_HIST_BUCKETS];
+
+    // Slice length of threads that were switched out while runnable
+    uint64_t preempt_slice[THREAD_SCHED_HIST_BUCKETS];
+
+    uint64_t switch_count;
+    uint64_t involuntary_count;
+
+    // Switched in a thread that last ran on another CPU
+    uint64_t migration_count;
+};
+
+static thread_sched_stats_t thread_sched_stats[MAX_CPUS];
+
+// A woken thread is left for the CPU it was placed on for this many
+// TSC cycles, after that any CPU may take it
+#define THREAD_WAKE_AFFINE_CYCLES       (UINT64_C(1) << 20)
+
+// Busier CPUs than this are not considered for cache affine wakeup
+#define THREAD_WAKE_AFFINE_BUSY_PERCENT 50
+
+// Once the run and sleep history of a thread adds up to more than
+// this many TSC cycles, both are halved
+#define THREAD_INTERACT_WINDOW          (UINT64_C(1) << 30)
+
+// Normal threads that mostly sleep are boosted by up to this much,
+// threads that mostly run are lowered by up to this much
+#define THREAD_INTERACT_BOOST_MAX       8
+
+// Sum of runtime/period of all SCHED_DEADLINE threads, in units of
+// 1/THREAD_DL_UNIT of one CPU. Admission keeps it below
+// THREAD_DL_LIMIT_PERCENT of all CPUs, so normal threads still run
+#define THREAD_DL_UNIT          (UINT64_C(1) << 20)
+#define THREAD_DL_LIMIT_PERCENT 95
+
+using thread_dl_lock_type = spinlock;
+using thread_dl_scoped_lock = unique_lock<thread_dl_lock_type>;
+static thread_dl_lock_type thread_dl_lock;
+static uint64_t thread_dl_bandwidth;
+
+// runtime * THREAD_DL_UNIT / period, runtime may use all 64 bits
+static _always_inline uint64_t thread_dl_share(
+        uint64_t runtime, uint64_t period)
+{
+    return uint64_t((__uint128_t(runtime) * THREAD_DL_UNIT) / period);
+}
+
+// Isolated CPUs, see thread_set_isolated
+using thread_isolation_lock_type = spinlock;
+using thread_isolation_scoped_lock = unique_lock<thread_isolation_lock_type>;
+static thread_isolation_lock_type thread_isolation_lock;
+static thread_cpu_mask_t thread_isolated_cpus;
+static bool volatile thread_isolation_active;
+
 static cpu_info_t cpus[MAX_CPUS] = {
-    { cpus, threads, tss_list, 0, 0, nullptr, 0, 0, 0, 0, 0, 0, {},
-      { }
+    { cpus, thread_boot_chunk, tss_list, 0, 0, nullptr, 0, 0, 0, 0, 0, 0, {},
+      nullptr, false, false, false, { }
     }
 };
 
@@ -217,6 +391,11 @@ private:
 static uint32_t get_apic_id()
 {
     cpuid_t cpuid_info;
+
+    // The topology leaf has the full 32 bit x2APIC ID
+    if (cpuid(&cpuid_info, CPUID_TOPOLOGY2, 0) && cpuid_info.ebx != 0)
+        return cpuid_info.edx;
+
     cpuid(&cpuid_info, CPUID_INFO_FEATURES, 0);
     uint32_t apic_id = cpuid_info.ebx >> 24;
     return apic_id;
@@ -232,6 +411,196 @@ static _always_inline thread_info_t *this_thread()
     return (thread_info_t*)cpu_gs_read_ptr<offsetof(cpu_info_t, cur_thread)>();
 }
 
+static _always_inline void thread_sched_hist_add(uint64_t *hist,
+                                                 uint64_t cycles)
+{
+    // Bucket 0 holds zero, bucket n holds [2^(n-1), 2^n)
+    hist[cycles ? bit_msb_set(cycles) + 1 : 0] += 1;
+}
+
+// Stamp the time the thread became ready, before it can be seen as ready
+static _always_inline void thread_ready_stamp(thread_info_t *thread)
+{
+    thread->ready_timestamp = cpu_rdtsc();
+}
+
+// Scheduling rank, the ready thread with the highest rank runs.
+// Deadline threads outrank fixed priority real time threads, which
+// outrank every normal thread
+static _always_inline uint64_t thread_sched_rank(thread_info_t const *thread)
+{
+    switch (thread->sched_policy) {
+    case SCHED_DEADLINE:
+        // Earliest deadline first
+        return (UINT64_C(2) << 62) | (~thread->dl_abs_deadline >> 2);
+
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return (UINT64_C(1) << 62) | uint64_t(thread->rt_priority);
+
+    default:
+        return uint64_t(int32_t(thread->priority) +
+                        thread->priority_boost + 65536);
+    }
+}
+
+static _always_inline thread_priority_t thread_interact_boost(
+        uint64_t run, uint64_t sleep)
+{
+    uint64_t total = run + sleep;
+
+    if (unlikely(!total))
+        return 0;
+
+    return thread_priority_t((int64_t(sleep) - int64_t(run)) *
+                             THREAD_INTERACT_BOOST_MAX / int64_t(total));
+}
+
+static void thread_interact_decay(thread_info_t *thread)
+{
+    while (thread->interact_run + thread->interact_sleep >
+           THREAD_INTERACT_WINDOW) {
+        thread->interact_run >>= 1;
+        thread->interact_sleep >>= 1;
+    }
+}
+
+// Boost a thread that is becoming ready, counting the sleep that is
+// just ending. The history itself is only updated by the CPU running
+// the thread, when it switches the thread in
+static void thread_interact_wake(thread_info_t *thread)
+{
+    uint64_t blocked = thread->block_timestamp;
+    uint64_t ready = thread->ready_timestamp;
+    uint64_t slept = blocked && ready > blocked ? ready - blocked : 0;
+
+    thread->priority_boost = thread_interact_boost(
+                thread->interact_run, thread->interact_sleep + slept);
+}
+
+// FIFO and deadline threads keep the CPU until they block or
+// something with a higher rank becomes ready
+static _always_inline bool thread_sched_round_robin(
+        thread_info_t const *thread)
+{
+    int policy = thread->sched_policy;
+    return policy != SCHED_FIFO && policy != SCHED_DEADLINE;
+}
+
+// Constant bandwidth server wakeup rule: a deadline thread waking
+// after its deadline passed gets a new deadline and a full budget
+static void thread_dl_wakeup(thread_info_t *thread, uint64_t now)
+{
+    if (now >= thread->dl_abs_deadline) {
+        thread->dl_abs_deadline = now + thread->dl_deadline;
+        thread->dl_budget = thread->dl_runtime;
+    }
+}
+
+// A real time or boosted interactive thread that became ready
+// preempts the lowest ranked thread it outranks, by sending a
+// reschedule IPI to its CPU
+static void thread_rt_preempt(thread_info_t *thread)
+{
+    if ((likely(thread->sched_policy == SCHED_OTHER) &&
+         thread->priority_boost <= 0) || !thread_idle_ready)
+        return;
+
+    uint64_t target_rank = thread_sched_rank(thread);
+    int target = -1;
+
+    for (size_t c = 0; c < cpu_count; ++c) {
+        if (!thread->cpu_affinity.test(c))
+            continue;
+
+        thread_info_t *running = atomic_ld_acq(&cpus[c].cur_thread);
+        uint64_t running_rank = thread_sched_rank(running);
+
+        if (running_rank < target_rank) {
+            target_rank = running_rank;
+            target = c;
+        }
+    }
+
+    if (target >= 0)
+        thread_send_ipi(target, INTR_THREAD_RESCHED);
+}
+
+// A woken thread is placed on the CPU it last ran on, where its cache
+// is likely to be warm, if that CPU is idle or lightly loaded. Returns
+// the CPU to kick out of idle, or -1
+static int thread_wake_affine(thread_info_t *thread)
+{
+    thread->wake_cpu = -1;
+
+    int cpu_nr = thread->last_cpu;
+
+    if (cpu_nr < 0 || !thread->cpu_affinity.test(cpu_nr))
+        return -1;
+
+    cpu_info_t *cpu = cpus + cpu_nr;
+    thread_info_t *running = atomic_ld_acq(&cpu->cur_thread);
+    bool idle = size_t(running->thread_id) < cpu_count;
+
+    if (!idle && cpu->busy_percent > THREAD_WAKE_AFFINE_BUSY_PERCENT)
+        return -1;
+
+    thread->wake_cpu = cpu_nr;
+
+    return idle ? cpu_nr : -1;
+}
+
+// Called before the thread is made ready
+static int thread_wake_prepare(thread_info_t *thread)
+{
+    thread_ready_stamp(thread);
+
+    if (unlikely(thread->sched_policy == SCHED_DEADLINE))
+        thread_dl_wakeup(thread, time_ns());
+
+    if (likely(thread->sched_policy == SCHED_OTHER)) {
+        thread_interact_wake(thread);
+        return thread_wake_affine(thread);
+    }
+
+    thread->wake_cpu = -1;
+    return -1;
+}
+
+// A tickless CPU does not notice that another thread can run there
+// until something interrupts it. Called after the thread is made ready
+static void thread_tickless_kick(thread_info_t *thread)
+{
+    if (likely(!thread_isolation_active) || !thread_idle_ready)
+        return;
+
+    for (size_t c = 0; c < cpu_count; ++c) {
+        if (cpus[c].tickless && thread->cpu_affinity.test(c))
+            thread_send_ipi(c, INTR_THREAD_RESCHED);
+    }
+}
+
+// Called after the thread is made ready
+static void thread_wake_finish(thread_info_t *thread, int kick_cpu)
+{
+    // Wake the halted CPU instead of waiting for its next tick
+    if (kick_cpu >= 0 && thread_idle_ready)
+        thread_send_ipi(kick_cpu, INTR_THREAD_RESCHED);
+
+    thread_rt_preempt(thread);
+    thread_tickless_kick(thread);
+}
+
+// Expects thread_dl_lock to be held
+static void thread_dl_release_bandwidth(thread_info_t *thread)
+{
+    if (thread->sched_policy != SCHED_DEADLINE)
+        return;
+
+    thread_dl_bandwidth -= thread_dl_share(thread->dl_runtime,
+                                           thread->dl_period);
+}
+
 EXPORT void thread_yield()
 {
 #if 1
@@ -288,16 +657,146 @@ static void thread_cleanup()
 
     assert(thread->state == THREAD_IS_RUNNING);
 
-    atomic_barrier();
+    // thread_set_scheduler either finishes first, or sees the thread
+    // destructing, the bandwidth is released exactly once
+    thread_dl_scoped_lock lock(thread_dl_lock);
+
+    thread_dl_release_bandwidth(thread);
+
     thread->priority = 0;
     thread->priority_boost = 0;
-    thread->state = THREAD_IS_DESTRUCTING_BUSY;
+    thread->sched_policy = SCHED_OTHER;
+    thread->rt_priority = 0;
+    atomic_st_rel(&thread->state, THREAD_IS_DESTRUCTING_BUSY);
+
+    lock.unlock();
+
     thread_yield();
 }
 
-static void thread_startup(thread_fn_t fn, void *p, thread_t id)
+static _always_inline thread_info_t *thread_lookup(thread_t tid)
+{
+    // The tid may come from user mode
+    if (unlikely(size_t(tid) >=
+                 size_t(THREAD_CHUNK_COUNT) << THREAD_CHUNK_LOG2))
+        return nullptr;
+
+    thread_info_t *chunk = thread_chunks[tid >> THREAD_CHUNK_LOG2];
+    return likely(chunk) ? chunk + (tid & (THREAD_CHUNK_SIZE - 1)) : nullptr;
+}
+
+// Returns the lowest free thread id, or -1 if there are none
+static thread_t thread_tid_alloc()
+{
+    thread_tid_scoped_lock lock(thread_tid_lock);
+
+    for (size_t top = 0; top < countof(thread_tid_top); ++top) {
+        if (thread_tid_top[top] == ~uint64_t(0))
+            continue;
+
+        size_t word = (top << 6) + bit_lsb_set_64(~thread_tid_top[top]);
+        uint8_t bit = bit_lsb_set_64(~thread_tid_map[word]);
+
+        thread_tid_map[word] |= uint64_t(1) << bit;
+
+        if (thread_tid_map[word] == ~uint64_t(0))
+            thread_tid_top[top] |= uint64_t(1) << (word & 63);
+
+        return thread_t((word << 6) + bit);
+    }
+
+    return -1;
+}
+
+static void thread_tid_free(thread_t tid)
+{
+    thread_tid_scoped_lock lock(thread_tid_lock);
+
+    size_t word = size_t(tid) >> 6;
+
+    assert(thread_tid_map[word] & (uint64_t(1) << (tid & 63)));
+
+    thread_tid_map[word] &= ~(uint64_t(1) << (tid & 63));
+    thread_tid_top[word >> 6] &= ~(uint64_t(1) << (word & 63));
+}
+
+static void thread_record_init(thread_info_t *thread, thread_t tid)
+{
+    thread->thread_id = tid;
+    mutex_init(&thread->lock);
+    condvar_init(&thread->done_cond);
+}
+
+// Returns the chunk containing the specified thread id,
+// allocating it if it does not exist yet
+static thread_info_t *thread_chunk_get(thread_t tid)
+{
+    size_t chunk_index = size_t(tid) >> THREAD_CHUNK_LOG2;
+
+    thread_info_t *chunk = thread_chunks[chunk_index];
+
+    if (likely(chunk))
+        return chunk;
+
+    size_t chunk_bytes = sizeof(thread_info_t) * THREAD_CHUNK_SIZE;
+
+    chunk = (thread_info_t*)mmap(nullptr, chunk_bytes,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_POPULATE, -1, 0);
+
+    if (unlikely(chunk == MAP_FAILED))
+        return nullptr;
+
+    for (size_t i = 0; i < THREAD_CHUNK_SIZE; ++i)
+        thread_record_init(chunk + i, (chunk_index << THREAD_CHUNK_LOG2) + i);
+
+    // Race to install it
+    thread_info_t *existing = atomic_cmpxchg(
+                thread_chunks + chunk_index, nullptr, chunk);
+
+    if (unlikely(existing)) {
+        // Another CPU beat us to it
+        munmap(chunk, chunk_bytes);
+        return existing;
+    }
+
+    THREAD_TRACE("Allocated thread records %zu-%zu\n",
+                 chunk_index << THREAD_CHUNK_LOG2,
+                 ((chunk_index + 1) << THREAD_CHUNK_LOG2) - 1);
+
+    return chunk;
+}
+
+static void thread_stacks_put(thread_stacks_t const& stacks);
+
+// Drop a reference to the thread record, recycle the stacks
+// and the thread id when the last one goes away
+static void thread_release(thread_info_t *thread)
 {
-    threads[id].exit_code = fn(p);
+    if (atomic_dec(&thread->ref_count) == 0) {
+        assert(thread->state == THREAD_IS_FINISHED);
+
+        thread_stacks_t stacks;
+        stacks.stack = (char*)thread->stack;
+        stacks.syscall_stack = thread->syscall_stack;
+        stacks.xsave_stack = thread->xsave_stack;
+        stacks.stack_size = thread->stack_size;
+
+        thread->stack = nullptr;
+        thread->syscall_stack = nullptr;
+        thread->xsave_stack = nullptr;
+        thread->xsave_ptr = nullptr;
+
+        thread_stacks_put(stacks);
+
+        atomic_st_rel(&thread->state, THREAD_IS_UNINITIALIZED);
+        thread_tid_free(thread->thread_id);
+    }
+}
+
+static void thread_startup(thread_fn_t fn, void *p, thread_t)
+{
+    this_thread()->exit_code = fn(p);
     thread_cleanup();
 }
 
@@ -334,11 +833,115 @@ static char *thread_allocate_stack(
     return stack;
 }
 
-// Returns threads array index or 0 on error
-// Minimum allowable stack space is 4KB
+static void thread_free_stack(char *stack, size_t stack_size)
+{
+    munmap(stack - stack_size - stack_guard_size,
+           stack_guard_size + stack_size + stack_guard_size);
+}
+
+// Room for the detected xsave area size, and for aligning it
+static size_t thread_xsave_stack_size()
+{
+    return (sse_context_size + 64 + PAGE_SIZE - 1) & -PAGE_SIZE;
+}
+
+static void thread_stacks_free(thread_stacks_t const& stacks)
+{
+    thread_free_stack(stacks.stack, stacks.stack_size);
+
+    if (stacks.syscall_stack)
+        thread_free_stack(stacks.syscall_stack, syscall_stack_size);
+
+    if (stacks.xsave_stack)
+        thread_free_stack(stacks.xsave_stack, thread_xsave_stack_size());
+}
+
+// Take matching stacks from this CPU's cache, returns false if none match
+static bool thread_stacks_get(thread_stacks_t *stacks,
+                              size_t stack_size, bool user)
+{
+    cpu_scoped_irq_disable intr_was_enabled;
+    thread_stack_cache_t *cache = thread_stack_caches + thread_cpu_number();
+
+    for (size_t i = cache->count; i > 0; --i) {
+        thread_stacks_t *entry = cache->entries + (i - 1);
+
+        if (entry->stack_size == stack_size &&
+                !entry->syscall_stack == !user) {
+            *stacks = *entry;
+            *entry = cache->entries[--cache->count];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Called on the context switch path, must not unmap anything
+static void thread_stacks_put(thread_stacks_t const& stacks)
+{
+    if (!stacks.stack)
+        return;
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    thread_stack_cache_t *cache = thread_stack_caches + thread_cpu_number();
+
+    if (likely(cache->count < THREAD_STACK_CACHE_SIZE)) {
+        cache->entries[cache->count++] = stacks;
+        return;
+    }
+
+    thread_reap_t *node = (thread_reap_t*)(stacks.stack -
+                                           sizeof(thread_reap_t));
+    node->stacks = stacks;
+
+    spinlock_lock(&thread_reap_lock);
+
+    node->next = thread_reap_list;
+    thread_reap_list = node;
+
+    if (thread_reap_sleeping) {
+        thread_reap_sleeping = false;
+        thread_wake(thread_reap_tid);
+    }
+
+    spinlock_unlock(&thread_reap_lock);
+}
+
+static int thread_reaper(void *)
+{
+    spinlock_lock(&thread_reap_lock);
+
+    for (;;) {
+        while (!thread_reap_list) {
+            thread_reap_sleeping = true;
+            thread_sleep_release(&thread_reap_lock, &thread_reap_tid,
+                                 UINT64_MAX);
+        }
+
+        thread_reap_t *node = thread_reap_list;
+        thread_reap_list = nullptr;
+
+        spinlock_unlock(&thread_reap_lock);
+
+        while (node) {
+            // The node is inside the memory being freed
+            thread_reap_t *next = node->next;
+            thread_stacks_t stacks = node->stacks;
+            thread_stacks_free(stacks);
+            node = next;
+        }
+
+        spinlock_lock(&thread_reap_lock);
+    }
+}
+
+// Returns thread id or -1 on error
+// Minimum allowable stack space is 16KB
+// An empty affinity inherits the affinity of the creator
 static thread_t thread_create_with_state(
         thread_fn_t fn, void *userdata, size_t stack_size,
-        thread_state_t state, uint64_t affinity,
+        thread_state_t state, thread_cpu_mask_t const& affinity,
         thread_priority_t priority, bool user)
 {
     if (stack_size == 0)
@@ -347,67 +950,99 @@ static thread_t thread_create_with_state(
         return -1;
 
     thread_info_t *thread = nullptr;
-    size_t i;
+    thread_t i;
 
-    for (i = 0; ; ++i) {
-        if (unlikely(i >= MAX_THREADS)) {
-            printdbg("Out of threads, yielding\n");
-            thread_yield();
-            i = 0;
-        }
+    for (;;) {
+        i = thread_tid_alloc();
 
-        thread = threads + i;
+        if (likely(i >= 0)) {
+            thread_info_t *chunk = thread_chunk_get(i);
 
-        if (thread->state != THREAD_IS_UNINITIALIZED)
-            continue;
+            if (likely(chunk)) {
+                thread = chunk + (i & (THREAD_CHUNK_SIZE - 1));
+                break;
+            }
 
-        // Atomically grab the thread
-        if (likely(atomic_cmpxchg(&thread->state,
-                                  THREAD_IS_UNINITIALIZED,
-                                  THREAD_IS_INITIALIZING) ==
-                   THREAD_IS_UNINITIALIZED))
-        {
-            break;
+            thread_tid_free(i);
         }
 
-        pause();
+        printdbg("Out of threads, yielding\n");
+        thread_yield();
     }
 
+    // The thread id allocator guarantees exclusive access to the record
+    thread_state_t old_state = atomic_cmpxchg(
+                &thread->state, THREAD_IS_UNINITIALIZED,
+                THREAD_IS_INITIALIZING);
+    assert(old_state == THREAD_IS_UNINITIALIZED);
+    (void)old_state;
+
     atomic_barrier();
 
     thread->flags = 0;
+    thread->ref_count = 2;
+    thread->exit_code = 0;
+    thread->errno = errno_t::OK;
+    thread->exception_chain = nullptr;
+    thread->wake_count = 0;
+    thread->used_time = 0;
+    thread->fpu_cpu = -1;
+
+    size_t xsave_stack_size = thread_xsave_stack_size();
+
+    thread_stacks_t stacks;
+    if (thread_stacks_get(&stacks, stack_size, user)) {
+        // Another thread's FPU state must not leak into this one
+        if (user)
+            memset(stacks.xsave_stack - xsave_stack_size, 0,
+                   xsave_stack_size);
+    } else {
+        stacks.stack = thread_allocate_stack(i, stack_size, "", 0xFE);
+        stacks.stack_size = stack_size;
+        stacks.syscall_stack = nullptr;
+        stacks.xsave_stack = nullptr;
+
+        if (user) {
+            stacks.syscall_stack = thread_allocate_stack(
+                        i, syscall_stack_size, "syscall", 0xFE);
 
-    char *stack = thread_allocate_stack(i, stack_size, "", 0xFE);
+            stacks.xsave_stack = thread_allocate_stack(
+                        i, xsave_stack_size, "xsave", 0);
+        }
+    }
+
+    char *stack = stacks.stack;
     thread->stack = stack;
     thread->stack_size = stack_size;
+    thread->syscall_stack = stacks.syscall_stack;
+    thread->xsave_stack = stacks.xsave_stack;
 
-    char *syscall_stack = nullptr;
-    char *xsave_stack = nullptr;
     if (user) {
-        // Syscall stack
-
-        syscall_stack = thread_allocate_stack(
-                    i, syscall_stack_size, "syscall", 0xFE);
-
-        // XSave stack
-
         thread->flags |= THREAD_FLAGS_USES_FPU;
 
-        xsave_stack = thread_allocate_stack(
-                    i, xsave_stack_size, "xsave", 0);
+        // xsave requires 64 byte alignment
+        thread->xsave_ptr = (char*)(uintptr_t(stacks.xsave_stack -
+                                              sse_context_size) & -64);
 
-        thread->xsave_ptr = xsave_stack - sse_context_size;
+        idt_xsave_area_init(thread->xsave_ptr);
     } else {
         thread->xsave_ptr = nullptr;
     }
-    thread->syscall_stack = syscall_stack;
-    thread->xsave_stack = xsave_stack;
 
     thread_info_t *creator_thread = this_thread();
 
     thread->priority = priority;
     thread->priority_boost = 0;
-    thread->cpu_affinity = affinity ? affinity : creator_thread->cpu_affinity;
+    thread->interact_run = 0;
+    thread->interact_sleep = 0;
+    thread->block_timestamp = 0;
+    thread->sched_policy = SCHED_OTHER;
+    thread->rt_priority = 0;
+    thread->last_cpu = -1;
+    thread->wake_cpu = -1;
+    thread->cpu_affinity = !affinity.empty()
+            ? affinity
+            : creator_thread->cpu_affinity;
     thread->fsbase = nullptr;
     thread->gsbase = nullptr;
 
@@ -446,28 +1081,18 @@ static thread_t thread_create_with_state(
     ISR_CTX_REG_RDX(ctx) = i;
     ISR_CTX_REG_CR3(ctx) = cpu_page_directory_get();
 
-    if (thread->flags & THREAD_FLAGS_USES_FPU) {
-        ISR_CTX_SSE_MXCSR(ctx) = (CPU_MXCSR_MASK_ALL |
-                CPU_MXCSR_RC_n(CPU_MXCSR_RC_NEAREST)) &
-                default_mxcsr_mask;
-        ISR_CTX_SSE_MXCSR_MASK(ctx) = default_mxcsr_mask;
-
-        // All FPU registers empty
-        ISR_CTX_FPU_FSW(ctx) = CPU_FPUSW_TOP_n(7);
-
-        // 53 bit FPU precision
-        ISR_CTX_FPU_FCW(ctx) = CPU_FPUCW_PC_n(CPU_FPUCW_PC_53) | CPU_FPUCW_IM |
-                CPU_FPUCW_DM | CPU_FPUCW_ZM | CPU_FPUCW_OM |
-                CPU_FPUCW_UM | CPU_FPUCW_PM;
-    }
-
     thread->ctx = ctx;
 
+    thread_ready_stamp(thread);
+
     atomic_barrier();
     thread->state = state;
 
     // Atomically make sure thread_count > i
-    atomic_max(&thread_count, i + 1);
+    atomic_max(&thread_count, size_t(i) + 1);
+
+    if (state == THREAD_IS_READY)
+        thread_tickless_kick(thread);
 
     return i;
 }
@@ -477,7 +1102,7 @@ EXPORT thread_t thread_create(thread_fn_t fn, void *userdata,
 {
     return thread_create_with_state(
                 fn, userdata, stack_size,
-                THREAD_IS_READY, -1, 0, user);
+                THREAD_IS_READY, thread_cpu_mask_t::all(), 0, user);
 }
 
 #if 0
@@ -519,11 +1144,28 @@ void thread_idle()
         halt();
 }
 
+// The idle threads must take the first thread ids,
+// start the reaper after every CPU is online
+static void thread_reaper_start(void *)
+{
+    thread_t tid = thread_create(thread_reaper, nullptr, 0, false);
+    thread_close(tid);
+}
+
+REGISTER_CALLOUT(thread_reaper_start, nullptr,
+                 callout_type_t::smp_online, "000");
+
 static isr_context_t *thread_context_switch_handler(int, isr_context_t *ctx)
 {
     return thread_schedule(ctx);
 }
 
+static isr_context_t *thread_resched_handler(int intr, isr_context_t *ctx)
+{
+    apic_eoi(intr);
+    return thread_schedule(ctx);
+}
+
 void thread_init(int ap)
 {
     uint32_t cpu_number = atomic_xadd(&cpu_count, 1);
@@ -537,7 +1179,7 @@ void thread_init(int ap)
 
     assert(thread_count == cpu_number);
 
-    thread_info_t *thread = threads + cpu_number;
+    thread_info_t *thread = thread_boot_chunk + cpu_number;
 
     cpu->self = cpu;
     cpu->apic_id = get_apic_id();
@@ -547,10 +1189,16 @@ void thread_init(int ap)
     cpu_altgsbase_set((void*)0xFFFFD1D1D1D1D1D1);
 
     if (!ap) {
-        for (unsigned i = 0; i < countof(threads); ++i)
-            threads[i].thread_id = i;
+        for (unsigned i = 0; i < countof(thread_boot_chunk); ++i)
+            thread_record_init(thread_boot_chunk + i, i);
+
+        // The BSP idle thread takes the first thread id
+        thread_t bsp_tid = thread_tid_alloc();
+        assert(bsp_tid == 0);
+        (void)bsp_tid;
 
         intr_hook(INTR_THREAD_YIELD, thread_context_switch_handler, "sw_yield");
+        intr_hook(INTR_THREAD_RESCHED, thread_resched_handler, "sw_resched");
 
         thread->process = process_t::init(cpu_page_directory_get());
 
@@ -569,18 +1217,21 @@ void thread_init(int ap)
 
         thread->xsave_stack = nullptr;
         thread->xsave_ptr = nullptr;
-        thread->cpu_affinity = 1;
+        thread->cpu_affinity = thread_cpu_mask_t(0);
+        thread->ref_count = 2;
         atomic_barrier();
         thread->state = THREAD_IS_RUNNING;
         thread_count = 1;
     } else {
         cpu_irq_disable();
 
-        thread = threads + thread_create_with_state(
+        thread = thread_lookup(thread_create_with_state(
                     smp_idle_thread, nullptr, 0,
                     THREAD_IS_INITIALIZING,
-                    1 << cpu_number,
-                    -256, false);
+                    thread_cpu_mask_t(cpu_number),
+                    -256, false));
+
+        assert(thread == thread_boot_chunk + cpu_number);
 
         thread->used_time = 0;
 
@@ -592,17 +1243,67 @@ void thread_init(int ap)
     }
 }
 
+// The FPU state is switched lazily. If the outgoing thread used the
+// FPU during its time slice, save its state (xsaveopt/xsaves skip
+// unmodified and initial components), then set CR0.TS so that the
+// restore is deferred until the next thread actually uses the FPU.
+// The registers keep the saved state, so a thread that comes back
+// to this CPU before anyone else uses the FPU skips the restore.
+static _always_inline void thread_fpu_switch(
+        cpu_info_t *cpu, thread_info_t *outgoing)
+{
+    if (cpu->fpu_trap)
+        return;
+
+    if (cpu->fpu_owner == outgoing)
+        isr_save_fpu_ctx(outgoing);
+
+    cpu_cr0_change_bits(0, CPU_CR0_TS);
+    cpu->fpu_trap = true;
+}
+
+isr_context_t *thread_fpu_trap_handler(int intr, isr_context_t *ctx)
+{
+    assert(intr == INTR_EX_DEV_NOT_AV);
+    (void)intr;
+
+    cpu_info_t *cpu = this_cpu();
+    thread_info_t *thread = cpu->cur_thread;
+    int cpu_number = cpu - cpus;
+
+    // Only threads with a save area may use the FPU
+    if (unlikely(!cpu->fpu_trap || !(thread->flags & THREAD_FLAGS_USES_FPU)))
+        return unhandled_exception_handler(ctx);
+
+    cpu_clts();
+    cpu->fpu_trap = false;
+
+    // Skip the restore if the registers still hold this thread's state
+    if (cpu->fpu_owner != thread || thread->fpu_cpu != cpu_number) {
+        isr_restore_fpu_ctx(thread);
+        cpu->fpu_owner = thread;
+        thread->fpu_cpu = cpu_number;
+    }
+
+    return ctx;
+}
+
+// On an isolated CPU, contenders receives the number of threads
+// that may run on it, ready or not
 static thread_info_t *thread_choose_next(
         cpu_info_t *cpu,
-        thread_info_t * const outgoing)
+        thread_info_t * const outgoing,
+        uint64_t tsc, size_t *contenders)
 {
     size_t cpu_number = cpu - cpus;
-    size_t i = outgoing - threads;
+    size_t i = outgoing->thread_id;
     thread_info_t *incoming = nullptr;
     thread_info_t *candidate;
     uint64_t now = 0;
 
-    assert(i < countof(threads));
+    assert(i < MAX_THREADS);
+
+    *contenders = 0;
 
     // If we have not created all of the idle threads yet, don't context switch
     if (unlikely(thread_count < cpu_count))
@@ -616,7 +1317,15 @@ static thread_info_t *thread_choose_next(
         if (i < cpu_count || i >= thread_count)
             i = cpu_count;
 
-        candidate = threads + i;
+        candidate = thread_lookup(i);
+
+        // Skip the rest of a chunk that is still being created
+        if (unlikely(!candidate)) {
+            size_t skip = THREAD_CHUNK_SIZE - 1 - (i & (THREAD_CHUNK_SIZE - 1));
+            i += skip;
+            checked += skip;
+            continue;
+        }
 
         // Quickly ignore running threads
         if (candidate->state == THREAD_IS_RUNNING ||
@@ -625,9 +1334,17 @@ static thread_info_t *thread_choose_next(
 
         // If this thread is not allowed to run on this CPU
         // then skip it
-        if (unlikely(!(candidate->cpu_affinity & (1U << cpu_number))))
+        if (unlikely(!candidate->cpu_affinity.test(cpu_number)))
             continue;
 
+        // Normal threads are never balanced onto an isolated CPU
+        if (unlikely(cpu->isolated)) {
+            if (!candidate->cpu_affinity.subset_of(thread_isolated_cpus))
+                continue;
+
+            ++*contenders;
+        }
+
         //
         // Expect states to have busy bit set if it is the outgoing thread
 
@@ -649,24 +1366,64 @@ static thread_info_t *thread_choose_next(
             if (likely(now < candidate->wake_time))
                 continue;
 
-            // Race to transition it to ready
+            // Race to claim it, ready but busy so no other CPU takes it
+            // while the winner updates its accounting
             if (unlikely(atomic_cmpxchg(&candidate->state, expected_sleep,
-                                        expected_ready) != expected_sleep)) {
+                                        THREAD_IS_READY_BUSY) !=
+                         expected_sleep)) {
                 // Another CPU beat us to it
                 continue;
             }
+
+            // Does not include how late the expiry was noticed
+            thread_ready_stamp(candidate);
+
+            if (candidate->sched_policy == SCHED_DEADLINE)
+                thread_dl_wakeup(candidate, now);
+            else
+                thread_interact_wake(candidate);
+
+            if (candidate != outgoing)
+                atomic_st_rel(&candidate->state, THREAD_IS_READY);
         } else if (unlikely(candidate->state != expected_ready))
             continue;
 
+        // Leave a recently woken thread for the CPU it was placed on
+        int wake_cpu = candidate->wake_cpu;
+        if (unlikely(wake_cpu >= 0 && size_t(wake_cpu) != cpu_number &&
+                     tsc - candidate->ready_timestamp <
+                     THREAD_WAKE_AFFINE_CYCLES))
+            continue;
+
+        // A deadline thread that used up its budget is throttled
+        // until its deadline, then replenished for the next period
+        if (unlikely(candidate->sched_policy == SCHED_DEADLINE &&
+                     candidate->dl_budget <= 0)) {
+            if (unlikely(now == 0))
+                now = time_ns();
+
+            if (now < candidate->dl_abs_deadline)
+                continue;
+
+            while (candidate->dl_abs_deadline <= now)
+                candidate->dl_abs_deadline += candidate->dl_period;
+            candidate->dl_budget = candidate->dl_runtime;
+        }
+
         if (likely(incoming)) {
             // Must be better than best
-            if (likely(candidate->priority + candidate->priority_boost >
-                       incoming->priority + incoming->priority_boost))
+            if (likely(thread_sched_rank(candidate) >
+                       thread_sched_rank(incoming)))
                 incoming = candidate;
         } else if (likely(outgoing->state == THREAD_IS_READY_BUSY)) {
-            // Must be at least the same priority as outgoing
-            if (likely(candidate->priority + candidate->priority_boost >=
-                       outgoing->priority + outgoing->priority_boost))
+            // Must be at least the same rank as outgoing, and better
+            // if the outgoing thread does not round robin
+            uint64_t candidate_rank = thread_sched_rank(candidate);
+            uint64_t outgoing_rank = thread_sched_rank(outgoing);
+            if (likely(candidate == outgoing ||
+                       candidate_rank > outgoing_rank ||
+                       (candidate_rank == outgoing_rank &&
+                        thread_sched_round_robin(outgoing))))
                 incoming = candidate;
         } else {
             // Outgoing thread is not ready, any thread is better
@@ -676,22 +1433,15 @@ static thread_info_t *thread_choose_next(
 
     // Did not find any ready thread, choose idle thread
     if (unlikely(!incoming))
-        incoming = threads + cpu_number;
-
-    assert(incoming
-           ? incoming >= threads && incoming <= threads + countof(threads)
-           : outgoing >= threads && outgoing <= threads + countof(threads));
+        incoming = thread_boot_chunk + cpu_number;
 
     if (incoming != outgoing) {
-        if (outgoing->flags & THREAD_FLAGS_USES_FPU)
-            isr_save_fpu_ctx(outgoing->ctx);
-        if (incoming->flags & THREAD_FLAGS_USES_FPU)
-            isr_restore_fpu_ctx(incoming->ctx);
+        thread_fpu_switch(cpu, outgoing);
 
         // Update TPL. Idle CPUs have TPL==0, busy CPUs have TPL=8
 
-//        bool incoming_idle = incoming < threads + cpu_count;
-//        bool outgoing_idle = outgoing < threads + cpu_count;
+//        bool incoming_idle = incoming->thread_id < cpu_count;
+//        bool outgoing_idle = outgoing->thread_id < cpu_count;
 //
 //        if (incoming_idle != outgoing_idle)
 //            cpu_set_cr8(incoming_idle ? 0 : 8);
@@ -703,7 +1453,10 @@ static thread_info_t *thread_choose_next(
 static void thread_clear_busy(void *outgoing)
 {
     thread_info_t *thread = (thread_info_t*)outgoing;
-    atomic_and(&thread->state, ~THREAD_BUSY);
+
+    // The thread is off its stack now, drop its own reference
+    if (atomic_and(&thread->state, ~THREAD_BUSY) == THREAD_IS_FINISHED)
+        thread_release(thread);
 }
 
 isr_context_t *thread_schedule(isr_context_t *ctx)
@@ -713,6 +1466,10 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
 
     thread_info_t * const outgoing = thread;
 
+    // Read side sections run with interrupts disabled and cannot span
+    // a switch, so every entry here is a quiescent state
+    rcu_quiescent(cpu - cpus);
+
     if (unlikely(cpu->goto_thread)) {
         thread = cpu->goto_thread;
         cpu->cur_thread = thread;
@@ -734,7 +1491,7 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
 
     // Accumulate used and busy time on this CPU
     cpu->time_ratio += elapsed;
-    cpu->busy_ratio += elapsed & -(thread >= threads + cpu_count);
+    cpu->busy_ratio += elapsed & -(size_t(thread->thread_id) >= cpu_count);
 
     // Normalize ratio to < 32768
     uint8_t time_scale = bit_msb_set(cpu->time_ratio);
@@ -747,23 +1504,37 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
     if (likely(cpu->time_ratio))
         cpu->busy_percent = 100 * cpu->busy_ratio / cpu->time_ratio;
 
+    // Charge the elapsed time to the budget of a deadline thread
+    if (unlikely(thread->sched_policy == SCHED_DEADLINE)) {
+        uint64_t now_ns = time_ns();
+        thread->dl_budget -= now_ns - thread->dl_run_start;
+        thread->dl_run_start = now_ns;
+    }
+
     thread_state_t state = atomic_ld_acq(&thread->state);
 
+    // Charge the elapsed time to the interactivity history, and note
+    // when a thread blocks. Hogs lose priority as they run
+    if (size_t(thread->thread_id) >= cpu_count) {
+        thread->interact_run += elapsed;
+        thread_interact_decay(thread);
+
+        if (state != THREAD_IS_RUNNING)
+            thread->block_timestamp = now;
+
+        thread->priority_boost = thread_interact_boost(
+                    thread->interact_run, thread->interact_sleep);
+    }
+
     // Change to ready if running
     if (likely(state == THREAD_IS_RUNNING)) {
+        thread->ready_timestamp = now;
         atomic_st_rel(&thread->state, THREAD_IS_READY_BUSY);
-    } else if (state == THREAD_IS_DESTRUCTING) {
-        munmap((char*)thread->stack - thread->stack_size - stack_guard_size,
-               stack_guard_size + thread->stack_size + stack_guard_size);
-
-        if (thread->flags & THREAD_FLAGS_USES_FPU) {
-            assert(thread->xsave_stack != nullptr);
-            munmap(thread->xsave_stack - stack_guard_size - xsave_stack_size,
-                   stack_guard_size + xsave_stack_size + stack_guard_size);
-        }
-
+    } else if (state == THREAD_IS_DESTRUCTING_BUSY) {
+        // The stacks are still in use here, they
+        // are kept with the record for reuse
         mutex_lock_noyield(&thread->lock);
-        atomic_st_rel(&thread->state, THREAD_IS_FINISHED);
+        atomic_st_rel(&thread->state, THREAD_IS_FINISHED_BUSY);
         condvar_wake_all(&thread->done_cond);
         mutex_unlock(&thread->lock);
     }
@@ -771,21 +1542,21 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
     // Retry because another CPU might steal this
     // thread after it transitions from sleeping to
     // ready
+    size_t contenders;
     int retries = 0;
     for ( ; ; ++retries) {
-        thread = thread_choose_next(cpu, outgoing);
+        thread = thread_choose_next(cpu, outgoing, now, &contenders);
 
-        assert((thread >= threads + cpu_count &&
-                thread < threads + countof(threads)) ||
-               thread == threads + (cpu - cpus));
+        assert(size_t(thread->thread_id) >= cpu_count ||
+               thread == thread_boot_chunk + (cpu - cpus));
 
         if (thread == outgoing && thread->state == THREAD_IS_READY_BUSY) {
             // This doesn't need to be cmpxchg because the
             // outgoing thread is still marked busy
             atomic_st_rel(&thread->state, THREAD_IS_RUNNING);
 
-//            if (thread - threads >= cpu_count)
-//                THREAD_TRACE("Staying on thread %zd\n", thread - threads);
+//            if (thread->thread_id >= cpu_count)
+//                THREAD_TRACE("Staying on thread %d\n", thread->thread_id);
             break;
         } else if (thread->state == THREAD_IS_READY &&
                 atomic_cmpxchg(&thread->state,
@@ -793,8 +1564,8 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
                            THREAD_IS_RUNNING) ==
                 THREAD_IS_READY) {
 
-//            if (thread - threads >= cpu_count)
-//                THREAD_TRACE("Switched to thread %zd\n", thread - threads);
+//            if (thread->thread_id >= cpu_count)
+//                THREAD_TRACE("Switched to thread %d\n", thread->thread_id);
 
             break;
         }
@@ -804,8 +1575,63 @@ isr_context_t *thread_schedule(isr_context_t *ctx)
 
     thread->sched_timestamp = now;
 
-    // Thread loses its priority boost when it is scheduled
-    thread->priority_boost = 0;
+    // Add the sleep that just ended to the interactivity history
+    uint64_t blocked = thread->block_timestamp;
+    if (blocked) {
+        uint64_t ready = thread->ready_timestamp;
+        if (ready > blocked)
+            thread->interact_sleep += ready - blocked;
+        thread->block_timestamp = 0;
+        thread_interact_decay(thread);
+    }
+
+    if (thread != outgoing) {
+        thread_sched_stats_t *stats = thread_sched_stats + (cpu - cpus);
+
+        ++stats->switch_count;
+
+        if (size_t(outgoing->thread_id) >= cpu_count) {
+            uint64_t slice = now - outgoing->run_timestamp;
+            thread_sched_hist_add(stats->slice_length, slice);
+
+            // Switched out by an interrupt while it could still run
+            if (state == THREAD_IS_RUNNING &&
+                    ISR_CTX_INTR(ctx) != INTR_THREAD_YIELD) {
+                ++stats->involuntary_count;
+                thread_sched_hist_add(stats->preempt_slice, slice);
+            }
+        }
+
+        if (size_t(thread->thread_id) >= cpu_count) {
+            uint64_t ready_time = thread->ready_timestamp;
+            thread_sched_hist_add(stats->wake_latency,
+                                  now > ready_time ? now - ready_time : 0);
+        }
+
+        thread->run_timestamp = now;
+
+        int cpu_number = cpu - cpus;
+        if (thread->last_cpu >= 0 && thread->last_cpu != cpu_number)
+            ++stats->migration_count;
+        thread->last_cpu = cpu_number;
+        thread->wake_cpu = -1;
+
+        if (unlikely(thread->sched_policy == SCHED_DEADLINE))
+            thread->dl_run_start = time_ns();
+    }
+
+    // Stop the tick on an isolated CPU while nothing else could run
+    // there. Anything that makes another thread ready for this CPU
+    // restarts it with a reschedule IPI
+    if (unlikely(cpu->isolated || cpu->tickless)) {
+        bool tickless = cpu->isolated && contenders <= 1 &&
+                size_t(thread->thread_id) >= cpu_count;
+
+        if (tickless != cpu->tickless) {
+            cpu->tickless = tickless;
+            apic_timer_tick(!tickless);
+        }
+    }
 
     assert(thread->state == THREAD_IS_RUNNING);
 
@@ -866,18 +1692,18 @@ EXPORT void thread_sleep_for(uint64_t ms)
 
 EXPORT uint64_t thread_get_usage(int id)
 {
-    if (id >= int(countof(threads)))
+    if (id >= MAX_THREADS)
         return -1;
 
-    thread_info_t *thread = id < 0 ? this_thread() : (threads + id);
-    return thread->used_time;
+    thread_info_t *thread = id < 0 ? this_thread() : thread_lookup(id);
+    return thread ? thread->used_time : -1;
 }
 
 void thread_suspend_release(spinlock_t *lock, thread_t *thread_id)
 {
     thread_info_t *thread = this_thread();
 
-    *thread_id = thread - threads;
+    *thread_id = thread->thread_id;
 
     thread_state_t old_state;
     old_state = atomic_cmpxchg(&thread->state,
@@ -890,42 +1716,204 @@ void thread_suspend_release(spinlock_t *lock, thread_t *thread_id)
     spinlock_lock_restore(lock, saved_lock);
 }
 
+void thread_sleep_release(spinlock_t *lock, thread_t *thread_id,
+                          uint64_t expiry)
+{
+    thread_info_t *thread = this_thread();
+
+    *thread_id = thread->thread_id;
+
+    thread->wake_time = expiry;
+    atomic_barrier();
+
+    thread_state_t old_state;
+    old_state = atomic_cmpxchg(&thread->state,
+                               THREAD_IS_RUNNING, THREAD_IS_SLEEPING_BUSY);
+    assert(old_state == THREAD_IS_RUNNING);
+    (void)old_state;
+
+    spinlock_value_t saved_lock = spinlock_unlock_save(lock);
+    thread_yield();
+    assert(thread->state == THREAD_IS_RUNNING);
+    spinlock_lock_restore(lock, saved_lock);
+}
+
+EXPORT bool thread_wake(thread_t tid)
+{
+    thread_info_t *thread = thread_lookup(tid);
+
+    for (;;) {
+        thread_state_t state = atomic_ld_acq(&thread->state);
+
+        thread_state_t ready;
+        if (state == THREAD_IS_SLEEPING)
+            ready = THREAD_IS_READY;
+        else if (state == THREAD_IS_SLEEPING_BUSY)
+            ready = THREAD_IS_READY_BUSY;
+        else
+            return false;
+
+        // Claim it before updating its accounting. A thread that is
+        // not busy stays busy until then, so no CPU can run it yet
+        if (atomic_cmpxchg(&thread->state, state,
+                           THREAD_IS_READY_BUSY) != state) {
+            pause();
+            continue;
+        }
+
+        int kick_cpu = thread_wake_prepare(thread);
+
+        if (ready == THREAD_IS_READY)
+            atomic_st_rel(&thread->state, THREAD_IS_READY);
+
+        thread_wake_finish(thread, kick_cpu);
+        return true;
+    }
+}
+
+EXPORT bool thread_is_running(thread_t tid)
+{
+    thread_info_t *thread = thread_lookup(tid);
+    return thread && atomic_ld_acq(&thread->state) == THREAD_IS_RUNNING;
+}
+
 EXPORT void thread_resume(thread_t tid)
 {
-    thread_info_t *thread = threads + tid;
+    thread_info_t *thread = thread_lookup(tid);
+
+    int kick_cpu;
 
     for (;;) {
         //THREAD_TRACE("Resuming %d\n", tid);
 
         cpu_wait_value(&thread->state, THREAD_IS_SUSPENDED);
 
+        kick_cpu = thread_wake_prepare(thread);
+
         // If the thread is suspended_busy, make it ready_busy
         // If the thread is suspended, make it ready
 
         if (thread->state == THREAD_IS_SUSPENDED &&
                 atomic_cmpxchg(&thread->state, THREAD_IS_SUSPENDED,
                            THREAD_IS_READY))
-            return;
+            break;
 
         if (thread->state == THREAD_IS_SUSPENDED_BUSY &&
                 atomic_cmpxchg(&thread->state, THREAD_IS_SUSPENDED_BUSY,
                            THREAD_IS_READY_BUSY))
-            return;
+            break;
 
         THREAD_TRACE("Did not resume %d! Retrying I guess\n", tid);
     }
+
+    thread_wake_finish(thread, kick_cpu);
+}
+
+EXPORT int thread_set_scheduler(thread_t tid, int policy, int rt_priority,
+                                uint64_t runtime, uint64_t deadline,
+                                uint64_t period)
+{
+    thread_info_t *thread = thread_lookup(tid);
+
+    if (unlikely(!thread || thread->state == THREAD_IS_UNINITIALIZED))
+        return -int(errno_t::ESRCH);
+
+    uint64_t bandwidth = 0;
+
+    switch (policy) {
+    case SCHED_OTHER:
+        if (rt_priority != 0)
+            return -int(errno_t::EINVAL);
+        break;
+
+    case SCHED_FIFO:
+    case SCHED_RR:
+        if (rt_priority < SCHED_RT_PRIORITY_MIN ||
+                rt_priority > SCHED_RT_PRIORITY_MAX)
+            return -int(errno_t::EINVAL);
+        break;
+
+    case SCHED_DEADLINE:
+        if (deadline == 0)
+            deadline = period;
+        if (period == 0)
+            period = deadline;
+        if (runtime == 0 || runtime > deadline || deadline > period)
+            return -int(errno_t::EINVAL);
+        bandwidth = thread_dl_share(runtime, period);
+        break;
+
+    default:
+        return -int(errno_t::EINVAL);
+    }
+
+    thread_dl_scoped_lock lock(thread_dl_lock);
+
+    // Exiting threads have released their bandwidth
+    thread_state_t state = thread_state_t(
+                atomic_ld_acq(&thread->state) & ~THREAD_BUSY);
+    if (unlikely(state == THREAD_IS_DESTRUCTING ||
+                 state == THREAD_IS_FINISHED))
+        return -int(errno_t::ESRCH);
+
+    uint64_t old_bandwidth = thread->sched_policy == SCHED_DEADLINE
+            ? thread_dl_share(thread->dl_runtime, thread->dl_period)
+            : 0;
+
+    // Admission control, the deadlines are only guaranteed
+    // if the total bandwidth fits on the CPUs
+    uint64_t limit = cpu_count * THREAD_DL_UNIT *
+            THREAD_DL_LIMIT_PERCENT / 100;
+    if (thread_dl_bandwidth - old_bandwidth + bandwidth > limit)
+        return -int(errno_t::EBUSY);
+
+    thread_dl_bandwidth += bandwidth - old_bandwidth;
+
+    thread->dl_runtime = runtime;
+    thread->dl_deadline = deadline;
+    thread->dl_period = period;
+    thread->dl_budget = runtime;
+    thread->dl_abs_deadline = time_ns() + deadline;
+    thread->dl_run_start = time_ns();
+    thread->rt_priority = rt_priority;
+    atomic_st_rel(&thread->sched_policy, policy);
+
+    lock.unlock();
+
+    // Let a newly real time thread preempt if it is waiting to run
+    if ((atomic_ld_acq(&thread->state) & ~THREAD_BUSY) == THREAD_IS_READY)
+        thread_rt_preempt(thread);
+
+    return 0;
+}
+
+EXPORT int thread_get_scheduler(thread_t tid)
+{
+    thread_info_t *thread = thread_lookup(tid);
+
+    if (unlikely(!thread || thread->state == THREAD_IS_UNINITIALIZED))
+        return -int(errno_t::ESRCH);
+
+    return thread->sched_policy;
 }
 
 EXPORT int thread_wait(thread_t thread_id)
 {
-    thread_info_t *thread = threads + thread_id;
+    thread_info_t *thread = thread_lookup(thread_id);
     mutex_lock(&thread->lock);
-    while (thread->state != THREAD_IS_FINISHED)
+    while ((thread->state & ~THREAD_BUSY) != THREAD_IS_FINISHED)
         condvar_wait(&thread->done_cond, &thread->lock);
     mutex_unlock(&thread->lock);
     return thread->exit_code;
 }
 
+EXPORT void thread_close(thread_t thread_id)
+{
+    thread_info_t *thread = thread_lookup(thread_id);
+    assert(thread != nullptr);
+    thread_release(thread);
+}
+
 int thread_cpu_count()
 {
     return cpu_count;
@@ -961,7 +1949,7 @@ EXPORT thread_t thread_get_id()
         thread_t thread_id;
 
         thread_info_t *cur_thread = this_thread();
-        thread_id = cur_thread - threads;
+        thread_id = cur_thread->thread_id;
 
         return thread_id;
     }
@@ -970,9 +1958,9 @@ EXPORT thread_t thread_get_id()
     return 0;
 }
 
-EXPORT uint64_t thread_get_affinity(int id)
+EXPORT thread_cpu_mask_t thread_get_affinity(int id)
 {
-    return threads[id].cpu_affinity;
+    return thread_lookup(id)->cpu_affinity;
 }
 
 EXPORT size_t thread_get_cpu_count()
@@ -980,17 +1968,21 @@ EXPORT size_t thread_get_cpu_count()
     return cpu_count;
 }
 
-EXPORT void thread_set_affinity(int id, uint64_t affinity)
+EXPORT void thread_set_affinity(int id, thread_cpu_mask_t const& affinity)
 {
     cpu_scoped_irq_disable intr_was_enabled;
     cpu_info_t *cpu = this_cpu();
     size_t cpu_number = cpu - cpus;
 
-    threads[id].cpu_affinity = affinity;
+    thread_info_t *thread = thread_lookup(id);
+
+    thread->cpu_affinity = affinity;
+
+    thread_tickless_kick(thread);
 
     // Are we changing current thread affinity?
-    while (cpu->cur_thread == threads + id &&
-            !(affinity & (1 << cpu_number))) {
+    while (cpu->cur_thread == thread &&
+            !affinity.test(cpu_number)) {
         // Get off this CPU
         thread_yield();
 
@@ -1001,15 +1993,72 @@ EXPORT void thread_set_affinity(int id, uint64_t affinity)
     }
 }
 
+EXPORT int thread_set_isolated(thread_cpu_mask_t const& isolated)
+{
+    // The boot CPU keeps the housekeeping work
+    if (isolated.test(0))
+        return -int(errno_t::EINVAL);
+
+    thread_isolation_scoped_lock lock(thread_isolation_lock);
+
+    thread_isolated_cpus = isolated;
+
+    for (size_t c = 0; c < MAX_CPUS; ++c)
+        cpus[c].isolated = isolated.test(c);
+
+    thread_isolation_active = !isolated.empty();
+
+    lock.unlock();
+
+    // Routes chosen before the change may target a newly isolated CPU
+    apic_irq_reroute_isolated();
+
+    // Make each CPU reconsider what it is running. CPUs that have not
+    // started yet pick up their setting when they come online
+    if (thread_idle_ready) {
+        for (size_t c = 0; c < cpu_count; ++c)
+            thread_send_ipi(c, INTR_THREAD_RESCHED);
+    }
+
+    return 0;
+}
+
+EXPORT thread_cpu_mask_t thread_get_isolated()
+{
+    thread_isolation_scoped_lock lock(thread_isolation_lock);
+    return thread_isolated_cpus;
+}
+
+EXPORT bool thread_cpu_is_isolated(int cpu)
+{
+    return unsigned(cpu) < MAX_CPUS && cpus[cpu].isolated;
+}
+
+EXPORT int thread_cpu_irq_target(int cpu)
+{
+    if (likely(!thread_isolation_active) ||
+            (cpu >= 0 && !thread_cpu_is_isolated(cpu)))
+        return cpu;
+
+    // Use the next CPU that is not isolated, the boot CPU never is
+    int total = acpi_cpu_count();
+    for (int c = cpu + 1; c < total; ++c) {
+        if (!thread_cpu_is_isolated(c))
+            return c;
+    }
+
+    return 0;
+}
+
 EXPORT thread_priority_t thread_get_priority(thread_t thread_id)
 {
-    return threads[thread_id].priority;
+    return thread_lookup(thread_id)->priority;
 }
 
 EXPORT void thread_set_priority(thread_t thread_id,
                                 thread_priority_t priority)
 {
-    threads[thread_id].priority = priority;
+    thread_lookup(thread_id)->priority = priority;
 }
 
 void thread_check_stack()
@@ -1096,10 +2145,40 @@ int thread_cpu_number()
     return cpu - cpus;
 }
 
+void thread_sched_stats_reset()
+{
+    memset(thread_sched_stats, 0, sizeof(thread_sched_stats));
+}
+
+static void thread_sched_hist_dump(char const *name, uint64_t const *hist)
+{
+    printk("  %s:\n", name);
+    for (size_t i = 0; i < THREAD_SCHED_HIST_BUCKETS; ++i) {
+        if (hist[i])
+            printk("    < 2^%-2zu cycles: %" PRIu64 "\n", i, hist[i]);
+    }
+}
+
+void thread_sched_stats_dump()
+{
+    for (size_t c = 0; c < cpu_count; ++c) {
+        thread_sched_stats_t const *stats = thread_sched_stats + c;
+
+        printk("cpu %zu: %" PRIu64 " switches, %" PRIu64 " involuntary,"
+               " %" PRIu64 " migrations\n",
+               c, stats->switch_count, stats->involuntary_count,
+               stats->migration_count);
+
+        thread_sched_hist_dump("wake to run latency", stats->wake_latency);
+        thread_sched_hist_dump("time slice", stats->slice_length);
+        thread_sched_hist_dump("preempted time slice", stats->preempt_slice);
+    }
+}
+
 isr_context_t *thread_schedule_if_idle(isr_context_t *ctx)
 {
     thread_info_t *cur_thread = this_thread();
-    if (cur_thread - threads < cpu_count && thread_idle_ready)
+    if (size_t(cur_thread->thread_id) < cpu_count && thread_idle_ready)
         return thread_schedule(ctx);
     return ctx;
 }
@@ -1110,6 +2189,16 @@ process_t *thread_current_process()
     return thread->process;
 }
 
+process_t *thread_get_process(thread_t tid)
+{
+    thread_info_t *thread = thread_lookup(tid);
+
+    if (unlikely(!thread || thread->state == THREAD_IS_UNINITIALIZED))
+        return nullptr;
+
+    return thread->process;
+}
+
 
 uint32_t thread_get_cpu_apic_id(int cpu)
 {
@@ -1148,7 +2237,7 @@ errno_t thread_get_error()
 void *thread_get_fsbase(int thread)
 {
     if (cpu_count) {
-        thread_info_t *info = thread >= 0 ? threads + thread : this_thread();
+        thread_info_t *info = thread >= 0 ? thread_lookup(thread) : this_thread();
         return info->fsbase;
     }
     return nullptr;
@@ -1157,7 +2246,7 @@ void *thread_get_fsbase(int thread)
 void *thread_get_gsbase(int thread)
 {
     if (cpu_count) {
-        thread_info_t *info = thread >= 0 ? threads + thread : this_thread();
+        thread_info_t *info = thread >= 0 ? thread_lookup(thread) : this_thread();
         return info->gsbase;
     }
     return nullptr;
@@ -1165,7 +2254,7 @@ void *thread_get_gsbase(int thread)
 
 void thread_set_process(int thread, process_t *process)
 {
-    thread_info_t *info = thread >= 0 ? threads + thread : this_thread();
+    thread_info_t *info = thread >= 0 ? thread_lookup(thread) : this_thread();
     info->process = process;
 }
 
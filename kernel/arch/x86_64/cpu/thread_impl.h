@@ -10,6 +10,8 @@ extern uint32_t volatile thread_smp_running;
 
 isr_context_t *thread_schedule(isr_context_t *ctx);
 isr_context_t *thread_schedule_if_idle(isr_context_t *ctx);
+extern "C" isr_context_t *thread_fpu_trap_handler(
+        int intr, isr_context_t *ctx);
 void thread_init(int ap);
 int thread_cpu_count(void);
 uint32_t thread_cpus_started(void);
@@ -0,0 +1,149 @@
+#include "tsc.h"
+#include "hpet.h"
+#include "legacy_pit.h"
+#include "cpu_broadcast.h"
+#include "thread_impl.h"
+#include "callout.h"
+#include "cpuid.h"
+#include "printk.h"
+#include "time.h"
+#include "inttypes.h"
+#include "cpu/atomic.h"
+#include "cpu/spinlock.h"
+#include "cpu/control_regs.h"
+
+// Round trips through the shared last value per AP. Enough to see a
+// warp of a few hundred cycles, without delaying boot much
+#define TSC_WARP_LOOPS  10000
+
+static bool tsc_reliable = true;
+
+uint64_t tsc_cpuid_hz()
+{
+    cpuid_t info;
+
+    // TSC/crystal ratio in ebx/eax, crystal Hz in ecx
+    if (!cpuid(&info, CPUID_TSC_FREQ, 0) || !info.eax || !info.ebx)
+        return 0;
+
+    uint64_t numer = info.ebx;
+    uint64_t denom = info.eax;
+
+    if (info.ecx)
+        return uint64_t(info.ecx) * numer / denom;
+
+    // Crystal not reported, the base frequency is the TSC frequency
+    if (cpuid(&info, CPUID_PROC_FREQ, 0) && (info.eax & 0xFFFF))
+        return uint64_t(info.eax & 0xFFFF) * 1000000;
+
+    return 0;
+}
+
+bool tsc_is_reliable()
+{
+    return tsc_reliable;
+}
+
+// Values read from the TSC by two CPUs, serialized by a lock
+struct tsc_warp_t {
+    spinlock_t lock;
+    uint64_t last;
+    uint64_t max_warp;
+    int volatile arrived;
+};
+
+static void tsc_warp_check(void *arg)
+{
+    tsc_warp_t *warp = (tsc_warp_t *)arg;
+
+    // Start together
+    atomic_inc(&warp->arrived);
+    while (atomic_ld_acq(&warp->arrived) < 2)
+        pause();
+
+    for (size_t i = 0; i < TSC_WARP_LOOPS; ++i) {
+        spinlock_lock(&warp->lock);
+        uint64_t prev = warp->last;
+        uint64_t now = cpu_rdtsc_ordered();
+        warp->last = now;
+        spinlock_unlock(&warp->lock);
+
+        // Time went backwards from one CPU to the other
+        if (unlikely(int64_t(now - prev) < 0))
+            atomic_max(&warp->max_warp, prev - now);
+    }
+}
+
+static void tsc_adjust_sync(void *arg)
+{
+    uint64_t adjust = *(uint64_t *)arg;
+
+    if (cpu_msr_get(CPU_MSR_TSC_ADJUST) != adjust)
+        cpu_msr_set(CPU_MSR_TSC_ADJUST, adjust);
+}
+
+static void tsc_validate(void *)
+{
+    // Nothing to check unless the TSC is the clock
+    if (!cpuid_has_inrdtsc())
+        return;
+
+    int cpu_count = thread_cpu_count();
+
+    if (cpu_count < 2)
+        return;
+
+    // Firmware may have written a different TSC_ADJUST on each CPU,
+    // which offsets its TSC. Make them all match the BSP
+    if (cpuid_has_tsc_adjust()) {
+        uint64_t adjust = cpu_msr_get(CPU_MSR_TSC_ADJUST);
+        thread_cpu_mask_t all = thread_cpu_mask_t::all();
+        cpu_call_mask(all, tsc_adjust_sync, &adjust, true);
+    }
+
+    // Stay on this CPU while comparing it with each of the others
+    cpu_scoped_irq_disable intr_was_enabled;
+    int self = thread_cpu_number();
+
+    uint64_t max_warp = 0;
+
+    for (int cpu = 0; cpu < cpu_count; ++cpu) {
+        if (cpu == self)
+            continue;
+
+        tsc_warp_t warp{};
+
+        // Runs on this CPU and on the other one at the same time
+        thread_cpu_mask_t pair(self);
+        pair.set(cpu);
+        cpu_call_mask(pair, tsc_warp_check, &warp, true);
+
+        if (warp.max_warp) {
+            printk("TSC: CPU %d is %" PRIu64 " cycles"
+                   " out of sync with CPU %d\n", cpu, warp.max_warp, self);
+        }
+
+        if (max_warp < warp.max_warp)
+            max_warp = warp.max_warp;
+    }
+
+    intr_was_enabled.restore();
+
+    if (!max_warp)
+        return;
+
+    tsc_reliable = false;
+
+    // The new clock continues from the TSC time, or time_ns would
+    // jump back to the HPET or PIT count
+    uint64_t now_ns = time_ns();
+
+    if (hpet_use_as_clock(now_ns)) {
+        printk("TSC: unsynchronized, using HPET\n");
+    } else {
+        printk("TSC: unsynchronized, using PIT\n");
+        pit8254_enable(true, now_ns);
+    }
+}
+
+REGISTER_CALLOUT(tsc_validate, nullptr, callout_type_t::smp_online, "010");
@@ -0,0 +1,8 @@
+#pragma once
+#include "types.h"
+
+// TSC frequency in Hz reported by CPUID, or 0 if it is not reported
+uint64_t tsc_cpuid_hz();
+
+// True until the TSC failed the cross-CPU check at SMP online
+bool tsc_is_reliable();
@@ -0,0 +1,87 @@
+#include "vdso.h"
+#include "tsc.h"
+#include "cpuid.h"
+#include "mm.h"
+#include "time.h"
+#include "callout.h"
+#include "assert.h"
+#include "printk.h"
+#include "cpu/atomic.h"
+#include "cpu/spinlock.h"
+#include "cpu/control_regs.h"
+
+C_ASSERT(offsetof(vdso_time_data_t, seq) == VDSO_TIME_SEQ_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, enabled) == VDSO_TIME_ENABLED_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, base_tsc) == VDSO_TIME_BASE_TSC_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, base_ns) == VDSO_TIME_BASE_NS_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, mult) == VDSO_TIME_MULT_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, shift) == VDSO_TIME_SHIFT_OFS);
+C_ASSERT(offsetof(vdso_time_data_t, realtime_ns) == VDSO_TIME_REALTIME_OFS);
+C_ASSERT(sizeof(seqcount) == sizeof(uint32_t));
+C_ASSERT(VDSO_SIZE == PAGESIZE * 2);
+
+// The page of code in vdso_text.S
+extern char vdso_text_st[];
+
+// A whole page, so no other kernel data is visible to user mode
+static struct alignas(PAGESIZE) vdso_data_page_t {
+    vdso_time_data_t time;
+    char pad[PAGESIZE - sizeof(vdso_time_data_t)];
+} vdso_data;
+
+C_ASSERT(sizeof(vdso_data) == PAGESIZE);
+
+// Serializes writers of seq
+static spinlock_t vdso_time_lock;
+
+void vdso_time_set_clock(uint64_t base_tsc, uint64_t base_ns,
+                         uint64_t mult, uint32_t shift)
+{
+    vdso_time_data_t *data = &vdso_data.time;
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    spinlock_lock(&vdso_time_lock);
+    data->seq.write_begin();
+
+    data->base_tsc = base_tsc;
+    data->base_ns = base_ns;
+    data->mult = mult;
+    data->shift = shift;
+
+    data->seq.write_end();
+    spinlock_unlock(&vdso_time_lock);
+}
+
+// After the TSC has been checked on every CPU
+static void vdso_time_start(void *)
+{
+    vdso_time_data_t *data = &vdso_data.time;
+
+    int64_t realtime_ns = time_realtime_base();
+    // Only when time_ns is the TSC clock, user mode would not
+    // agree with the kernel otherwise
+    bool enabled = cpuid_has_inrdtsc() && tsc_is_reliable() && data->mult;
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    spinlock_lock(&vdso_time_lock);
+    data->seq.write_begin();
+
+    data->realtime_ns = realtime_ns;
+    data->enabled = enabled;
+
+    data->seq.write_end();
+    spinlock_unlock(&vdso_time_lock);
+
+    printdbg("vdso: clock_gettime %s\n",
+             enabled ? "in user mode" : "through syscall");
+}
+
+REGISTER_CALLOUT(vdso_time_start, nullptr, callout_type_t::smp_online, "020");
+
+bool vdso_map_process()
+{
+    return mmap_phys_user((void*)VDSO_BASE, mphysaddr(vdso_text_st),
+                          PAGESIZE, PROT_READ | PROT_EXEC) &&
+            mmap_phys_user((void*)(VDSO_BASE + PAGESIZE),
+                           mphysaddr(&vdso_data), PAGESIZE, PROT_READ);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "types.h"
+#include "vdso_constants.h"
+#include "mutex.h"
+
+// Read in user mode with a sequence count, the writer makes seq odd
+// while it updates the fields. Layout is shared with vdso_text.S,
+// which repeats the seqcount read side in user mode
+struct vdso_time_data_t {
+    seqcount seq;
+
+    // Zero when user mode must make the clock_gettime syscall
+    uint32_t enabled;
+
+    // ns = base_ns + (((tsc - base_tsc) * mult) >> shift)
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t mult;
+    uint32_t shift;
+    uint32_t reserved;
+
+    // Added to the monotonic time for CLOCK_REALTIME
+    int64_t realtime_ns;
+};
+
+// Called with each new TSC to nanoseconds conversion
+void vdso_time_set_clock(uint64_t base_tsc, uint64_t base_ns,
+                         uint64_t mult, uint32_t shift);
+
+// Map the vDSO into the current process at VDSO_BASE
+bool vdso_map_process();
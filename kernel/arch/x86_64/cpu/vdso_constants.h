@@ -0,0 +1,25 @@
+#pragma once
+
+// Careful, this is included in assembly code
+
+// Fixed user address of the vDSO in every process, the code page
+// followed by the time data page. libc calls the entry points here
+#define VDSO_BASE                   0x7FFFFFFFD000
+#define VDSO_SIZE                   0x2000
+
+// Entry points, offsets from VDSO_BASE
+#define VDSO_CLOCK_GETTIME_OFS      0
+
+// Time data page, offsets of the fields of vdso_time_data_t
+#define VDSO_TIME_SEQ_OFS           0
+#define VDSO_TIME_ENABLED_OFS       4
+#define VDSO_TIME_BASE_TSC_OFS      8
+#define VDSO_TIME_BASE_NS_OFS       16
+#define VDSO_TIME_MULT_OFS          24
+#define VDSO_TIME_SHIFT_OFS         32
+#define VDSO_TIME_REALTIME_OFS      40
+
+#define VDSO_CLOCK_REALTIME         0
+#define VDSO_CLOCK_MONOTONIC        1
+
+#define VDSO_SYS_CLOCK_GETTIME      228
@@ -2472,6 +2472,7 @@ void gdb_cpu_ctrl_t::start()
     }
 
     stub_tid = thread_create(gdb_thread, nullptr, 0, false);
+    thread_close(stub_tid);
 
     cpu_wait_value(&stub_running, true);
 
@@ -2504,7 +2505,7 @@ void gdb_cpu_ctrl_t::gdb_thread()
 
     gdb_cpu = cpus.size();
 
-    thread_set_affinity(stub_tid, 1U << (gdb_cpu));
+    thread_set_affinity(stub_tid, thread_cpu_mask_t(gdb_cpu));
 
     // Set GDB stub to time critical priority
     thread_set_priority(stub_tid, 32767);
@@ -1,10 +1,100 @@
 #include "nano_time.h"
 #include "time.h"
+#include "mutex.h"
+#include "likely.h"
 #include "cpu/control_regs.h"
+#include "cpu/vdso.h"
 
 uint64_t rdtsc_mhz;
-uint64_t clk_to_ns_numer;
-uint64_t clk_to_ns_denom;
+
+// Conversion from TSC ticks to nanoseconds, rarely written. Readers take
+// no lock and do no atomic read-modify-write. Each direction is one
+// multiply and one shift
+struct nano_time_clock_t {
+    uint64_t base_tsc;
+    uint64_t base_ns;
+
+    // ns = (ticks * mult) >> shift
+    uint64_t mult;
+    uint32_t shift;
+
+    // ticks = (ns * inv_mult) >> inv_shift
+    uint32_t inv_shift;
+    uint64_t inv_mult;
+};
+
+static nano_time_clock_t nano_time_clock;
+static seqlock nano_time_clock_lock;
+
+static _always_inline uint64_t nano_time_scale(
+        uint64_t n, uint64_t mult, uint32_t shift)
+{
+    return uint64_t((__uint128_t(n) * mult) >> shift);
+}
+
+// The largest shift that keeps numer << shift in 64 bits
+static void nano_time_ratio(uint64_t *mult, uint32_t *shift,
+                            uint64_t numer, uint64_t denom)
+{
+    *shift = __builtin_clzll(numer);
+    *mult = (numer << *shift) / denom;
+}
+
+static _always_inline nano_time_clock_t nano_time_clock_get()
+{
+    nano_time_clock_t clock;
+    uint32_t seq;
+
+    do {
+        seq = nano_time_clock_lock.read_begin();
+        clock = nano_time_clock;
+    } while (unlikely(nano_time_clock_lock.read_retry(seq)));
+
+    return clock;
+}
+
+void nano_time_set_rate(uint64_t numer, uint64_t denom)
+{
+    // time_ns is read in IRQ handlers
+    cpu_scoped_irq_disable intr_was_enabled;
+    unique_lock<seqlock> lock(nano_time_clock_lock);
+
+    uint64_t now = cpu_rdtsc();
+
+    uint64_t mult;
+    uint32_t shift;
+    nano_time_ratio(&mult, &shift, numer, denom);
+
+    // Continue from the time at the old rate, if there was one
+    if (nano_time_clock.mult) {
+        nano_time_clock.base_ns += nano_time_scale(
+                    now - nano_time_clock.base_tsc,
+                    nano_time_clock.mult, nano_time_clock.shift);
+    } else {
+        nano_time_clock.base_ns = nano_time_scale(now, mult, shift);
+    }
+
+    nano_time_clock.base_tsc = now;
+    nano_time_clock.mult = mult;
+    nano_time_clock.shift = shift;
+    nano_time_ratio(&nano_time_clock.inv_mult, &nano_time_clock.inv_shift,
+                    denom, numer);
+
+    vdso_time_set_clock(now, nano_time_clock.base_ns, mult, shift);
+}
+
+uint64_t nano_time_clock_ns()
+{
+    nano_time_clock_t clock = nano_time_clock_get();
+
+    // The TSC may be read before the base of a concurrent rate change
+    uint64_t now = cpu_rdtsc();
+    uint64_t elapsed = likely(now > clock.base_tsc)
+            ? now - clock.base_tsc
+            : 0;
+
+    return clock.base_ns + nano_time_scale(elapsed, clock.mult, clock.shift);
+}
 
 uint64_t nano_time(void)
 {
@@ -13,10 +103,12 @@ uint64_t nano_time(void)
 
 uint64_t nano_time_ns(uint64_t a, uint64_t b)
 {
-    return ((b - a) * clk_to_ns_numer) / clk_to_ns_denom;
+    nano_time_clock_t clock = nano_time_clock_get();
+    return nano_time_scale(b - a, clock.mult, clock.shift);
 }
 
 uint64_t nano_time_add(uint64_t after, uint64_t ns)
 {
-    return after + (ns * clk_to_ns_denom) / clk_to_ns_numer;
+    nano_time_clock_t clock = nano_time_clock_get();
+    return after + nano_time_scale(ns, clock.inv_mult, clock.inv_shift);
 }
@@ -2,5 +2,10 @@
 #include "types.h"
 
 extern uint64_t rdtsc_mhz;
-extern uint64_t clk_to_ns_numer;
-extern uint64_t clk_to_ns_denom;
+
+// Set the TSC to nanoseconds ratio,
+// the clock stays continuous across a change
+void nano_time_set_rate(uint64_t numer, uint64_t denom);
+
+// Nanoseconds from the TSC, takes no lock
+uint64_t nano_time_clock_ns();
@@ -1,6 +1,7 @@
 #pragma once
 #include "errno.h"
 #include "mutex.h"
+#include "work_queue.h"
 #include "cpu/atomic.h"
 
 // I/O completion
@@ -207,6 +208,177 @@ T basic_blocking_iocp_t<T, S>::wait()
     return status;
 }
 
+// Joins the completions of any number of iocps, without blocking
+// a thread per request. Attach each iocp before starting its
+// operation, then either pass the rest of the work to then(), or
+// block one thread for all of them with wait().
+//
+// C++14 has no coroutines, the continuation is a callable taking the
+// result, the first failure if any operation failed. It runs on the
+// work queue of the CPU that completed the last operation
+template<typename T, typename S = T>
+class basic_iocp_join_t {
+public:
+    using iocp_type = basic_iocp_t<T, S>;
+
+    basic_iocp_join_t();
+    ~basic_iocp_join_t();
+
+    basic_iocp_join_t(basic_iocp_join_t const&) = delete;
+    basic_iocp_join_t &operator=(basic_iocp_join_t const&) = delete;
+
+    // Routes the completion of iocp to this join
+    void attach(iocp_type *iocp);
+
+    // Starting the operation of an attached iocp failed, completes
+    // the iocp with the error since the device never will
+    void fail(iocp_type *iocp, T const& err);
+
+    // Call once, after attaching every iocp. The join may be destroyed
+    // as soon as the continuation starts. Returns false if out of
+    // memory, wait() is still usable then
+    template<typename F>
+    bool then(F&& continuation);
+
+    // Call once, instead of then. Returns the first failure, if any
+    // operation failed
+    T wait();
+
+private:
+    struct continuation_base_t : public workq_work {
+        T result;
+    };
+
+    template<typename F>
+    struct continuation_t final : public continuation_base_t {
+        continuation_t(F&& fn)
+            : fn(forward<F>(fn))
+        {
+        }
+
+        void invoke() override final
+        {
+            fn(this->result);
+        }
+
+        typename remove_reference<F>::type fn;
+    };
+
+    using lock_type = mcslock;
+    using scoped_lock = unique_lock<lock_type>;
+
+    static void handler(T const& result, uintptr_t arg);
+    void set_result(T const& sub_result);
+    void release();
+
+    // One for each incomplete operation, plus one until then or wait
+    unsigned volatile pending;
+    bool failed;
+    bool volatile done;
+    continuation_base_t *work;
+    lock_type lock;
+    condition_variable done_cond;
+    T result;
+};
+
+template<typename T, typename S>
+basic_iocp_join_t<T, S>::basic_iocp_join_t()
+    : pending(1)
+    , failed(false)
+    , done(false)
+    , work(nullptr)
+    , result{}
+{
+}
+
+template<typename T, typename S>
+basic_iocp_join_t<T, S>::~basic_iocp_join_t()
+{
+    assert(pending == 0);
+}
+
+template<typename T, typename S>
+void basic_iocp_join_t<T, S>::attach(iocp_type *iocp)
+{
+    atomic_inc(&pending);
+    iocp->reset(&basic_iocp_join_t::handler, uintptr_t(this));
+}
+
+template<typename T, typename S>
+void basic_iocp_join_t<T, S>::fail(iocp_type *iocp, T const& err)
+{
+    // Reaches handler like a completion would
+    iocp->set_result(err);
+    iocp->set_expect(1);
+    iocp->invoke();
+}
+
+template<typename T, typename S>
+template<typename F>
+bool basic_iocp_join_t<T, S>::then(F&& continuation)
+{
+    work = workq::construct<continuation_t<F>>(forward<F>(continuation));
+
+    if (unlikely(!work))
+        return false;
+
+    release();
+
+    return true;
+}
+
+template<typename T, typename S>
+T basic_iocp_join_t<T, S>::wait()
+{
+    release();
+
+    scoped_lock hold(lock);
+    while (!done)
+        done_cond.wait(hold);
+    return result;
+}
+
+template<typename T, typename S>
+void basic_iocp_join_t<T, S>::handler(T const& result, uintptr_t arg)
+{
+    basic_iocp_join_t *join = (basic_iocp_join_t*)arg;
+    join->set_result(result);
+    join->release();
+}
+
+template<typename T, typename S>
+void basic_iocp_join_t<T, S>::set_result(T const& sub_result)
+{
+    if (S::succeeded(sub_result))
+        return;
+
+    // Keep the first failure
+    scoped_lock hold(lock);
+    if (!failed) {
+        failed = true;
+        result = sub_result;
+    }
+}
+
+template<typename T, typename S>
+void basic_iocp_join_t<T, S>::release()
+{
+    if (atomic_dec(&pending) != 0)
+        return;
+
+    if (work) {
+        // Resume on the completing CPU, the join may go away after this
+        work->result = result;
+        workq::enqueue(work);
+        return;
+    }
+
+    // The waiter may destroy the join as soon as it can take the lock
+    scoped_lock hold(lock);
+    done = true;
+    done_cond.notify_all();
+}
+
 template<typename T>
 struct __basic_iocp_error_success_t {
     static constexpr bool succeeded(errno_t const& status)
@@ -218,3 +390,5 @@ struct __basic_iocp_error_success_t {
 using iocp_t = basic_iocp_t<errno_t, __basic_iocp_error_success_t<errno_t>>;
 using blocking_iocp_t = basic_blocking_iocp_t<errno_t,
     __basic_iocp_error_success_t<errno_t>>;
+using iocp_join_t = basic_iocp_join_t<errno_t,
+    __basic_iocp_error_success_t<errno_t>>;
@@ -136,6 +136,16 @@ struct pci_msix_mappings {
 
 static vector<pair<pci_addr_t, pci_msix_mappings>> pcix_tables;
 
+// Where to rewrite the message when an MSI IRQ moves to another CPU
+struct pci_msi_irq_t {
+    pci_addr_t addr;
+    int capability;
+
+    // MSI-X table, null for MSI
+    pci_msix64_t volatile *tbl;
+    int table_count;
+};
+
 #define offset_of(type, member) \
     ((uintptr_t)&(((type*)0x10U)->member) - 0x10U)
 #define size_of(type, member) \
@@ -733,6 +743,35 @@ int pci_vector_count_from_offsets(int const *vector_offsets, int count)
     }) + 1;
 }
 
+static void pci_msi_irq_write(void *arg, msi_irq_mem_t const *mem)
+{
+    pci_msi_irq_t const *msi = (pci_msi_irq_t const *)arg;
+
+    if (!msi->tbl) {
+        // Only the destination changes, the low address dword
+        uint32_t addr_lo = uint32_t(mem->addr);
+        pci_config_write(msi->addr,
+                         msi->capability + sizeof(pci_msi_caps_hdr_t),
+                         &addr_lo, sizeof(addr_lo));
+        return;
+    }
+
+    // Every table entry that sends this vector
+    for (int i = 0; i < msi->table_count; ++i) {
+        pci_msix64_t volatile *ent = msi->tbl + i;
+
+        if (uint8_t(ent->data) != uint8_t(mem->data))
+            continue;
+
+        // Entries may only be modified while masked
+        uint32_t ctrl = ent->ctrl;
+        ent->ctrl = ctrl | PCI_MSIX_VEC_CTL_MASKIRQ;
+        ent->addr = mem->addr;
+        ent->data = mem->data;
+        ent->ctrl = ctrl;
+    }
+}
+
 // Returns with the function masked if possible
 // Use pci_set_irq_mask to unmask it when appropriate
 bool pci_set_msi_irq(pci_addr_t addr, pci_irq_range_t *irq_range,
@@ -852,6 +891,14 @@ bool pci_set_msi_irq(pci_addr_t addr, pci_irq_range_t *irq_range,
             PCI_MSIX_VEC_CTL_MASKIRQ_SET(tbl[i].ctrl, 0);
         }
 
+        pci_msi_irq_t *msi = new pci_msi_irq_t{
+                addr, capability, tbl, table_count };
+
+        for (i = 0; msi && i < irq_range->count; ++i) {
+            apic_msi_irq_set_writer(irq_range->base + i,
+                                    pci_msi_irq_write, msi);
+        }
+
         pci_config_write(addr,
                          capability + offsetof(pci_msi_caps_hdr_t, msg_ctrl),
                          &caps.msg_ctrl, sizeof(caps.msg_ctrl));
@@ -913,6 +960,17 @@ bool pci_set_msi_irq(pci_addr_t addr, pci_irq_range_t *irq_range,
         pci_config_write(addr,
                          capability + offsetof(pci_msi_caps_hdr_t, msg_ctrl),
                          &caps.msg_ctrl, sizeof(caps.msg_ctrl));
+
+        // Multiple messages share one address, they cannot move apart
+        if (irq_range->count == 1) {
+            pci_msi_irq_t *msi = new pci_msi_irq_t{
+                    addr, capability, nullptr, 0 };
+
+            if (msi) {
+                apic_msi_irq_set_writer(irq_range->base,
+                                        pci_msi_irq_write, msi);
+            }
+        }
     }
 
     return true;
@@ -3,6 +3,7 @@
 #include "callout.h"
 #include "vector.h"
 #include "irq.h"
+#include "cpu/irq_balance.h"
 #include "mutex.h"
 #include "cpu/control_regs.h"
 #include "nano_time.h"
@@ -766,7 +767,8 @@ ssize_t uart_async_t::read(void *buf, size_t size, size_t min_read)
 
 void uart_async_t::route_irq(int cpu)
 {
-    irq_setcpu(irq, cpu);
+    // Pinned, so the balancer does not move it off that CPU
+    irq_set_affinity(irq, cpu);
 }
 
 void uart_async_t::send_some(scoped_lock const&)
@@ -40,6 +40,67 @@ STORAGE_REGISTER_FACTORY(mbr_part);
 
 static vector<part_dev_t*> partitions;
 
+// Linux partitions are only listed if their first sector is readable,
+// read all of them at once. The results are checked by a continuation
+// on the work queue of the CPU that completed the last read
+static void check_readable(storage_dev_base_t *drive, long sector_size,
+                           partition_tbl_ent_t const *ptbl, bool *readable)
+{
+    int count = 0;
+    for (int i = 0; i < 4; ++i)
+        count += (ptbl[i].system_id == 0x83);
+
+    if (!count)
+        return;
+
+    unique_ptr<uint8_t[]> sectors(new uint8_t[sector_size * count]);
+    unique_ptr<iocp_t[]> iocps(new iocp_t[count]);
+    int iocp_index[4];
+
+    iocp_join_t join;
+
+    for (int i = 0, n = 0; i < 4; ++i) {
+        if (ptbl[i].system_id != 0x83)
+            continue;
+
+        iocp_index[i] = n;
+        join.attach(&iocps[n]);
+
+        errno_t err = drive->read_async(sectors + n * sector_size, 1,
+                                        ptbl[i].start_lba, &iocps[n]);
+
+        if (err == errno_t::OK)
+            readable[i] = true;
+        else
+            join.fail(&iocps[n], err);
+
+        ++n;
+    }
+
+    auto check = [&](errno_t const&) {
+        for (int i = 0; i < 4; ++i) {
+            if (readable[i] && !iocps[iocp_index[i]])
+                readable[i] = false;
+        }
+    };
+
+    // The continuation completes this, the probe itself is synchronous
+    blocking_iocp_t checked;
+    checked.set_expect(1);
+
+    bool queued = join.then([&](errno_t const& err) {
+        check(err);
+        checked.invoke();
+    });
+
+    if (queued) {
+        checked.wait();
+    } else {
+        check(join.wait());
+        checked.invoke();
+    }
+}
+
 vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
 {
     vector<part_dev_t *> list;
@@ -55,6 +116,9 @@ vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
                 partition_tbl_ent_t ptbl[4];
                 memcpy(ptbl, sector + 446, sizeof(ptbl));
 
+                bool readable[4] = {};
+                check_readable(drive, sector_size, ptbl, readable);
+
                 for (int i = 0; i < 4; ++i) {
                     unique_ptr<part_dev_t> part;
 
@@ -74,11 +138,7 @@ vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
 
                     case 0x83:
                         // Linux filesystem
-                        unique_ptr<uint8_t> ext_superblock =
-                                new uint8_t[sector_size];
-
-                        if (drive->read_blocks(ext_superblock, 1,
-                                                ptbl[i].start_lba) < 0) {
+                        if (!readable[i]) {
                             MBR_TRACE("Unable to read linux partition"
                                       " (at LBA %u)!\n", ptbl[i].start_lba);
                             break;
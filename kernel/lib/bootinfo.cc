@@ -31,6 +31,9 @@ uintptr_t bootinfo_parameter(bootparam_t param)
     case bootparam_t::boot_mptables:
         return uintptr_t(&data->mptables);
 
+    case bootparam_t::boot_isolated_cpus:
+        return data->isolated_cpus;
+
     default:
         return 0;
     }
@@ -9,7 +9,8 @@ enum struct bootparam_t {
     boot_debugger,
     boot_serial_log,
     boot_acpi_rsdp,
-    boot_mptables
+    boot_mptables,
+    boot_isolated_cpus
 };
 
 extern "C" uintptr_t bootinfo_parameter(bootparam_t param);
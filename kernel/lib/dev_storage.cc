@@ -4,6 +4,7 @@
 #include "string.h"
 #include "assert.h"
 #include "vector.h"
+#include "mutex.h"
 #include "cpu/control_regs.h"
 
 #define DEBUG_STORAGE   0
@@ -30,6 +31,10 @@ static vector<part_factory_t*> part_factories;
 static vector<fs_reg_t*> fs_regs;
 static vector<fs_mount_t> fs_mounts;
 
+// Looked up on every path open, changed only when mounting. Mounting
+// may reallocate the vector in place, readers must hold it shared
+static shared_brlock fs_mounts_lock;
+
 size_t storage_dev_count()
 {
     return storage_devs.size();
@@ -130,15 +135,22 @@ void fs_mount(char const *fs_name, fs_init_info_t *info)
 
     fs_base_t *mfs = fs_reg->factory->mount(info);
 
-    if (mfs && mfs->is_boot())
+    if (!mfs)
+        return;
+
+    unique_lock<shared_brlock> lock(fs_mounts_lock);
+
+    if (mfs->is_boot())
         fs_mounts.insert(fs_mounts.begin(), fs_mount_t{ fs_reg, mfs });
-    else if (mfs)
+    else
         fs_mounts.push_back(fs_mount_t{ fs_reg, mfs });
 }
 
 fs_base_t *fs_from_id(size_t id)
 {
-    return !fs_mounts.empty()
+    shared_lock<shared_brlock> lock(fs_mounts_lock);
+
+    return id < fs_mounts.size()
             ? fs_mounts[id].fs
             : nullptr;
 }
@@ -5,27 +5,63 @@
 #include "mm.h"
 #include "stdlib.h"
 #include "string.h"
-#include "vector.h"
 #include "mutex.h"
+#include "rcu.h"
+#include "refcount.h"
+#include "cpu/atomic.h"
 
 struct filetab_t {
     fs_file_info_t *fi;
     fs_base_t *fs;
     off_t pos;
     filetab_t *next_free;
+    int id;
+
+    // Descriptors referring to it, dup adds one, close drops one
     int refcount;
+
+    // Operations in progress, plus one until the last close
+    percpu_refcount users;
 };
 
+// Entries are never freed, the id indexes a table of pointers to them.
+// The table grows by publishing a bigger copy and freeing the old copy
+// after a grace period, so looking up an id takes no lock
+struct file_table_t {
+    rcu_head_t rcu;
+    size_t volatile count;
+    size_t capacity;
+    filetab_t **items;
+};
+
+#define FILE_TABLE_INITIAL  64
+
+// Serializes allocating and freeing entries
 using file_table_lock_type = mcslock;
 using file_table_scoped_lock = unique_lock<file_table_lock_type>;
 static file_table_lock_type file_table_lock;
-static vector<filetab_t> file_table;
+static file_table_t *file_table;
 static filetab_t *file_table_ff;
 
+static file_table_t *file_table_alloc(size_t capacity)
+{
+    file_table_t *table = (file_table_t*)malloc(
+                sizeof(*table) + capacity * sizeof(*table->items));
+
+    if (unlikely(!table))
+        return nullptr;
+
+    table->count = 0;
+    table->capacity = capacity;
+    table->items = (filetab_t**)(table + 1);
+
+    return table;
+}
+
 static void file_init(void *)
 {
     file_table_scoped_lock lock(file_table_lock);
-    file_table.reserve(1000);
+    atomic_st_rel(&file_table, file_table_alloc(FILE_TABLE_INITIAL));
 }
 
 static fs_base_t *file_fs_from_path(char const *path)
@@ -34,6 +70,8 @@ static fs_base_t *file_fs_from_path(char const *path)
     return fs_from_id(0);
 }
 
+static void file_release_filetab(percpu_refcount *ref);
+
 static filetab_t *file_new_filetab(void)
 {
     file_table_scoped_lock lock(file_table_lock);
@@ -43,36 +81,102 @@ static filetab_t *file_new_filetab(void)
         item = file_table_ff;
         file_table_ff = item->next_free;
         item->next_free = nullptr;
-    } else if (file_table.size() < file_table.capacity()) {
-        // Add another item
-        file_table.emplace_back();
-        item = &file_table.back();
     } else {
-        return nullptr;
+        file_table_t *table = file_table;
+
+        if (unlikely(!table))
+            return nullptr;
+
+        if (table->count == table->capacity) {
+            // Publish a bigger copy, readers may still be using the old
+            file_table_t *new_table = file_table_alloc(table->capacity * 2);
+
+            if (unlikely(!new_table))
+                return nullptr;
+
+            memcpy(new_table->items, table->items,
+                   table->count * sizeof(*table->items));
+            new_table->count = table->count;
+
+            atomic_st_rel(&file_table, new_table);
+
+            call_rcu(&table->rcu, [](rcu_head_t *head) {
+                free(head);
+            });
+
+            table = new_table;
+        }
+
+        // Add another item
+        item = new filetab_t{};
+        item->id = int(table->count);
+        table->items[table->count] = item;
+
+        // Readers check the count before using the slot
+        atomic_st_rel(&table->count, table->count + 1);
     }
     assert(item->refcount == 0);
     item->refcount = 1;
+    item->users.init(file_release_filetab);
     return item;
 }
 
-static bool file_del_filetab(filetab_t *item)
+// Returns 1 if that was the last reference, 0 if others remain, or
+// -EBADF if a concurrent close already dropped the last one
+static int file_del_filetab(filetab_t *item)
 {
-    if (--item->refcount == 0) {
-        item->next_free = file_table_ff;
-        file_table_ff = item;
-        return true;
+    int refcount = atomic_ld_acq(&item->refcount);
+    while (refcount > 0) {
+        if (atomic_cmpxchg_upd(&item->refcount, &refcount, refcount - 1))
+            return refcount == 1;
     }
 
-    return false;
+    return -int(errno_t::EBADF);
 }
 
-bool file_ref_filetab(int id)
+// Called when the last close has happened and the last operation
+// has finished
+static void file_release_filetab(percpu_refcount *ref)
 {
+    filetab_t *item = (filetab_t*)((char*)ref - offsetof(filetab_t, users));
+
+    if (item->fs)
+        item->fs->release(item->fi);
+
+    item->fi = nullptr;
+    item->fs = nullptr;
+    item->pos = 0;
+
     file_table_scoped_lock lock(file_table_lock);
-    if (id >= 0 && id < (int)file_table.size() &&
-            file_table[id].refcount > 0) {
-        ++file_table[id].refcount;
-        return true;
+    item->next_free = file_table_ff;
+    file_table_ff = item;
+}
+
+// Expects to be called in a read side section
+static filetab_t *file_lookup(int id)
+{
+    file_table_t const *table = atomic_ld_acq(&file_table);
+
+    if (likely(table && id >= 0 && size_t(id) < atomic_ld_acq(&table->count)))
+        return table->items[id];
+
+    return nullptr;
+}
+
+bool file_ref_filetab(int id)
+{
+    rcu_scoped_read_lock lock;
+
+    filetab_t *item = file_lookup(id);
+
+    if (unlikely(!item))
+        return false;
+
+    // Never resurrect an entry that is being closed
+    int refcount = atomic_ld_acq(&item->refcount);
+    while (refcount > 0) {
+        if (atomic_cmpxchg_upd(&item->refcount, &refcount, refcount + 1))
+            return true;
     }
 
     return false;
@@ -80,19 +184,57 @@ bool file_ref_filetab(int id)
 
 REGISTER_CALLOUT(file_init, nullptr, callout_type_t::partition_probe, "999");
 
+// Returns the entry with an operation reference held,
+// or null if the id is not open
 static filetab_t *file_fh_from_id(int id)
 {
-    filetab_t *item = nullptr;
-    if (likely(id >= 0 && id < (int)file_table.size())) {
-        item = &file_table[id];
+    rcu_scoped_read_lock lock;
+
+    filetab_t *item = file_lookup(id);
+
+    if (likely(item && item->users.tryget_live()))
+        return item;
 
-        if (likely(item->refcount > 0))
-            return item;
-        assert(!"Zero ref count!");
-    }
     return nullptr;
 }
 
+// Holds an operation reference for the duration of a file operation,
+// a concurrent close releases the file after the operation finishes
+class file_ref_t {
+public:
+    explicit file_ref_t(int id)
+        : fh(file_fh_from_id(id))
+    {
+    }
+
+    ~file_ref_t()
+    {
+        if (fh)
+            fh->users.put();
+    }
+
+    file_ref_t(file_ref_t const&) = delete;
+    file_ref_t &operator=(file_ref_t const&) = delete;
+
+    explicit operator bool() const
+    {
+        return fh != nullptr;
+    }
+
+    filetab_t *operator->() const
+    {
+        return fh;
+    }
+
+    filetab_t *get() const
+    {
+        return fh;
+    }
+
+private:
+    filetab_t *fh;
+};
+
 int file_creat(char const *path, mode_t mode)
 {
     return file_open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
@@ -107,34 +249,43 @@ int file_open(char const *path, int flags, mode_t mode)
 
     filetab_t *fh = file_new_filetab();
 
+    if (unlikely(!fh))
+        return -1;
+
     int status = fs->open(&fh->fi, path, flags, mode);
-    if (status < 0)
+    if (status < 0) {
+        fh->refcount = 0;
+        fh->users.kill();
         return status;
+    }
 
     fh->fs = fs;
     fh->pos = 0;
 
-    return fh - file_table.data();
+    return fh->id;
 }
 
 int file_close(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
 
     if (unlikely(!fh))
-        return -1;
+        return -int(errno_t::EBADF);
 
-    if (file_del_filetab(fh)) {
-        fh->fs->release(fh->fi);
-        memset(fh, 0, sizeof(*fh));
-    }
+    int last = file_del_filetab(fh.get());
+
+    if (unlikely(last < 0))
+        return last;
+
+    if (last)
+        fh->users.kill();
 
     return 0;
 }
 
 ssize_t file_pread(int id, void *buf, size_t bytes, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -143,7 +294,7 @@ ssize_t file_pread(int id, void *buf, size_t bytes, off_t ofs)
 
 ssize_t file_pwrite(int id, void const *buf, size_t bytes, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -152,7 +303,7 @@ ssize_t file_pwrite(int id, void const *buf, size_t bytes, off_t ofs)
 
 int file_syncfs(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -161,7 +312,7 @@ int file_syncfs(int id)
 
 off_t file_seek(int id, off_t ofs, int whence)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -206,7 +357,7 @@ off_t file_seek(int id, off_t ofs, int whence)
 
 int file_ftruncate(int id, off_t size)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -215,7 +366,7 @@ int file_ftruncate(int id, off_t size)
 
 ssize_t file_read(int id, void *buf, size_t bytes)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -228,7 +379,7 @@ ssize_t file_read(int id, void *buf, size_t bytes)
 
 ssize_t file_write(int id, void const *buf, size_t bytes)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -241,7 +392,7 @@ ssize_t file_write(int id, void const *buf, size_t bytes)
 
 int file_fsync(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -250,7 +401,7 @@ int file_fsync(int id)
 
 int file_fdatasync(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -265,23 +416,28 @@ int file_opendir(char const *path)
         return -1;
 
     filetab_t *fh = file_new_filetab();
-    fh->fs = fs;
 
-    int status = fh->fs->opendir(&fh->fi, path);
-    if (status < 0)
+    if (unlikely(!fh))
+        return -1;
+
+    int status = fs->opendir(&fh->fi, path);
+    if (status < 0) {
+        fh->refcount = 0;
+        fh->users.kill();
         return -1;
+    }
 
     fh->fs = fs;
     //fh->path = strdup(path);
     fh->pos = 0;
     //fh->next = 0;
 
-    return fh - file_table.data();
+    return fh->id;
 }
 
 ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -298,7 +454,7 @@ ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result)
 
 off_t file_telldir(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -307,7 +463,7 @@ off_t file_telldir(int id)
 
 off_t file_seekdir(int id, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
     if (!fh)
         return -1;
 
@@ -317,7 +473,7 @@ off_t file_seekdir(int id, off_t ofs)
 
 int file_closedir(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    file_ref_t fh(id);
 
     if (!fh)
         return -1;
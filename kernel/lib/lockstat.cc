@@ -0,0 +1,333 @@
+#include "lockstat.h"
+#include "thread.h"
+#include "printk.h"
+#include "callout.h"
+#include "string.h"
+#include "likely.h"
+#include "inttypes.h"
+#include "cpu/atomic.h"
+#include "cpu/control_regs.h"
+#include "cpu/spinlock.h"
+
+#if ENABLE_LOCKSTAT
+
+#define LOCKSTAT_HASH_LOG2  10
+#define LOCKSTAT_HELD_MAX   16
+#define LOCKSTAT_DUMP_MAX   32
+#define LOCKSTAT_OWNED_LOG2 10
+
+// Print and clear the statistics this often, 0 to only dump on demand
+#define LOCKSTAT_DUMP_INTERVAL_MS   10000
+
+struct lockstat_ent_t {
+    void const * volatile site;
+    lockstat_type_t type;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+};
+
+// Open addressed by call site, entries are never removed
+static lockstat_ent_t lockstat_table[1 << LOCKSTAT_HASH_LOG2];
+
+// Collects everything after the table fills up
+static lockstat_ent_t lockstat_overflow;
+
+struct lockstat_held_t {
+    void const volatile *lock;
+    lockstat_ent_t *ent;
+    uint64_t acquire_time;
+};
+
+// Only accessed by the owning CPU with interrupts disabled
+struct alignas(64) lockstat_cpu_t {
+    unsigned depth;
+    lockstat_held_t held[LOCKSTAT_HELD_MAX];
+};
+
+static lockstat_cpu_t lockstat_cpus[MAX_CPUS];
+
+struct lockstat_owned_t {
+    void const volatile *lock;
+    lockstat_ent_t *ent;
+    uint64_t acquire_time;
+};
+
+// Open addressed by lock address. Removal shifts later entries back
+// into the hole, so no removed markers pile up and a lookup stops at
+// the first empty slot. One slot is always left empty
+static lockstat_owned_t lockstat_owned[1 << LOCKSTAT_OWNED_LOG2];
+static size_t lockstat_owned_count;
+
+// Not instrumented, the instrumented locks would record themselves
+static rwspinlock_t lockstat_owned_lock;
+
+// The CPU number cannot be looked up until every CPU is running
+static bool volatile lockstat_ready;
+
+static size_t lockstat_hash(void const volatile *p, unsigned log2)
+{
+    uint64_t key = uintptr_t(p) * UINT64_C(0x9E3779B97F4A7C15);
+    return key >> (64 - log2);
+}
+
+static lockstat_ent_t *lockstat_lookup(lockstat_type_t type, void const *site)
+{
+    size_t const mask = countof(lockstat_table) - 1;
+    size_t i = lockstat_hash(site, LOCKSTAT_HASH_LOG2);
+
+    for (size_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+        lockstat_ent_t *ent = lockstat_table + i;
+        void const *seen = ent->site;
+
+        if (likely(seen == site))
+            return ent;
+
+        if (seen)
+            continue;
+
+        seen = atomic_cmpxchg(&ent->site, nullptr, site);
+
+        if (seen == nullptr) {
+            ent->type = type;
+            return ent;
+        }
+
+        if (seen == site)
+            return ent;
+    }
+
+    return &lockstat_overflow;
+}
+
+lockstat_ent_t *lockstat_acquired(lockstat_type_t type, void const *site,
+                                  uint64_t wait, bool contended)
+{
+    if (unlikely(!lockstat_ready))
+        return nullptr;
+
+    lockstat_ent_t *ent = lockstat_lookup(type, site);
+
+    atomic_inc(&ent->acquisitions);
+    atomic_add(&ent->wait_total, wait);
+    atomic_max(&ent->wait_max, wait);
+
+    if (contended)
+        atomic_inc(&ent->contended);
+
+    return ent;
+}
+
+static void lockstat_held(lockstat_ent_t *ent, uint64_t hold)
+{
+    atomic_add(&ent->hold_total, hold);
+    atomic_max(&ent->hold_max, hold);
+}
+
+void lockstat_push(void const volatile *lock, lockstat_ent_t *ent)
+{
+    if (!ent)
+        return;
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    lockstat_cpu_t *cpu = lockstat_cpus + thread_cpu_number();
+
+    // Too deeply nested, the hold time is not recorded
+    if (unlikely(cpu->depth >= LOCKSTAT_HELD_MAX))
+        return;
+
+    cpu->held[cpu->depth++] = { lock, ent, cpu_rdtsc() };
+}
+
+void lockstat_pop(void const volatile *lock)
+{
+    if (unlikely(!lockstat_ready))
+        return;
+
+    uint64_t now = cpu_rdtsc();
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    lockstat_cpu_t *cpu = lockstat_cpus + thread_cpu_number();
+
+    // Locks are usually released in reverse order
+    for (unsigned i = cpu->depth; i > 0; --i) {
+        lockstat_held_t *held = cpu->held + (i - 1);
+
+        if (held->lock != lock)
+            continue;
+
+        lockstat_held(held->ent, now - held->acquire_time);
+
+        memmove(held, held + 1, (cpu->depth - i) * sizeof(*held));
+        --cpu->depth;
+        break;
+    }
+}
+
+void lockstat_own(void const volatile *lock, lockstat_ent_t *ent)
+{
+    if (!ent)
+        return;
+
+    size_t const mask = countof(lockstat_owned) - 1;
+    size_t i = lockstat_hash(lock, LOCKSTAT_OWNED_LOG2);
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    rwspinlock_ex_lock(&lockstat_owned_lock);
+
+    // Too many owned locks, the hold time is not recorded
+    if (likely(lockstat_owned_count < mask)) {
+        while (lockstat_owned[i].lock)
+            i = (i + 1) & mask;
+
+        lockstat_owned[i] = { lock, ent, cpu_rdtsc() };
+        ++lockstat_owned_count;
+    }
+
+    rwspinlock_ex_unlock(&lockstat_owned_lock);
+}
+
+void lockstat_disown(void const volatile *lock)
+{
+    if (unlikely(!lockstat_ready))
+        return;
+
+    uint64_t now = cpu_rdtsc();
+
+    size_t const mask = countof(lockstat_owned) - 1;
+    size_t i = lockstat_hash(lock, LOCKSTAT_OWNED_LOG2);
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    rwspinlock_ex_lock(&lockstat_owned_lock);
+
+    while (lockstat_owned[i].lock && lockstat_owned[i].lock != lock)
+        i = (i + 1) & mask;
+
+    if (lockstat_owned[i].lock) {
+        lockstat_held(lockstat_owned[i].ent,
+                      now - lockstat_owned[i].acquire_time);
+
+        // Move back each later entry of the run that may fill the
+        // hole, one whose home slot is not between the hole and it
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; lockstat_owned[j].lock;
+             j = (j + 1) & mask) {
+            size_t home = lockstat_hash(lockstat_owned[j].lock,
+                                        LOCKSTAT_OWNED_LOG2);
+
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                lockstat_owned[hole] = lockstat_owned[j];
+                hole = j;
+            }
+        }
+
+        lockstat_owned[hole].lock = nullptr;
+        --lockstat_owned_count;
+    }
+
+    rwspinlock_ex_unlock(&lockstat_owned_lock);
+}
+
+static char const *lockstat_type_name(lockstat_type_t type)
+{
+    switch (type) {
+    case lockstat_type_t::spinlock: return "spinlock";
+    case lockstat_type_t::ticketlock: return "ticketlock";
+    case lockstat_type_t::mcslock: return "mcslock";
+    case lockstat_type_t::mutex: return "mutex";
+    }
+    return "?";
+}
+
+void lockstat_dump()
+{
+    static lockstat_ent_t *sorted[countof(lockstat_table)];
+    size_t count = 0;
+
+    // Insertion sort by total wait, there are few entries
+    for (lockstat_ent_t &ent : lockstat_table) {
+        if (!ent.acquisitions)
+            continue;
+
+        size_t i = count++;
+        while (i > 0 && sorted[i - 1]->wait_total < ent.wait_total) {
+            sorted[i] = sorted[i - 1];
+            --i;
+        }
+        sorted[i] = &ent;
+    }
+
+    printdbg("%-10s %-18s %10s %10s %12s %10s %12s %10s\n",
+             "type", "site", "acquired", "contended",
+             "wait", "wait max", "hold", "hold max");
+
+    for (size_t i = 0; i < count && i < LOCKSTAT_DUMP_MAX; ++i) {
+        lockstat_ent_t const *ent = sorted[i];
+
+        printdbg("%-10s %18p %10" PRIu64 " %10" PRIu64 " %12" PRIu64
+                 " %10" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n",
+                 lockstat_type_name(ent->type), ent->site,
+                 ent->acquisitions, ent->contended,
+                 ent->wait_total, ent->wait_max,
+                 ent->hold_total, ent->hold_max);
+    }
+
+    if (lockstat_overflow.acquisitions) {
+        printdbg("%" PRIu64 " acquisitions at sites that did not fit\n",
+                 lockstat_overflow.acquisitions);
+    }
+}
+
+// Keeps the call sites, clears the counts
+void lockstat_reset()
+{
+    for (lockstat_ent_t &ent : lockstat_table) {
+        ent.acquisitions = 0;
+        ent.contended = 0;
+        ent.wait_total = 0;
+        ent.wait_max = 0;
+        ent.hold_total = 0;
+        ent.hold_max = 0;
+    }
+
+    memset(&lockstat_overflow, 0, sizeof(lockstat_overflow));
+}
+
+#if LOCKSTAT_DUMP_INTERVAL_MS
+static int lockstat_dump_thread(void *)
+{
+    for (;;) {
+        thread_sleep_for(LOCKSTAT_DUMP_INTERVAL_MS);
+        lockstat_dump();
+        lockstat_reset();
+    }
+}
+#endif
+
+static void lockstat_start(void *)
+{
+    lockstat_ready = true;
+
+#if LOCKSTAT_DUMP_INTERVAL_MS
+    thread_t tid = thread_create(lockstat_dump_thread, nullptr, 0, false);
+    thread_close(tid);
+#endif
+}
+
+REGISTER_CALLOUT(lockstat_start, nullptr, callout_type_t::smp_online, "000");
+
+#else
+
+void lockstat_dump()
+{
+    printdbg("lockstat disabled, set ENABLE_LOCKSTAT in lockstat.h\n");
+}
+
+void lockstat_reset()
+{
+}
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+#include "types.h"
+
+// Lock contention profiling. When enabled, every spinlock, ticketlock,
+// mcslock and mutex acquisition is recorded against the lock type and
+// the address it was called from: acquisitions, contended acquisitions,
+// total and max wait, total and max hold time, in TSC ticks.
+// When disabled, the hooks expand to nothing
+#define ENABLE_LOCKSTAT 0
+
+enum struct lockstat_type_t : uint8_t {
+    spinlock,
+    ticketlock,
+    mcslock,
+    mutex
+};
+
+struct lockstat_ent_t;
+
+// Print the call sites sorted by total wait time, most first
+void lockstat_dump();
+void lockstat_reset();
+
+#if ENABLE_LOCKSTAT
+#include "cpu/control_regs.h"
+
+// Returns the entry for the call site, or null if not recording yet
+lockstat_ent_t *lockstat_acquired(lockstat_type_t type, void const *site,
+                                  uint64_t wait, bool contended);
+
+// Locks that disable interrupts are tracked on a per-CPU stack
+// of held locks, from acquisition to release
+void lockstat_push(void const volatile *lock, lockstat_ent_t *ent);
+void lockstat_pop(void const volatile *lock);
+
+// Locks that may be held across a sleep are tracked in a table
+// of owned locks, keyed by the lock address
+void lockstat_own(void const volatile *lock, lockstat_ent_t *ent);
+void lockstat_disown(void const volatile *lock);
+
+// Lives on the stack of the acquiring function
+class lockstat_wait_t {
+public:
+    _always_inline
+    lockstat_wait_t(lockstat_type_t type, void const *site)
+        : st(cpu_rdtsc())
+        , site(site)
+        , type(type)
+        , contended(false)
+    {
+    }
+
+    _always_inline
+    lockstat_ent_t *acquired()
+    {
+        return lockstat_acquired(type, site, cpu_rdtsc() - st, contended);
+    }
+
+    uint64_t st;
+    void const *site;
+    lockstat_type_t type;
+    bool contended;
+};
+
+#define LOCKSTAT_WAIT(type) \
+    lockstat_wait_t lockstat_wait(lockstat_type_t::type, \
+                                  __builtin_return_address(0))
+#define LOCKSTAT_CONTENDED()    (lockstat_wait.contended = true)
+#define LOCKSTAT_ACQUIRED(lock) lockstat_push((lock), lockstat_wait.acquired())
+#define LOCKSTAT_RELEASED(lock) lockstat_pop(lock)
+#define LOCKSTAT_OWNED(lock)    lockstat_own((lock), lockstat_wait.acquired())
+#define LOCKSTAT_DISOWNED(lock) lockstat_disown(lock)
+#else
+#define LOCKSTAT_WAIT(type)     ((void)0)
+#define LOCKSTAT_CONTENDED()    ((void)0)
+#define LOCKSTAT_ACQUIRED(lock) ((void)0)
+#define LOCKSTAT_RELEASED(lock) ((void)0)
+#define LOCKSTAT_OWNED(lock)    ((void)0)
+#define LOCKSTAT_DISOWNED(lock) ((void)0)
+#endif
@@ -379,6 +379,10 @@ void munmap_window(void *addr, size_t size);
 int alias_window(void *addr, size_t size,
                  mmphysrange_t const *ranges, size_t range_count);
 
+// Map physical pages at a fixed address in the current process. The
+// pages are shared, they are not freed when the process exits
+bool mmap_phys_user(void *addr, uintptr_t physaddr, size_t len, int prot);
+
 void mm_init_process(process_t *process);
 
 uintptr_t mm_fork_kernel_text();
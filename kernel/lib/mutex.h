@@ -1,6 +1,7 @@
 #pragma once
 #include "threadsync.h"
 #include "utility.h"
+#include "cpu/atomic.h"
 
 // Meets BasicLockable requirements
 class mutex {
@@ -110,6 +111,63 @@ private:
 class alignas(64) padded_shared_mutex : public shared_mutex {
 };
 
+// Meets SharedMutex requirements. Shared locking scales with the number
+// of CPUs, exclusive locking is slow, see brlock_t
+class shared_brlock {
+public:
+    typedef brlock_t mutex_type;
+
+    shared_brlock()
+    {
+        brlock_init(&m);
+    }
+
+    ~shared_brlock()
+    {
+        brlock_destroy(&m);
+    }
+
+    shared_brlock(shared_brlock const&) = delete;
+
+    void lock()
+    {
+        brlock_ex_lock(&m);
+    }
+
+    bool try_lock()
+    {
+        return brlock_ex_try_lock(&m);
+    }
+
+    void unlock()
+    {
+        brlock_ex_unlock(&m);
+    }
+
+    void lock_shared()
+    {
+        brlock_sh_lock(&m);
+    }
+
+    bool try_lock_shared()
+    {
+        return brlock_sh_try_lock(&m);
+    }
+
+    void unlock_shared()
+    {
+        brlock_sh_unlock(&m);
+    }
+
+    mutex_type& native_handle()
+    {
+        return m;
+    }
+
+private:
+    mutex_type m;
+};
+
 class shared_spinlock {
 public:
     typedef rwspinlock_t mutex_type;
@@ -276,6 +334,106 @@ private:
     mcs_queue_ent_t * volatile m;
 };
 
+// Sequence counter, odd while a write is in progress. Readers write
+// nothing, they retry the read if a write overlapped it:
+//
+//  do {
+//      seq = count.read_begin();
+//      copy = data;
+//  } while (count.read_retry(seq));
+//
+// The caller serializes writers. A reader interrupting a writer on the
+// same CPU would spin forever, so writers disable interrupts if readers
+// may run in IRQ handlers
+class seqcount {
+public:
+    seqcount()
+        : seq(0)
+    {
+    }
+
+    seqcount(seqcount const&) = delete;
+
+    uint32_t read_begin() const
+    {
+        uint32_t result;
+        while (unlikely((result = atomic_ld_acq(&seq)) & 1))
+            pause();
+        return result;
+    }
+
+    // Returns true if the data read since read_begin may be torn
+    bool read_retry(uint32_t begin) const
+    {
+        // Order the data loads before reloading the sequence. This is
+        // an acquire fence, on x86 it emits no instruction but stops
+        // the compiler moving the loads
+        atomic_lfence();
+        return seq != begin;
+    }
+
+    void write_begin()
+    {
+        seq = seq + 1;
+
+        // Order the odd sequence before the data stores
+        atomic_sfence();
+    }
+
+    void write_end()
+    {
+        atomic_st_rel(&seq, seq + 1);
+    }
+
+private:
+    uint32_t volatile seq;
+};
+
+// Sequence counter with a spinlock serializing the writers.
+// Meets BasicLockable requirements for the write side
+class seqlock {
+public:
+    typedef spinlock_t mutex_type;
+
+    seqlock()
+        : m(0)
+    {
+    }
+
+    seqlock(seqlock const&) = delete;
+
+    uint32_t read_begin() const
+    {
+        return count.read_begin();
+    }
+
+    bool read_retry(uint32_t begin) const
+    {
+        return count.read_retry(begin);
+    }
+
+    void lock()
+    {
+        spinlock_lock(&m);
+        count.write_begin();
+    }
+
+    void unlock()
+    {
+        count.write_end();
+        spinlock_unlock(&m);
+    }
+
+    spinlock_t& native_handle()
+    {
+        return m;
+    }
+
+private:
+    seqcount count;
+    spinlock_t m;
+};
+
 struct defer_lock_t {
 };
 
@@ -14,6 +14,7 @@
 #include "desc_alloc.h"
 #include "cpu/control_regs.h"
 #include "cpu/isr.h"
+#include "cpu/vdso.h"
 
 union process_ptr_t {
     process_t *p;
@@ -130,6 +131,7 @@ int process_t::spawn(pid_t * pid_result,
     thread_t tid = thread_create(&process_t::start, process, 0, true);
 
     process->add_thread(process->pid, tid);
+    thread_close(tid);
 
     processes_scoped_lock lock(process->process_lock);
     while (process->state == process_t::state_t::starting)
@@ -151,6 +153,10 @@ int process_t::start()
 
     mmu_context = mm_new_process(this);
 
+    // clock_gettime without a syscall
+    if (!vdso_map_process())
+        return -1;
+
     // Simply load it for now
     Elf64_Ehdr hdr;
 
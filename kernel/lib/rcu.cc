@@ -0,0 +1,167 @@
+#include "rcu.h"
+#include "thread.h"
+#include "callout.h"
+#include "time.h"
+#include "likely.h"
+#include "assert.h"
+#include "cpu/atomic.h"
+#include "cpu/spinlock.h"
+#include "cpu/control_regs.h"
+#include "cpu/thread_impl.h"
+#include "cpu/interrupts.h"
+
+// A CPU that has not switched for this long is sent a reschedule IPI
+#define RCU_KICK_NS     1000000
+
+struct alignas(64) rcu_cpu_t {
+    // Incremented by the owning CPU on every context switch
+    uint64_t volatile qs_seq;
+
+    // Only accessed by the owning CPU with interrupts disabled
+    uint32_t nest;
+    bool intr_was_enabled;
+};
+
+static rcu_cpu_t rcu_cpus[MAX_CPUS];
+
+// Callbacks waiting for a grace period, pushed with compare exchange
+static rcu_head_t * volatile rcu_pending;
+
+static spinlock_t rcu_sleep_lock;
+static thread_t rcu_sleep_tid = -1;
+static bool volatile rcu_sleeping;
+
+void rcu_read_lock()
+{
+    bool intr_was_enabled = cpu_irq_save_disable();
+
+    rcu_cpu_t *cpu = rcu_cpus + thread_cpu_number();
+
+    if (cpu->nest++ == 0)
+        cpu->intr_was_enabled = intr_was_enabled;
+}
+
+void rcu_read_unlock()
+{
+    rcu_cpu_t *cpu = rcu_cpus + thread_cpu_number();
+
+    assert(cpu->nest > 0);
+
+    if (--cpu->nest == 0)
+        cpu_irq_toggle(cpu->intr_was_enabled);
+}
+
+void rcu_quiescent(int cpu_nr)
+{
+    rcu_cpu_t *cpu = rcu_cpus + cpu_nr;
+    atomic_st_rel(&cpu->qs_seq, cpu->qs_seq + 1);
+}
+
+void synchronize_rcu()
+{
+    // Order the caller's unpublish before sampling the other CPUs,
+    // readers that start after this see the new version
+    atomic_fence();
+
+    // Nothing else can be in a read side section on the CPU running
+    // this thread, even if it migrates after this
+    int self = thread_cpu_number();
+
+    assert(rcu_cpus[self].nest == 0);
+
+    int cpu_count = thread_get_cpu_count();
+
+    // Waiting for the CPUs one after another costs about as much as
+    // the slowest one, they all make progress meanwhile
+    for (int c = 0; c < cpu_count; ++c) {
+        if (c == self)
+            continue;
+
+        rcu_cpu_t *cpu = rcu_cpus + c;
+        uint64_t seq = atomic_ld_acq(&cpu->qs_seq);
+        uint64_t kick_time = time_ns() + RCU_KICK_NS;
+
+        while (atomic_ld_acq(&cpu->qs_seq) == seq) {
+            // A tickless CPU running one thread may not switch for
+            // a long time, force it through the scheduler
+            if (unlikely(time_ns() >= kick_time)) {
+                thread_send_ipi(c, INTR_THREAD_RESCHED);
+                kick_time = UINT64_MAX;
+            }
+
+            thread_yield();
+        }
+    }
+}
+
+void call_rcu(rcu_head_t *head, rcu_callback_t callback)
+{
+    head->callback = callback;
+
+    rcu_head_t *old_head = rcu_pending;
+
+    for (;;) {
+        head->next = old_head;
+
+        rcu_head_t *seen = atomic_cmpxchg(&rcu_pending, old_head, head);
+
+        if (likely(seen == old_head))
+            break;
+
+        old_head = seen;
+    }
+
+    // Whoever queued the first callback of a batch already woke it
+    if (old_head || !atomic_ld_acq(&rcu_sleeping))
+        return;
+
+    spinlock_lock(&rcu_sleep_lock);
+
+    if (rcu_sleeping) {
+        rcu_sleeping = false;
+        thread_wake(rcu_sleep_tid);
+    }
+
+    spinlock_unlock(&rcu_sleep_lock);
+}
+
+static int rcu_thread(void *)
+{
+    for (;;) {
+        spinlock_lock(&rcu_sleep_lock);
+
+        // The fence orders the store before the final check,
+        // call_rcu pushes before it checks rcu_sleeping
+        rcu_sleeping = true;
+        atomic_fence();
+
+        if (!atomic_ld_acq(&rcu_pending))
+            thread_sleep_release(&rcu_sleep_lock, &rcu_sleep_tid, UINT64_MAX);
+
+        rcu_sleeping = false;
+
+        spinlock_unlock(&rcu_sleep_lock);
+
+        // Everything queued so far shares one grace period
+        rcu_head_t *batch = atomic_xchg(&rcu_pending, nullptr);
+
+        if (!batch)
+            continue;
+
+        synchronize_rcu();
+
+        while (batch) {
+            rcu_head_t *next = batch->next;
+            batch->callback(batch);
+            batch = next;
+        }
+    }
+}
+
+static void rcu_startup(void *)
+{
+    thread_t tid = thread_create(rcu_thread, nullptr, 0, false);
+    thread_close(tid);
+}
+
+REGISTER_CALLOUT(rcu_startup, nullptr, callout_type_t::smp_online, "050");
@@ -0,0 +1,60 @@
+#pragma once
+#include "types.h"
+
+// Read-copy-update
+//
+// Readers run between rcu_read_lock and rcu_read_unlock without taking
+// any shared cache line exclusive. A read side section must not block
+// or yield, it runs with interrupts disabled so the CPU cannot context
+// switch inside it. Every context switch, including switching to and
+// from the idle thread, is a quiescent state for that CPU.
+//
+// Writers publish a new version with atomic_st_rel, then wait for a
+// grace period with synchronize_rcu, or defer the free with call_rcu.
+// After a grace period no reader can still see the old version.
+
+__BEGIN_DECLS
+
+struct rcu_head_t;
+
+typedef void (*rcu_callback_t)(rcu_head_t *head);
+
+// Embed this in the object to be reclaimed
+struct rcu_head_t {
+    rcu_head_t *next;
+    rcu_callback_t callback;
+};
+
+void rcu_read_lock();
+void rcu_read_unlock();
+
+// Block until every read side section that was running at the time of
+// the call has finished. Must not be called in a read side section
+void synchronize_rcu();
+
+// Invoke callback(head) from the RCU thread after a grace period.
+// Callbacks are batched, many share one grace period.
+// Not callable from IRQ handlers
+void call_rcu(rcu_head_t *head, rcu_callback_t callback);
+
+// Called by the scheduler on every context switch
+void rcu_quiescent(int cpu_nr);
+
+__END_DECLS
+
+class rcu_scoped_read_lock
+{
+public:
+    rcu_scoped_read_lock()
+    {
+        rcu_read_lock();
+    }
+
+    ~rcu_scoped_read_lock()
+    {
+        rcu_read_unlock();
+    }
+
+    rcu_scoped_read_lock(rcu_scoped_read_lock const&) = delete;
+    rcu_scoped_read_lock &operator=(rcu_scoped_read_lock const&) = delete;
+};
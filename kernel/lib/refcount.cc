@@ -1,2 +1,174 @@
 #include "refcount.h"
+#include "thread.h"
+#include "callout.h"
+#include "stdlib.h"
+#include "likely.h"
+#include "cpu/spinlock.h"
 
+// Number of objects that can count per-CPU at once
+#define PERCPU_REF_SLOTS    4096
+
+// Keeps the atomic count away from zero while CPUs may still be
+// updating their own counters
+#define PERCPU_REF_BIAS     (intptr_t(1) << 60)
+
+// The counters of each CPU are contiguous, so they share cache lines
+// only with counters of the same CPU
+static intptr_t volatile *percpu_ref_counters[MAX_CPUS];
+static int percpu_ref_cpu_count;
+
+static spinlock_t percpu_ref_slot_lock;
+static uint64_t percpu_ref_slot_map[PERCPU_REF_SLOTS / 64];
+
+static int percpu_ref_slot_alloc()
+{
+    if (unlikely(!percpu_ref_cpu_count))
+        return -1;
+
+    spinlock_lock(&percpu_ref_slot_lock);
+
+    int slot = -1;
+
+    for (size_t i = 0; i < countof(percpu_ref_slot_map); ++i) {
+        uint64_t free_bits = ~percpu_ref_slot_map[i];
+
+        if (free_bits) {
+            int bit = __builtin_ctzll(free_bits);
+            percpu_ref_slot_map[i] |= UINT64_C(1) << bit;
+            slot = int(i * 64) + bit;
+            break;
+        }
+    }
+
+    spinlock_unlock(&percpu_ref_slot_lock);
+
+    return slot;
+}
+
+static void percpu_ref_slot_free(int slot)
+{
+    spinlock_lock(&percpu_ref_slot_lock);
+    percpu_ref_slot_map[slot >> 6] &= ~(UINT64_C(1) << (slot & 63));
+    spinlock_unlock(&percpu_ref_slot_lock);
+}
+
+void percpu_refcount::init(percpu_ref_release_t release_fn)
+{
+    release = release_fn;
+    dead = false;
+    slot = percpu_ref_slot_alloc();
+
+    if (likely(slot >= 0)) {
+        count = PERCPU_REF_BIAS + 1;
+        atomic_mode = false;
+    } else {
+        count = 1;
+        atomic_mode = true;
+    }
+}
+
+bool percpu_refcount::tryget_live()
+{
+    rcu_scoped_read_lock lock;
+
+    if (unlikely(atomic_ld_acq(&dead)))
+        return false;
+
+    if (likely(!atomic_ld_acq(&atomic_mode))) {
+        ++percpu_ref_counters[thread_cpu_number()][slot];
+        return true;
+    }
+
+    // Never resurrect it after the last put
+    intptr_t old_count = atomic_ld_acq(&count);
+    while (old_count > 0) {
+        if (atomic_cmpxchg_upd(&count, &old_count, old_count + 1))
+            return true;
+    }
+
+    return false;
+}
+
+void percpu_refcount::get()
+{
+    rcu_scoped_read_lock lock;
+
+    if (likely(!atomic_ld_acq(&atomic_mode)))
+        ++percpu_ref_counters[thread_cpu_number()][slot];
+    else
+        atomic_inc(&count);
+}
+
+void percpu_refcount::put()
+{
+    {
+        rcu_scoped_read_lock lock;
+
+        if (likely(!atomic_ld_acq(&atomic_mode))) {
+            --percpu_ref_counters[thread_cpu_number()][slot];
+            return;
+        }
+    }
+
+    // Released outside the read side section, it may block
+    if (atomic_dec(&count) == 0)
+        release(this);
+}
+
+void percpu_refcount::kill()
+{
+    assert(!dead);
+
+    atomic_st_rel(&dead, true);
+
+    if (slot < 0) {
+        put();
+        return;
+    }
+
+    // From now on, gets and puts go to the biased atomic count
+    atomic_st_rel(&atomic_mode, true);
+
+    call_rcu(&rcu, kill_rcu);
+}
+
+void percpu_refcount::kill_rcu(rcu_head_t *head)
+{
+    percpu_refcount *ref = (percpu_refcount*)
+            ((char*)head - offsetof(percpu_refcount, rcu));
+
+    // Nothing updates the per-CPU counters after the grace period
+    intptr_t sum = 0;
+    for (int cpu = 0; cpu < percpu_ref_cpu_count; ++cpu) {
+        intptr_t volatile *counter = percpu_ref_counters[cpu] + ref->slot;
+        sum += *counter;
+        *counter = 0;
+    }
+
+    percpu_ref_slot_free(ref->slot);
+    ref->slot = -1;
+
+    atomic_add(&ref->count, sum - PERCPU_REF_BIAS);
+
+    // Drop the initial reference
+    ref->put();
+}
+
+static void percpu_ref_startup(void *)
+{
+    int cpu_count = thread_get_cpu_count();
+
+    for (int cpu = 0; cpu < cpu_count; ++cpu) {
+        percpu_ref_counters[cpu] = (intptr_t*)calloc(
+                    PERCPU_REF_SLOTS, sizeof(**percpu_ref_counters));
+
+        // Objects initialized without a slot stay in atomic mode
+        if (unlikely(!percpu_ref_counters[cpu]))
+            return;
+    }
+
+    atomic_st_rel(&percpu_ref_cpu_count, cpu_count);
+}
+
+REGISTER_CALLOUT(percpu_ref_startup, nullptr,
+                 callout_type_t::smp_online, "000");
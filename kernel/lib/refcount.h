@@ -2,6 +2,7 @@
 #include "assert.h"
 #include "cpu/atomic.h"
 #include "utility.h"
+#include "rcu.h"
 
 template<typename T>
 class refcounted;
@@ -168,3 +169,44 @@ protected:
 private:
     int mutable refcount;
 };
+
+class percpu_refcount;
+
+typedef void (*percpu_ref_release_t)(percpu_refcount *ref);
+
+// Reference count for hot shared objects. While the object is live,
+// get and put only update a counter owned by the running CPU. A get on
+// one CPU may be put on another, the counters only add up to the real
+// count as a whole.
+//
+// kill marks it dead, so tryget_live fails, and switches it to one
+// shared atomic count. After a grace period no CPU can still be using
+// its own counter, they are summed into the atomic count and the
+// initial reference is dropped. release is called when the count
+// reaches zero, possibly from the RCU thread.
+//
+// Starts in atomic mode if no per-CPU counter slot is available
+class percpu_refcount {
+public:
+    // Starts with one reference, dropped by kill
+    void init(percpu_ref_release_t release_fn);
+
+    // Fails if killed
+    bool tryget_live();
+
+    // The caller must already hold a reference
+    void get();
+    void put();
+
+    void kill();
+
+private:
+    static void kill_rcu(rcu_head_t *head);
+
+    intptr_t volatile count;
+    percpu_ref_release_t release;
+    rcu_head_t rcu;
+    int slot;
+    bool volatile dead;
+    bool volatile atomic_mode;
+};
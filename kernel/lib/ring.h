@@ -0,0 +1,173 @@
+#pragma once
+#include "types.h"
+#include "likely.h"
+#include "cpu/atomic.h"
+
+// Bounded lock-free rings for handing items between CPUs. The indices
+// written by the producers and by the consumer are on separate cache
+// lines. N must be a power of two. T is copied in and out, keep it
+// small and trivially copyable
+
+// Single producer, single consumer
+template<typename T, size_t N>
+class spsc_ring {
+    static_assert((N & (N - 1)) == 0, "Size must be a power of two");
+
+public:
+    spsc_ring()
+        : tail(0)
+        , head_cache(0)
+        , head(0)
+    {
+    }
+
+    spsc_ring(spsc_ring const&) = delete;
+    spsc_ring &operator=(spsc_ring const&) = delete;
+
+    // Returns false if full
+    bool push(T const& value)
+    {
+        size_t pos = tail;
+
+        // Only read the consumer's cache line when it looks full
+        if (unlikely(pos - head_cache == N)) {
+            head_cache = atomic_ld_acq(&head);
+
+            if (pos - head_cache == N)
+                return false;
+        }
+
+        items[pos & (N - 1)] = value;
+
+        // Publish the item
+        atomic_st_rel(&tail, pos + 1);
+
+        return true;
+    }
+
+    // Returns false if empty
+    bool pop(T& value)
+    {
+        size_t pos = head;
+
+        if (pos == atomic_ld_acq(&tail))
+            return false;
+
+        value = items[pos & (N - 1)];
+
+        // Give the slot back after it has been read
+        atomic_st_rel(&head, pos + 1);
+
+        return true;
+    }
+
+    bool empty() const
+    {
+        return atomic_ld_acq(&head) == atomic_ld_acq(&tail);
+    }
+
+private:
+    // Written by the producer
+    alignas(64) size_t volatile tail;
+    size_t head_cache;
+
+    // Written by the consumer
+    alignas(64) size_t volatile head;
+
+    alignas(64) T items[N];
+};
+
+// Multiple producers, single consumer. Producers claim a slot with one
+// compare exchange on the tail, each slot has a sequence number that
+// says whether it is free for the producer or filled for the consumer
+template<typename T, size_t N>
+class mpsc_ring {
+    static_assert((N & (N - 1)) == 0, "Size must be a power of two");
+
+public:
+    mpsc_ring()
+        : tail(0)
+        , head(0)
+    {
+        for (size_t i = 0; i < N; ++i)
+            slots[i].seq = i;
+    }
+
+    mpsc_ring(mpsc_ring const&) = delete;
+    mpsc_ring &operator=(mpsc_ring const&) = delete;
+
+    // Returns false if full
+    bool push(T const& value)
+    {
+        size_t pos = atomic_ld_acq(&tail);
+
+        for (;;) {
+            slot_t *slot = slots + (pos & (N - 1));
+            size_t seq = atomic_ld_acq(&slot->seq);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+            if (likely(diff == 0)) {
+                size_t seen = atomic_cmpxchg(&tail, pos, pos + 1);
+
+                if (likely(seen == pos)) {
+                    slot->value = value;
+
+                    // Publish the item
+                    atomic_st_rel(&slot->seq, pos + 1);
+
+                    return true;
+                }
+
+                pos = seen;
+            } else if (diff < 0) {
+                // The consumer has not taken the item from a lap ago
+                return false;
+            } else {
+                // Another producer claimed it, catch up
+                pos = atomic_ld_acq(&tail);
+            }
+        }
+    }
+
+    // Returns false if empty, or if the next item is claimed
+    // but not yet filled in
+    bool pop(T& value)
+    {
+        size_t pos = head;
+        slot_t *slot = slots + (pos & (N - 1));
+
+        if (atomic_ld_acq(&slot->seq) != pos + 1)
+            return false;
+
+        value = slot->value;
+
+        // Give the slot to the producer one lap ahead
+        atomic_st_rel(&slot->seq, pos + N);
+
+        atomic_st_rel(&head, pos + 1);
+
+        return true;
+    }
+
+    // Any CPU may ask, producers too. Compares the published indices,
+    // so an item that is claimed but not filled in yet counts. The
+    // answer may be stale by the time it returns
+    bool empty() const
+    {
+        return atomic_ld_acq(&head) == atomic_ld_acq(&tail);
+    }
+
+private:
+    struct slot_t {
+        size_t volatile seq;
+        T value;
+    };
+
+    // Claimed by the producers
+    alignas(64) size_t volatile tail;
+
+    // Only written by the consumer
+    alignas(64) size_t volatile head;
+
+    alignas(64) slot_t slots[N];
+};
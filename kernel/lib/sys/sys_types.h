@@ -2,3 +2,5 @@
 #include "types.h"
 
 typedef int64_t time_t;
+typedef int64_t suseconds_t;
+typedef int clockid_t;
@@ -2,6 +2,99 @@
 #include "types.h"
 #include "cpu/spinlock.h"
 #include "errno.h"
+#include "cpu/control_regs_constants.h"
+
+// Set of CPUs, used for thread affinity
+struct thread_cpu_mask_t {
+    static constexpr size_t bitsof_word = sizeof(uint64_t) * 8;
+    static constexpr size_t word_count =
+            (MAX_CPUS + bitsof_word - 1) / bitsof_word;
+
+    thread_cpu_mask_t()
+        : bitmap{}
+    {
+    }
+
+    explicit thread_cpu_mask_t(size_t cpu)
+        : bitmap{}
+    {
+        set(cpu);
+    }
+
+    static thread_cpu_mask_t all()
+    {
+        thread_cpu_mask_t result;
+        for (size_t i = 0; i < word_count; ++i)
+            result.bitmap[i] = ~uint64_t(0);
+        return result;
+    }
+
+    thread_cpu_mask_t &set(size_t cpu)
+    {
+        bitmap[cpu / bitsof_word] |= uint64_t(1) << (cpu % bitsof_word);
+        return *this;
+    }
+
+    thread_cpu_mask_t &clr(size_t cpu)
+    {
+        bitmap[cpu / bitsof_word] &= ~(uint64_t(1) << (cpu % bitsof_word));
+        return *this;
+    }
+
+    bool test(size_t cpu) const
+    {
+        return bitmap[cpu / bitsof_word] & (uint64_t(1) << (cpu % bitsof_word));
+    }
+
+    bool empty() const
+    {
+        for (size_t i = 0; i < word_count; ++i) {
+            if (bitmap[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool operator==(thread_cpu_mask_t const& rhs) const
+    {
+        for (size_t i = 0; i < word_count; ++i) {
+            if (bitmap[i] != rhs.bitmap[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(thread_cpu_mask_t const& rhs) const
+    {
+        return !(*this == rhs);
+    }
+
+    // True if every CPU in this set is also in rhs
+    bool subset_of(thread_cpu_mask_t const& rhs) const
+    {
+        for (size_t i = 0; i < word_count; ++i) {
+            if (bitmap[i] & ~rhs.bitmap[i])
+                return false;
+        }
+        return true;
+    }
+
+    thread_cpu_mask_t &operator&=(thread_cpu_mask_t const& rhs)
+    {
+        for (size_t i = 0; i < word_count; ++i)
+            bitmap[i] &= rhs.bitmap[i];
+        return *this;
+    }
+
+    thread_cpu_mask_t &operator|=(thread_cpu_mask_t const& rhs)
+    {
+        for (size_t i = 0; i < word_count; ++i)
+            bitmap[i] |= rhs.bitmap[i];
+        return *this;
+    }
+
+    uint64_t bitmap[word_count];
+};
 
 __BEGIN_DECLS
 
@@ -28,8 +121,8 @@ void thread_sleep_until(uint64_t expiry);
 void thread_sleep_for(uint64_t ms);
 uint64_t thread_get_usage(int id);
 
-void thread_set_affinity(int id, uint64_t affinity);
-uint64_t thread_get_affinity(int id);
+void thread_set_affinity(int id, thread_cpu_mask_t const& affinity);
+thread_cpu_mask_t thread_get_affinity(int id);
 
 size_t thread_get_cpu_count();
 int thread_cpu_number();
@@ -42,11 +135,62 @@ void thread_suspend_release(spinlock_t *lock, thread_t *thread_id);
 
 void thread_resume(thread_t thread);
 
+// Sleep until woken by thread_wake or until the time_ns expiry passes,
+// releasing the lock while asleep and reacquiring it before returning
+void thread_sleep_release(spinlock_t *lock, thread_t *thread_id,
+                          uint64_t expiry);
+
+// Returns false if the thread was not asleep, for example
+// because its thread_sleep_release timed out
+bool thread_wake(thread_t thread);
+
+// True if the thread is currently executing on a CPU. Only a hint,
+// it may change immediately after it is returned
+bool thread_is_running(thread_t thread);
+
 thread_priority_t thread_get_priority(thread_t thread_id);
 void thread_set_priority(thread_t thread_id, thread_priority_t priority);
 
+// Scheduling classes, values match the user mode <sched.h>
+// Real time classes always preempt normal threads
+#define SCHED_OTHER             0
+#define SCHED_FIFO              1
+#define SCHED_RR                2
+#define SCHED_DEADLINE          6
+
+#define SCHED_RT_PRIORITY_MIN   1
+#define SCHED_RT_PRIORITY_MAX   99
+
+// Deadline times are in nanoseconds. A zero deadline or period
+// defaults to the other. Returns negative errno, -EBUSY if admitting
+// the deadline thread would overcommit the CPUs
+int thread_set_scheduler(thread_t tid, int policy, int rt_priority,
+                         uint64_t runtime, uint64_t deadline,
+                         uint64_t period);
+
+// Returns the SCHED_* policy or negative errno
+int thread_get_scheduler(thread_t tid);
+
+// Isolated CPUs only run threads whose affinity is confined to
+// isolated CPUs, and do not take device IRQs or cpu_broadcast work.
+// An isolated CPU running a single thread stops its timer tick.
+// The boot CPU cannot be isolated. Returns negative errno
+int thread_set_isolated(thread_cpu_mask_t const& cpus);
+thread_cpu_mask_t thread_get_isolated();
+bool thread_cpu_is_isolated(int cpu);
+
+// Returns cpu if it may take device IRQs, otherwise a CPU that is not
+// isolated. A cpu of -1 (any CPU) is also redirected while any CPU is
+// isolated, because lowest priority delivery could pick an isolated CPU
+int thread_cpu_irq_target(int cpu);
+
 int thread_wait(thread_t thread_id);
 
+// Release the handle returned by thread_create. The thread id may be
+// reused for another thread after the thread has finished and the
+// handle has been closed
+void thread_close(thread_t thread_id);
+
 void thread_idle_set_ready(void);
 
 void *thread_get_exception_top(void);
@@ -54,6 +198,15 @@ void *thread_set_exception_top(void *chain);
 
 process_t *thread_current_process();
 
+// Process owning the thread, nullptr if there is no such thread
+process_t *thread_get_process(thread_t tid);
+
+// Per-CPU log scale histograms of the latency from becoming ready
+// to running, of time slice lengths, and of involuntary switches,
+// and counts of switches and cross CPU migrations
+void thread_sched_stats_reset();
+void thread_sched_stats_dump();
+
 // Get the TLB shootdown counter for the specified CPU
 uint64_t thread_shootdown_count(int cpu_nr);
 
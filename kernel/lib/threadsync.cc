@@ -2,9 +2,11 @@
 #include "thread.h"
 #include "assert.h"
 #include "cpu/atomic.h"
+#include "likely.h"
 #include "printk.h"
 #include "time.h"
 #include "export.h"
+#include "lockstat.h"
 
 #define MUTEX_DEBUG 0
 #if MUTEX_DEBUG
@@ -23,6 +25,12 @@
 #define SPINCOUNT_MAX   4096
 #define SPINCOUNT_MIN   4
 
+// Maximum number of pause instructions between polls of the owner
+#define MUTEX_BACKOFF_MAX   64
+
+// Number of polls of the writer flag before a reader yields
+#define BRLOCK_SPIN_MAX     256
+
 //
 // Wait chain
 
@@ -65,6 +73,8 @@ EXPORT void mutex_init(mutex_t *mutex)
 
 EXPORT bool mutex_try_lock(mutex_t *mutex)
 {
+    LOCKSTAT_WAIT(mutex);
+
     bool result;
 
     thread_t this_thread_id = thread_get_id();
@@ -75,6 +85,7 @@ EXPORT bool mutex_try_lock(mutex_t *mutex)
 
     if (mutex->owner < 0) {
         mutex->owner = this_thread_id;
+        LOCKSTAT_OWNED(mutex);
         result = true;
     } else {
         result = false;
@@ -85,47 +96,71 @@ EXPORT bool mutex_try_lock(mutex_t *mutex)
     return result;
 }
 
+// Spin while the owner is running on another CPU, it is likely to
+// release the mutex before a sleep and wakeup could complete. Give up
+// immediately when the owner is not running, it cannot release it.
+// Returns true if the mutex appeared to become free
+static bool mutex_spin(mutex_t *mutex)
+{
+    int backoff = 1;
+
+    for (int spin = 0; spin < mutex->spin_count; spin += backoff) {
+        thread_t owner = atomic_ld_acq(&mutex->owner);
+
+        if (owner < 0 && !mutex->noyield_waiting)
+            return true;
+
+        if (owner >= 0 && !thread_is_running(owner))
+            return false;
+
+        // Back off exponentially to reduce traffic on the cache line
+        for (int i = 0; i < backoff; ++i)
+            pause();
+
+        if (backoff < MUTEX_BACKOFF_MAX)
+            backoff <<= 1;
+    }
+
+    return false;
+}
+
 EXPORT void mutex_lock(mutex_t *mutex)
 {
     assert(mutex->owner != thread_get_id());
 
-    for (int spin = 0; ; pause(), ++spin) {
-        // Spin outside lock until spin limit
-        if (spin < mutex->spin_count &&
-                (mutex->owner >= 0 || mutex->noyield_waiting))
-            continue;
+    LOCKSTAT_WAIT(mutex);
 
-        // Lock the mutex to acquire it or manipulate wait chain
-        spinlock_lock(&mutex->lock);
-
-        // Check again inside lock
-        if (spin < mutex->spin_count &&
-                (mutex->owner >= 0 || mutex->noyield_waiting)) {
-            // Racing thread beat us, go back to spinning outside lock
-            spinlock_unlock(&mutex->lock);
-            continue;
-        }
+#if ENABLE_LOCKSTAT
+    if (atomic_ld_acq(&mutex->owner) >= 0)
+        LOCKSTAT_CONTENDED();
+#endif
 
-        if (mutex->owner < 0 && !mutex->noyield_waiting) {
-            // Take ownership
-            mutex->owner = thread_get_id();
+    // Spin count is zero on uniprocessor
+    bool spun = mutex_spin(mutex);
 
-            MUTEX_DTRACE("Took ownership of %p\n", (void*)mutex);
+    // Lock the mutex to acquire it or manipulate wait chain
+    spinlock_lock(&mutex->lock);
 
-            // Increase spin count
-            if (mutex->spin_count < SPINCOUNT_MAX)
-                mutex->spin_count -= spincount_mask;
+    if (mutex->owner < 0 && !mutex->noyield_waiting) {
+        // Take ownership
+        mutex->owner = thread_get_id();
 
-            atomic_barrier();
+        MUTEX_DTRACE("Took ownership of %p\n", (void*)mutex);
 
-            break;
-        }
+        // Increase spin count if spinning paid off
+        if (spun && mutex->spin_count < SPINCOUNT_MAX)
+            mutex->spin_count -= spincount_mask;
 
+        atomic_barrier();
+    } else {
         // Mutex is owned
         thread_wait_t wait;
 
-        // Decrease spin count
-        if (mutex->spin_count > SPINCOUNT_MIN)
+        // Decrease spin count if the owner ran for the whole spin.
+        // It is unowned while a noyield waiter is being handed it
+        thread_t owner = mutex->owner;
+        if (mutex->spin_count > SPINCOUNT_MIN && owner >= 0 &&
+                thread_is_running(owner))
             mutex->spin_count += spincount_mask;
 
         MUTEX_DTRACE("Adding to waitchain of %p\n", (void*)mutex);
@@ -135,17 +170,17 @@ EXPORT void mutex_lock(mutex_t *mutex)
 
         MUTEX_DTRACE("Waitchain for %p\n", (void*)mutex);
 
-        // Wait
+        // Wait, ownership is handed to us by mutex_unlock
         thread_suspend_release(&mutex->lock, &wait.thread);
 
         assert(mutex->lock != 0);
         assert(wait.link.next == nullptr);
         assert(wait.link.prev == nullptr);
         assert(mutex->owner == wait.thread);
-
-        break;
     }
 
+    LOCKSTAT_OWNED(mutex);
+
     // Release lock
     spinlock_unlock(&mutex->lock);
 }
@@ -157,6 +192,8 @@ EXPORT void mutex_unlock(mutex_t *mutex)
     atomic_barrier();
     assert(mutex->owner == thread_get_id());
 
+    LOCKSTAT_DISOWNED(mutex);
+
     // See if any threads are waiting
     if (mutex->link.next != &mutex->link) {
         // Wake up the first waiter
@@ -177,6 +214,8 @@ EXPORT void mutex_unlock(mutex_t *mutex)
 
 EXPORT void mutex_lock_noyield(mutex_t *mutex)
 {
+    LOCKSTAT_WAIT(mutex);
+
     thread_t tid = thread_get_id();
     int noyield_stored = 0;
 
@@ -197,7 +236,11 @@ EXPORT void mutex_lock_noyield(mutex_t *mutex)
             if (noyield_stored)
                 mutex->noyield_waiting = 0;
 
+            LOCKSTAT_OWNED(mutex);
+
             done = true;
+        } else {
+            LOCKSTAT_CONTENDED();
         }
 
         spinlock_unlock(&mutex->lock);
@@ -470,6 +513,116 @@ EXPORT bool rwlock_have_ex(rwlock_t *rwlock)
     return rwlock->reader_count == -thread_get_id();
 }
 
+//
+// Big-reader lock
+
+EXPORT void brlock_init(brlock_t *brlock)
+{
+    for (brlock_cpu_t &cpu : brlock->cpus)
+        cpu.readers = 0;
+    brlock->writer = false;
+    mutex_init(&brlock->writer_lock);
+}
+
+EXPORT void brlock_destroy(brlock_t *brlock)
+{
+    assert(!brlock->writer);
+    mutex_destroy(&brlock->writer_lock);
+}
+
+static int brlock_reader_count(brlock_t *brlock)
+{
+    int readers = 0;
+
+    for (int i = 0, e = thread_get_cpu_count(); i < e; ++i)
+        readers += atomic_ld_acq(&brlock->cpus[i].readers);
+
+    return readers;
+}
+
+// Expects the writer lock to be held
+static bool brlock_ex_try_acquire(brlock_t *brlock)
+{
+    // The fence orders the flag before summing the counters,
+    // readers increment their counter before they check the flag
+    brlock->writer = true;
+    atomic_fence();
+
+    return brlock_reader_count(brlock) == 0;
+}
+
+EXPORT bool brlock_ex_try_lock(brlock_t *brlock)
+{
+    if (!mutex_try_lock(&brlock->writer_lock))
+        return false;
+
+    if (brlock_ex_try_acquire(brlock))
+        return true;
+
+    atomic_st_rel(&brlock->writer, false);
+    mutex_unlock(&brlock->writer_lock);
+
+    return false;
+}
+
+EXPORT void brlock_ex_lock(brlock_t *brlock)
+{
+    mutex_lock(&brlock->writer_lock);
+
+    if (brlock_ex_try_acquire(brlock))
+        return;
+
+    // New readers back off, wait for the ones holding it to leave
+    while (brlock_reader_count(brlock) != 0)
+        thread_yield();
+}
+
+EXPORT void brlock_ex_unlock(brlock_t *brlock)
+{
+    assert(brlock->writer);
+    atomic_st_rel(&brlock->writer, false);
+    mutex_unlock(&brlock->writer_lock);
+}
+
+EXPORT bool brlock_sh_try_lock(brlock_t *brlock)
+{
+    // The CPU may change right after this, any counter will do
+    int volatile *readers = &brlock->cpus[thread_cpu_number()].readers;
+
+    // The locked increment orders it before the load of the flag
+    atomic_inc(readers);
+
+    if (likely(!atomic_ld_acq(&brlock->writer)))
+        return true;
+
+    // Back off on the same counter, so a writer summing the counters
+    // never sees fewer than the readers holding the lock
+    atomic_dec(readers);
+
+    return false;
+}
+
+EXPORT void brlock_sh_lock(brlock_t *brlock)
+{
+    while (unlikely(!brlock_sh_try_lock(brlock))) {
+        int spin = 0;
+        while (atomic_ld_acq(&brlock->writer)) {
+            if (++spin < BRLOCK_SPIN_MAX) {
+                pause();
+            } else {
+                // The writer may be waiting for readers on this CPU
+                thread_yield();
+            }
+        }
+    }
+}
+
+EXPORT void brlock_sh_unlock(brlock_t *brlock)
+{
+    // The locked decrement orders the reads of the data before it
+    atomic_dec(&brlock->cpus[thread_cpu_number()].readers);
+}
+
 //
 // Condition variable
 
@@ -510,6 +663,11 @@ public:
         saved_lock = spinlock_unlock_save(spinlock);
     }
 
+    _always_inline mutex_t *requeue_mutex() const
+    {
+        return nullptr;
+    }
+
 protected:
     spinlock_t *spinlock;
     spinlock_value_t saved_lock;
@@ -532,6 +690,11 @@ public:
         saved_lock = ticketlock_unlock_save(ticketlock);
     }
 
+    _always_inline mutex_t *requeue_mutex() const
+    {
+        return nullptr;
+    }
+
 protected:
     ticketlock_t *ticketlock;
     ticketlock_value_t saved_lock;
@@ -555,6 +718,11 @@ public:
         mcslock_unlock_noena(root, node);
     }
 
+    _always_inline mutex_t *requeue_mutex() const
+    {
+        return nullptr;
+    }
+
 protected:
     mcs_queue_ent_t * volatile *root;
     mcs_queue_ent_t * node;
@@ -577,6 +745,11 @@ public:
         mutex_unlock(mutex);
     }
 
+    _always_inline mutex_t *requeue_mutex() const
+    {
+        return mutex;
+    }
+
 protected:
     mutex_t *mutex;
 };
@@ -591,6 +764,23 @@ struct condvar_mutex_noyield_t : public condvar_mutex_t {
     {
         mutex_lock_noyield(mutex);
     }
+
+    _always_inline mutex_t *requeue_mutex() const
+    {
+        return nullptr;
+    }
+};
+
+// A condvar waiter that will reacquire a mutex_t can be moved onto the
+// wait chain of the mutex instead of being woken, so that waking many
+// waiters hands the mutex from one to the next, instead of waking them
+// all to contend for it
+struct condvar_wait_t {
+    // Must be first, the mutex wait chain links thread_wait_t
+    thread_wait_t wait;
+
+    // Null if the lock cannot be requeued onto
+    mutex_t *mutex;
 };
 
 template<typename T>
@@ -598,19 +788,52 @@ static void condvar_wait_ex(condition_var_t *var, T& lock_upd)
 {
     spinlock_lock(&var->lock);
 
-    thread_wait_t wait;
-    thread_wait_add(&var->link, &wait.link);
+    condvar_wait_t wait;
+    wait.mutex = lock_upd.requeue_mutex();
+    thread_wait_add(&var->link, &wait.wait.link);
 
     lock_upd.unlock();
     CONDVAR_DTRACE("%p: Suspending\n", (void*)&wait);
-    thread_suspend_release(&var->lock, &wait.thread);
+    thread_suspend_release(&var->lock, &wait.wait.thread);
     CONDVAR_DTRACE("%p: Awoke\n", (void*)&wait);
 
     spinlock_unlock(&var->lock);
-    lock_upd.lock();
 
-    assert(wait.link.next == nullptr);
-    assert(wait.link.prev == nullptr);
+    // A requeued waiter is woken with the mutex handed to it
+    if (!wait.mutex || atomic_ld_acq(&wait.mutex->owner) != wait.wait.thread)
+        lock_upd.lock();
+
+    assert(wait.wait.link.next == nullptr);
+    assert(wait.wait.link.prev == nullptr);
+}
+
+// Expects the condvar to be locked, and the waiter to be unlinked
+static void condvar_wake_waiter(condvar_wait_t *wait)
+{
+    mutex_t *mutex = wait->mutex;
+
+    if (!mutex) {
+        thread_resume(wait->wait.thread);
+        return;
+    }
+
+    // Lock order is condvar then mutex, same as condvar_wait
+    spinlock_lock(&mutex->lock);
+
+    if (mutex->owner < 0) {
+        // Hand the free mutex to the waiter, like mutex_unlock does
+        mutex->owner = wait->wait.thread;
+        atomic_barrier();
+        spinlock_unlock(&mutex->lock);
+        thread_resume(wait->wait.thread);
+        return;
+    }
+
+    // Requeue, it stays suspended until mutex_unlock hands it the mutex
+    CONDVAR_DTRACE("%p: Requeue onto mutex %p\n",
+                   (void*)wait, (void*)mutex);
+    thread_wait_add(&mutex->link, &wait->wait.link);
+    spinlock_unlock(&mutex->lock);
 }
 
 EXPORT void condvar_wait_spinlock(condition_var_t *var, spinlock_t *lock)
@@ -652,12 +875,13 @@ EXPORT void condvar_wake_one(condition_var_t *var)
 {
     spinlock_lock(&var->lock);
 
-    thread_wait_t volatile *wait = (thread_wait_t*)var->link.next;
+    condvar_wait_t *wait = (condvar_wait_t*)var->link.next;
     if ((void*)wait != (void*)&var->link) {
         CONDVAR_DTRACE("%p: Removing wait\n", (void*)wait);
-        thread_wait_del(&wait->link);
-        CONDVAR_DTRACE("%p: Waking id %d\n", (void*)wait, wait->thread);
-        thread_resume(wait->thread);
+        thread_wait_del(&wait->wait.link);
+        CONDVAR_DTRACE("%p: Waking id %d\n",
+                       (void*)wait, wait->wait.thread);
+        condvar_wake_waiter(wait);
     } else {
         CONDVAR_DTRACE("No waiters when waking\n");
     }
@@ -668,13 +892,15 @@ EXPORT void condvar_wake_all(condition_var_t *var)
 {
     spinlock_lock(&var->lock);
 
-    thread_wait_t *next_wait;
-    for (thread_wait_t *wait = (thread_wait_t*)var->link.next;
+    // At most one waiter gets the mutex, the rest are requeued onto it
+    condvar_wait_t *next_wait;
+    for (condvar_wait_t *wait = (condvar_wait_t*)var->link.next;
          wait != (void*)&var->link;
          wait = next_wait) {
-        CONDVAR_DTRACE("%p: Waking id %d\n", (void*)wait, wait->thread);
-        next_wait = (thread_wait_t*)thread_wait_del(&wait->link);
-        thread_resume(wait->thread);
+        CONDVAR_DTRACE("%p: Waking id %d\n",
+                       (void*)wait, wait->wait.thread);
+        next_wait = (condvar_wait_t*)thread_wait_del(&wait->wait.link);
+        condvar_wake_waiter(wait);
     }
 
     spinlock_unlock(&var->lock);
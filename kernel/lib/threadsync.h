@@ -60,6 +60,26 @@ struct rwlock_t {
     spinlock_t lock;
 };
 
+// Big-reader lock, for read-mostly data. A reader only takes its own
+// CPU's counter cache line. A writer sets the writer flag and waits for
+// the readers on every CPU to drain, it is much more expensive than an
+// rwlock_t writer. Not recursive, a reader taking it again while a
+// writer waits deadlocks
+struct alignas(64) brlock_cpu_t {
+    int volatile readers;
+};
+
+struct brlock_t {
+    // A reader may migrate and release on another CPU,
+    // only the sum over every CPU is meaningful
+    brlock_cpu_t cpus[MAX_CPUS];
+
+    bool volatile writer;
+
+    // Serializes writers
+    mutex_t writer_lock;
+};
+
 void mutex_init(mutex_t *mutex);
 void mutex_destroy(mutex_t *mutex);
 int mutex_held(mutex_t *mutex);
@@ -79,6 +99,15 @@ void rwlock_ex_unlock(rwlock_t *rwlock);
 void rwlock_sh_unlock(rwlock_t *rwlock);
 bool rwlock_have_ex(rwlock_t *rwlock);
 
+void brlock_init(brlock_t *brlock);
+void brlock_destroy(brlock_t *brlock);
+bool brlock_ex_try_lock(brlock_t *brlock);
+void brlock_ex_lock(brlock_t *brlock);
+void brlock_ex_unlock(brlock_t *brlock);
+bool brlock_sh_try_lock(brlock_t *brlock);
+void brlock_sh_lock(brlock_t *brlock);
+void brlock_sh_unlock(brlock_t *brlock);
+
 void condvar_init(condition_var_t *var);
 void condvar_destroy(condition_var_t *var);
 void condvar_wait(condition_var_t *var, mutex_t *mutex);
@@ -62,14 +62,17 @@ unsigned time_day_of_year(time_of_day_t const& time)
 
 uint64_t time_unix(time_of_day_t const& time)
 {
+    // Years since 1900
+    int64_t year = time.century * 100 + time.year - 1900;
+
     return uint64_t(time.second) +
             time.minute * 60 +
             time.hour * 3600 +
             time_day_of_year(time) * 86400 +
-            (time.year - 70) * 365 * 86400 +
-            ((time.year - 69) / 4) * 86400 -
-            ((time.year - 1) / 100) * 86400 +
-            ((time.year + 299) / 400) * 86400;
+            (year - 70) * 365 * 86400 +
+            ((year - 69) / 4) * 86400 -
+            ((year - 1) / 100) * 86400 +
+            ((year + 299) / 400) * 86400;
 }
 
 bool time_ns_set_handler(uint64_t (*vec)(), void (*stop)(), bool override)
@@ -126,3 +129,17 @@ time_of_day_t time_ofday()
 {
     return time_gettimeofday_vec();
 }
+
+int64_t time_realtime_base(void)
+{
+    static int64_t realtime_base;
+
+    // Racing callers compute the same value
+    if (!realtime_base && time_gettimeofday_vec) {
+        time_of_day_t now = time_ofday();
+        realtime_base = int64_t(time_unix(now)) * 1000000000 -
+                int64_t(time_ns());
+    }
+
+    return realtime_base;
+}
@@ -37,4 +37,7 @@ time_of_day_t time_ofday(void);
 
 uint64_t time_unix(time_of_day_t const& time);
 
+// Nanoseconds since the epoch when time_ns was zero, from the RTC
+int64_t time_realtime_base(void);
+
 __END_DECLS
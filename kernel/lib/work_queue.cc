@@ -1,92 +1,284 @@
 #include "work_queue.h"
 #include "thread.h"
-#include "vector.h"
-#include "mutex.h"
-#include "heap.h"
+#include "callout.h"
+#include "likely.h"
+#include "assert.h"
+#include "cpu/atomic.h"
+#include "cpu/spinlock.h"
+#include "cpu/control_regs.h"
 
 workq_impl* workq::percpu;
+int workq::count;
 
-class workq_impl : public workq {
+// Small items are carved from malloc'ed slabs of this many slots, and
+// go back to the free list of whichever CPU frees them. Slots are never
+// returned to the heap
+#define WORKQ_SLAB_SLOTS    128
+
+struct workq_slot_t {
+    workq_slot_t *next;
+};
+
+// Only accessed by the owning CPU with interrupts disabled
+struct alignas(64) workq_slot_list_t {
+    workq_slot_t *free;
+};
+
+static workq_slot_list_t workq_slots[MAX_CPUS];
+
+// Per-CPU queue. Anyone pushes onto the incoming list with a single
+// compare exchange, the worker takes the whole list at once and runs
+// it as a batch. An idle worker takes the whole list of another CPU
+class workq_impl {
 public:
     workq_impl()
+        : incoming(nullptr)
+        , cpu(-1)
+        , sleep_lock(0)
+        , sleep_tid(-1)
+        , sleeping(false)
     {
-        heap_create();
-        tid = thread_create(worker, this, 0, false);
     }
 
     workq_impl(workq_impl const&) = delete;
     workq_impl& operator=(workq_impl) = delete;
 
+    void start(int cpu_nr);
+
     void enqueue(workq_work *work);
 
-private:
-    struct work {
-        typedef void (*callback_t)(uintptr_t arg);
-        callback_t callback;
-        uintptr_t arg;
-    };
+    // Returns false if the worker was not sleeping
+    bool wake();
 
-    int tid;
-    using lock_type = mcslock;
-    using scoped_lock = unique_lock<lock_type>;
-    lock_type lock;
-    condition_variable not_empty;
+private:
+    workq_work *take_all();
+    workq_work *steal();
+    void wait();
 
-    workq_work *head;
-    workq_work *tail;
+    _noreturn
+    void worker();
 
     static int worker(void *arg)
     {
         ((workq_impl*)arg)->worker();
-        return 0;
     }
 
-    workq_work *dequeue_work()
-    {
-        scoped_lock hold(lock);
-        while (!head)
-            not_empty.wait(hold);
-        workq_work *item = head;
-        head = item->next;
-        return item;
+    workq_work * volatile incoming;
+
+    int cpu;
+
+    spinlock_t sleep_lock;
+    thread_t sleep_tid;
+    bool volatile sleeping;
+};
+
+void workq_impl::start(int cpu_nr)
+{
+    cpu = cpu_nr;
+    thread_t tid = thread_create(worker, this, 0, false);
+    thread_close(tid);
+}
+
+void workq_impl::enqueue(workq_work *work)
+{
+    workq_work *old_head = incoming;
+
+    for (;;) {
+        work->next = old_head;
+
+        workq_work *seen = atomic_cmpxchg(&incoming, old_head, work);
+
+        if (likely(seen == old_head))
+            break;
+
+        old_head = seen;
     }
 
-    void worker()
-    {
-        workq_work *item = dequeue_work();
+    // Whoever queued the first item of a batch already woke somebody
+    if (old_head || wake())
+        return;
+
+    // The worker is busy, let an idle worker steal the batch
+    for (int i = 1; i < workq::count; ++i) {
+        workq_impl *other = workq::percpu + (cpu + i) % workq::count;
 
-        item->invoke();
-        free_item(item);
+        if (!thread_cpu_is_isolated(other->cpu) && other->wake())
+            break;
     }
-};
+}
+
+bool workq_impl::wake()
+{
+    if (!atomic_ld_acq(&sleeping))
+        return false;
+
+    spinlock_lock(&sleep_lock);
+
+    bool was_sleeping = sleeping;
+
+    if (was_sleeping) {
+        sleeping = false;
+        thread_wake(sleep_tid);
+    }
+
+    spinlock_unlock(&sleep_lock);
+
+    return was_sleeping;
+}
+
+// Returns the queued items in the order they were queued
+workq_work *workq_impl::take_all()
+{
+    // Avoid taking the cache line exclusive when there is nothing
+    if (!atomic_ld_acq(&incoming))
+        return nullptr;
+
+    workq_work *item = atomic_xchg(&incoming, nullptr);
+
+    workq_work *batch = nullptr;
+
+    while (item) {
+        workq_work *next = item->next;
+        item->next = batch;
+        batch = item;
+        item = next;
+    }
+
+    return batch;
+}
+
+workq_work *workq_impl::steal()
+{
+    for (int i = 1; i < workq::count; ++i) {
+        workq_work *batch = workq::percpu[(cpu + i) % workq::count].take_all();
+
+        if (batch)
+            return batch;
+    }
+
+    return nullptr;
+}
+
+void workq_impl::wait()
+{
+    spinlock_lock(&sleep_lock);
+
+    // The fence orders the store before the final check,
+    // enqueue pushes before it checks sleeping
+    sleeping = true;
+    atomic_fence();
+
+    if (!atomic_ld_acq(&incoming))
+        thread_sleep_release(&sleep_lock, &sleep_tid, UINT64_MAX);
+
+    sleeping = false;
+
+    spinlock_unlock(&sleep_lock);
+}
+
+void workq_impl::worker()
+{
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t(cpu));
+
+    for (;;) {
+        workq_work *batch = take_all();
+
+        // Isolated CPUs do not run other CPUs' work
+        if (!batch && !thread_cpu_is_isolated(cpu))
+            batch = steal();
+
+        if (!batch) {
+            wait();
+            continue;
+        }
+
+        while (batch) {
+            workq_work *next = batch->next;
+            batch->invoke();
+            workq::free_item(batch);
+            batch = next;
+        }
+    }
+}
 
 void workq::init(int cpu_count)
 {
     percpu = new workq_impl[cpu_count];
+    count = cpu_count;
+
+    for (int i = 0; i < cpu_count; ++i)
+        percpu[i].start(i);
 }
 
-void workq_impl::enqueue(workq_work *work)
+void workq::enqueue(workq_work *item)
 {
-    scoped_lock hold(lock);
-    if (head == nullptr) {
-        head = tail = work;
-    } else {
-        tail->next = work;
-        tail = work;
-    }
-    not_empty.notify_one();
+    assert(percpu);
+
+    int cpu = thread_cpu_number();
+
+    // Unbound work stays off isolated CPUs, the boot CPU never is
+    while (thread_cpu_is_isolated(cpu))
+        cpu = (cpu + 1) % count;
+
+    percpu[cpu].enqueue(item);
 }
 
 void workq::free_item(workq_work *item)
 {
-    heap_free(item->owner->heap, item);
+    bool pooled = item->pooled;
+
+    item->~workq_work();
+
+    if (!pooled) {
+        free(item);
+        return;
+    }
+
+    workq_slot_t *slot = (workq_slot_t*)item;
+
+    cpu_scoped_irq_disable intr_was_enabled;
+    workq_slot_list_t *list = workq_slots + thread_cpu_number();
+    slot->next = list->free;
+    list->free = slot;
 }
 
-workq_work *workq::allocate(size_t size)
+void *workq::allocate(size_t size)
 {
-    size_t current_cpu = thread_cpu_number();
-    workq_impl *queue = percpu + current_cpu;
-    auto item = (workq_work *)heap_alloc(queue->heap, size);
-    item->owner = queue;
-    return item;
+    if (size > slot_size)
+        return malloc(size);
+
+    for (;;) {
+        {
+            cpu_scoped_irq_disable intr_was_enabled;
+            workq_slot_list_t *list = workq_slots + thread_cpu_number();
+            workq_slot_t *slot = list->free;
+
+            if (likely(slot)) {
+                list->free = slot->next;
+                return slot;
+            }
+        }
+
+        // The heap may block, carve the slab with interrupts enabled
+        char *slab = (char*)malloc(slot_size * WORKQ_SLAB_SLOTS);
+
+        if (unlikely(!slab))
+            return nullptr;
+
+        cpu_scoped_irq_disable intr_was_enabled;
+        workq_slot_list_t *list = workq_slots + thread_cpu_number();
+
+        for (size_t i = 0; i < WORKQ_SLAB_SLOTS; ++i) {
+            workq_slot_t *slot = (workq_slot_t*)(slab + i * slot_size);
+            slot->next = list->free;
+            list->free = slot;
+        }
+    }
 }
+
+static void workq_startup(void *)
+{
+    workq::init(thread_get_cpu_count());
+}
+
+REGISTER_CALLOUT(workq_startup, nullptr, callout_type_t::smp_online, "100");
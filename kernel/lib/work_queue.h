@@ -1,6 +1,7 @@
 #pragma once
 #include "types.h"
-#include "heap.h"
+#include "stdlib.h"
+#include "likely.h"
 #include <utility.h>
 
 class workq_impl;
@@ -9,11 +10,14 @@ class workq;
 // Abstract work queue work item
 class workq_work {
 public:
+    virtual ~workq_work() {}
     virtual void invoke() = 0;
 
 private:
     workq_work *next;
-    workq_impl *owner;
+
+    // Allocated from the per-CPU slot lists instead of the heap
+    bool pooled;
 
     friend class workq_impl;
     friend class workq;
@@ -21,32 +25,46 @@ private:
 
 class workq {
 public:
+    // Items up to this size come from per-CPU free lists
+    static constexpr size_t slot_size = 64;
+
+    // Returns null if out of memory
     template<typename T, typename... Args>
     static T* construct(Args&& ...args)
     {
         void *mem = workq::allocate(sizeof(T));
-        return new (mem) T(forward<Args>(args)...);
+        if (unlikely(!mem))
+            return nullptr;
+        T* item = new (mem) T(forward<Args>(args)...);
+        static_cast<workq_work*>(item)->pooled = sizeof(T) <= slot_size;
+        return item;
     }
 
+    // Returns false if out of memory
     template<typename T, typename... Args>
-    static void emplace(Args&& ...args)
+    static bool emplace(Args&& ...args)
     {
-        T* item = construct(forward<Args>(args)...);
+        T* item = construct<T>(forward<Args>(args)...);
+        if (unlikely(!item))
+            return false;
         enqueue(item);
+        return true;
     }
 
+    // Queue the item on the calling CPU, or on another CPU if this one
+    // is isolated. Idle workers steal queued items from busy CPUs
+    static void enqueue(workq_work *item);
+
     static void init(int cpu_count);
 
-protected:
+private:
     static void free_item(workq_work *item);
 
-    // Per CPU heap
-    heap_t *heap;
+    static void *allocate(size_t size);
 
     // Array of queues, one per CPU
     static workq_impl* percpu;
+    static int count;
 
-private:
-    // Allocate memory on the per-cpu heap
-    static workq_work *allocate(size_t size);
+    friend class workq_impl;
 };
@@ -14,6 +14,7 @@
 #include "assert.h"
 #include "cpu/atomic.h"
 #include "cpu/control_regs.h"
+#include "cpu/cpuid.h"
 #include "rand.h"
 #include "string.h"
 #include "heap.h"
@@ -60,14 +61,28 @@ REGISTER_CALLOUT(smp_main, nullptr, callout_type_t::smp_start, "100");
 #define ENABLE_READ_STRESS_THREAD   0
 #define ENABLE_SLEEP_THREAD         0
 #define ENABLE_MUTEX_THREAD         0
+#define ENABLE_MUTEX_BENCH          0
 #define ENABLE_REGISTER_THREAD      0
 #define ENABLE_MMAP_STRESS_THREAD   0
 #define ENABLE_CTXSW_STRESS_THREAD  0
+#define ENABLE_CTXSW_BENCH          0
 #define ENABLE_HEAP_STRESS_THREAD   0
 #define ENABLE_FRAMEBUFFER_THREAD   0
 #define ENABLE_FILESYSTEM_TEST      0
 #define ENABLE_SPAWN_STRESS         0
 #define ENABLE_CONDVAR_STRESS       0
+#define ENABLE_CONDVAR_BENCH        0
+#define ENABLE_ISOLATION_BENCH      0
+#define ENABLE_INTERACT_BENCH       0
+#define ENABLE_THREAD_CREATE_BENCH  0
+#define ENABLE_WORKQ_BENCH          0
+#define ENABLE_RCU_BENCH            0
+#define ENABLE_TIME_BENCH           0
+#define ENABLE_BRLOCK_BENCH         0
+#define ENABLE_RING_BENCH           0
+#define ENABLE_PREAD_BENCH          0
+#define ENABLE_IPI_BENCH            0
+#define ENABLE_HPET_TEST            0
 #define ENABLE_STRESS_HEAP_SMALL    0
 #define ENABLE_STRESS_HEAP_LARGE    0
 #define ENABLE_STRESS_HEAP_BOTH     1
@@ -97,6 +112,58 @@ static int ctx_sw_thread(void *p)
 
 #endif
 
+#if ENABLE_CTXSW_BENCH > 0
+// Measures context switch cost between a pair of threads yielding to
+// each other on one CPU, with and without live vector register state
+struct ctxsw_bench_t {
+    bool use_vector;
+    uint64_t cycles;
+};
+
+static int ctxsw_bench_thread(void *p)
+{
+    ctxsw_bench_t *bench = (ctxsw_bench_t*)p;
+
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t(0));
+
+    uint64_t st = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_CTXSW_BENCH; ++i) {
+        // Dirty the vector state every time slice
+        if (bench->use_vector && cpuid_has_avx())
+            __asm__ __volatile__ ("vpcmpeqb %%ymm0,%%ymm0,%%ymm0" ::: "memory");
+        else if (bench->use_vector)
+            __asm__ __volatile__ ("pcmpeqb %%xmm0,%%xmm0" ::: "memory");
+
+        thread_yield();
+    }
+    bench->cycles = cpu_rdtsc() - st;
+
+    return 0;
+}
+
+static void ctxsw_bench(bool use_vector)
+{
+    ctxsw_bench_t bench[2] = {
+        { use_vector, 0 },
+        { use_vector, 0 }
+    };
+
+    // Threads with user set get an FPU save area
+    thread_t tids[2];
+    for (size_t i = 0; i < countof(tids); ++i)
+        tids[i] = thread_create(ctxsw_bench_thread, bench + i, 0, use_vector);
+
+    for (size_t i = 0; i < countof(tids); ++i) {
+        thread_wait(tids[i]);
+        thread_close(tids[i]);
+    }
+
+    printk("Context switch %s: %" PRIu64 " cycles per switch\n",
+           use_vector ? "vector" : "integer",
+           (bench[0].cycles + bench[1].cycles) / (2 * ENABLE_CTXSW_BENCH));
+}
+#endif
+
 #if ENABLE_SHELL_THREAD > 0
 static int shell_thread(void *p)
 {
@@ -269,8 +336,8 @@ static int other_thread(void *p)
             thread_sleep_for(tp->sleep);
         //else
 
-        thread_set_affinity(thread_get_id(),
-                            (1UL << (odd % thread_get_cpu_count())));
+        thread_set_affinity(thread_get_id(), thread_cpu_mask_t(
+                                odd % thread_get_cpu_count()));
     }
     return 0;
 }
@@ -306,6 +373,885 @@ static int stress_mutex(void *p)
 }
 #endif
 
+#if ENABLE_MUTEX_BENCH > 0
+// Measures the cycles waiters spend acquiring a contended mutex, and the
+// latency from an unlock to the next acquisition by a different thread.
+// With a short critical section the waiters should spin and take over
+// quickly, when the holder sleeps they should not burn cycles spinning
+struct mutex_bench_t {
+    mutex_t lock;
+    bool sleep_holder;
+    thread_t volatile last_owner;
+    uint64_t volatile unlock_time;
+
+    // Updated while holding the lock
+    uint64_t wait_cycles;
+    uint64_t handoff_cycles;
+    uint64_t handoffs;
+};
+
+static int mutex_bench_thread(void *p)
+{
+    mutex_bench_t *bench = (mutex_bench_t*)p;
+    thread_t this_thread = thread_get_id();
+
+    for (size_t i = 0; i < ENABLE_MUTEX_BENCH; ++i) {
+        uint64_t st = cpu_rdtsc();
+        mutex_lock(&bench->lock);
+        uint64_t en = cpu_rdtsc();
+
+        bench->wait_cycles += en - st;
+
+        if (bench->last_owner != this_thread && bench->last_owner >= 0) {
+            bench->handoff_cycles += en - bench->unlock_time;
+            ++bench->handoffs;
+        }
+
+        bench->last_owner = this_thread;
+
+        if (bench->sleep_holder)
+            thread_sleep_for(1);
+        else
+            for (size_t k = 0; k < 64; ++k)
+                pause();
+
+        bench->unlock_time = cpu_rdtsc();
+        mutex_unlock(&bench->lock);
+    }
+
+    return 0;
+}
+
+static void mutex_bench(bool sleep_holder)
+{
+    static mutex_bench_t bench;
+    bench.sleep_holder = sleep_holder;
+    bench.last_owner = -1;
+    bench.unlock_time = 0;
+    bench.wait_cycles = 0;
+    bench.handoff_cycles = 0;
+    bench.handoffs = 0;
+    mutex_init(&bench.lock);
+
+    size_t thread_count = max(thread_get_cpu_count(), size_t(2));
+
+    thread_t *tids = new thread_t[thread_count];
+    for (size_t i = 0; i < thread_count; ++i)
+        tids[i] = thread_create(mutex_bench_thread, &bench, 0, false);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        thread_wait(tids[i]);
+        thread_close(tids[i]);
+    }
+
+    delete[] tids;
+
+    mutex_destroy(&bench.lock);
+
+    printk("Mutex %s holder, %zu threads: %" PRIu64 " cycles per acquire,"
+           " %" PRIu64 " cycles per handoff\n",
+           sleep_holder ? "sleeping" : "running", thread_count,
+           bench.wait_cycles / (thread_count * ENABLE_MUTEX_BENCH),
+           bench.handoffs ? bench.handoff_cycles / bench.handoffs : 0);
+}
+#endif
+
+#if ENABLE_CONDVAR_BENCH > 0
+// Measures the cycles from a broadcast until every waiter has
+// reacquired the mutex and consumed the broadcast
+#define CONDVAR_BENCH_WAITERS   64
+
+struct condvar_bench_t {
+    mutex_t lock;
+    condition_var_t wake_cond;
+    condition_var_t done_cond;
+
+    // Protected by lock
+    int generation;
+    int pending;
+    uint64_t broadcast_time;
+    uint64_t cycles;
+};
+
+static int condvar_bench_thread(void *p)
+{
+    condvar_bench_t *bench = (condvar_bench_t*)p;
+
+    mutex_lock(&bench->lock);
+
+    for (int gen = 0; gen < ENABLE_CONDVAR_BENCH; ) {
+        while (bench->generation == gen)
+            condvar_wait(&bench->wake_cond, &bench->lock);
+
+        gen = bench->generation;
+
+        if (--bench->pending == 0) {
+            bench->cycles += cpu_rdtsc() - bench->broadcast_time;
+            condvar_wake_one(&bench->done_cond);
+        }
+    }
+
+    mutex_unlock(&bench->lock);
+
+    return 0;
+}
+
+static void condvar_bench()
+{
+    static condvar_bench_t bench;
+    mutex_init(&bench.lock);
+    condvar_init(&bench.wake_cond);
+    condvar_init(&bench.done_cond);
+    bench.generation = 0;
+    bench.pending = 0;
+    bench.cycles = 0;
+
+    thread_t tids[CONDVAR_BENCH_WAITERS];
+    for (size_t i = 0; i < countof(tids); ++i)
+        tids[i] = thread_create(condvar_bench_thread, &bench, 0, false);
+
+    mutex_lock(&bench.lock);
+    for (int i = 0; i < ENABLE_CONDVAR_BENCH; ++i) {
+        while (bench.pending)
+            condvar_wait(&bench.done_cond, &bench.lock);
+
+        bench.pending = CONDVAR_BENCH_WAITERS;
+        ++bench.generation;
+        bench.broadcast_time = cpu_rdtsc();
+        condvar_wake_all(&bench.wake_cond);
+    }
+    mutex_unlock(&bench.lock);
+
+    for (size_t i = 0; i < countof(tids); ++i) {
+        thread_wait(tids[i]);
+        thread_close(tids[i]);
+    }
+
+    condvar_destroy(&bench.done_cond);
+    condvar_destroy(&bench.wake_cond);
+    mutex_destroy(&bench.lock);
+
+    printk("Condvar broadcast to %d waiters: %" PRIu64 " cycles\n",
+           CONDVAR_BENCH_WAITERS, bench.cycles / ENABLE_CONDVAR_BENCH);
+}
+#endif
+
+#if ENABLE_ISOLATION_BENCH > 0
+// Busy-polls the TSC on the last CPU, with the CPU isolated and not,
+// while a CPU hog per CPU competes for it. Reports the largest gap
+// between polls, and how many gaps exceeded ISOLATION_BENCH_STALL
+#define ISOLATION_BENCH_STALL   (1 << 12)
+
+struct isolation_bench_t {
+    size_t cpu;
+    uint64_t max_gap;
+    uint64_t stalls;
+};
+
+static bool volatile isolation_bench_done;
+
+static int isolation_bench_hog(void *)
+{
+    while (!isolation_bench_done)
+        pause();
+
+    return 0;
+}
+
+static int isolation_bench_thread(void *p)
+{
+    isolation_bench_t *bench = (isolation_bench_t*)p;
+
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t(bench->cpu));
+
+    uint64_t last = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_ISOLATION_BENCH; ++i) {
+        uint64_t now = cpu_rdtsc();
+        uint64_t gap = now - last;
+        last = now;
+
+        if (bench->max_gap < gap)
+            bench->max_gap = gap;
+
+        bench->stalls += gap > ISOLATION_BENCH_STALL;
+    }
+
+    return 0;
+}
+
+static void isolation_bench_run(size_t cpu, bool isolate)
+{
+    thread_cpu_mask_t saved = thread_get_isolated();
+    thread_cpu_mask_t isolated = saved;
+    if (isolate)
+        isolated.set(cpu);
+    else
+        isolated.clr(cpu);
+    thread_set_isolated(isolated);
+
+    isolation_bench_done = false;
+
+    size_t hog_count = thread_get_cpu_count();
+    thread_t *hogs = new thread_t[hog_count];
+    for (size_t i = 0; i < hog_count; ++i)
+        hogs[i] = thread_create(isolation_bench_hog, nullptr, 0, false);
+
+    isolation_bench_t bench{ cpu, 0, 0 };
+    thread_t tid = thread_create(isolation_bench_thread, &bench, 0, false);
+    thread_wait(tid);
+    thread_close(tid);
+
+    isolation_bench_done = true;
+
+    for (size_t i = 0; i < hog_count; ++i) {
+        thread_wait(hogs[i]);
+        thread_close(hogs[i]);
+    }
+
+    delete[] hogs;
+
+    thread_set_isolated(saved);
+
+    printk("CPU %zu %s: max gap %" PRIu64 " cycles,"
+           " %" PRIu64 " gaps over %d cycles\n",
+           cpu, isolate ? "isolated" : "shared",
+           bench.max_gap, bench.stalls, ISOLATION_BENCH_STALL);
+}
+
+static void isolation_bench()
+{
+    size_t cpu_count = thread_get_cpu_count();
+    if (cpu_count < 2) {
+        printk("Isolation benchmark needs at least 2 CPUs\n");
+        return;
+    }
+
+    isolation_bench_run(cpu_count - 1, false);
+    isolation_bench_run(cpu_count - 1, true);
+}
+#endif
+
+#if ENABLE_INTERACT_BENCH > 0
+// Two threads ping-pong through a condition variable, like a thread
+// waiting for I/O completions, while a CPU hog per CPU keeps every CPU
+// busy. Measures the cycles from the wakeup until the woken thread runs
+struct interact_bench_t {
+    mutex_t lock;
+    condition_var_t ping_cond;
+    condition_var_t pong_cond;
+
+    // Protected by lock
+    bool ping;
+    uint64_t wake_time;
+    uint64_t total_latency;
+    uint64_t max_latency;
+};
+
+static bool volatile interact_bench_done;
+
+static int interact_bench_hog(void *)
+{
+    while (!interact_bench_done)
+        pause();
+
+    return 0;
+}
+
+static int interact_bench_io_thread(void *p)
+{
+    interact_bench_t *bench = (interact_bench_t*)p;
+
+    mutex_lock(&bench->lock);
+
+    for (size_t i = 0; i < ENABLE_INTERACT_BENCH; ++i) {
+        while (!bench->ping)
+            condvar_wait(&bench->ping_cond, &bench->lock);
+
+        uint64_t latency = cpu_rdtsc() - bench->wake_time;
+        bench->total_latency += latency;
+        if (bench->max_latency < latency)
+            bench->max_latency = latency;
+
+        bench->ping = false;
+        condvar_wake_one(&bench->pong_cond);
+    }
+
+    mutex_unlock(&bench->lock);
+
+    return 0;
+}
+
+static void interact_bench()
+{
+    static interact_bench_t bench;
+    mutex_init(&bench.lock);
+    condvar_init(&bench.ping_cond);
+    condvar_init(&bench.pong_cond);
+    bench.ping = false;
+    bench.total_latency = 0;
+    bench.max_latency = 0;
+
+    interact_bench_done = false;
+
+    size_t hog_count = thread_get_cpu_count();
+    thread_t *hogs = new thread_t[hog_count];
+    for (size_t i = 0; i < hog_count; ++i)
+        hogs[i] = thread_create(interact_bench_hog, nullptr, 0, false);
+
+    thread_t tid = thread_create(interact_bench_io_thread, &bench, 0, false);
+
+    mutex_lock(&bench.lock);
+    for (size_t i = 0; i < ENABLE_INTERACT_BENCH; ++i) {
+        while (bench.ping)
+            condvar_wait(&bench.pong_cond, &bench.lock);
+
+        bench.ping = true;
+        bench.wake_time = cpu_rdtsc();
+        condvar_wake_one(&bench.ping_cond);
+    }
+    mutex_unlock(&bench.lock);
+
+    thread_wait(tid);
+    thread_close(tid);
+
+    interact_bench_done = true;
+
+    for (size_t i = 0; i < hog_count; ++i) {
+        thread_wait(hogs[i]);
+        thread_close(hogs[i]);
+    }
+
+    delete[] hogs;
+
+    condvar_destroy(&bench.pong_cond);
+    condvar_destroy(&bench.ping_cond);
+    mutex_destroy(&bench.lock);
+
+    printk("I/O thread wake latency with %zu hogs: %" PRIu64 " cycles avg,"
+           " %" PRIu64 " cycles max\n", hog_count,
+           bench.total_latency / ENABLE_INTERACT_BENCH, bench.max_latency);
+}
+#endif
+
+#if ENABLE_THREAD_CREATE_BENCH > 0
+// Creates and joins threads that exit immediately, one at a time
+// and in batches, and measures the cycles per thread
+#define THREAD_CREATE_BENCH_BATCH   32
+
+static int thread_create_bench_thread(void *)
+{
+    return 0;
+}
+
+static void thread_create_bench()
+{
+    uint64_t st = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_THREAD_CREATE_BENCH; ++i) {
+        thread_t tid = thread_create(thread_create_bench_thread,
+                                     nullptr, 0, false);
+        thread_wait(tid);
+        thread_close(tid);
+    }
+    uint64_t serial_cycles = cpu_rdtsc() - st;
+
+    thread_t tids[THREAD_CREATE_BENCH_BATCH];
+    st = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_THREAD_CREATE_BENCH;
+         i += THREAD_CREATE_BENCH_BATCH) {
+        for (size_t k = 0; k < countof(tids); ++k)
+            tids[k] = thread_create(thread_create_bench_thread,
+                                    nullptr, 0, false);
+
+        for (size_t k = 0; k < countof(tids); ++k) {
+            thread_wait(tids[k]);
+            thread_close(tids[k]);
+        }
+    }
+    uint64_t batch_cycles = cpu_rdtsc() - st;
+
+    printk("Thread create/join: %" PRIu64 " cycles per thread one at"
+           " a time, %" PRIu64 " cycles per thread in batches of %d\n",
+           serial_cycles / ENABLE_THREAD_CREATE_BENCH,
+           batch_cycles / ENABLE_THREAD_CREATE_BENCH,
+           THREAD_CREATE_BENCH_BATCH);
+}
+#endif
+
+#if ENABLE_WORKQ_BENCH > 0
+#include "work_queue.h"
+
+// Queues tiny items from every CPU and measures the cycles per item
+// until all of them have run
+class workq_bench_item : public workq_work {
+public:
+    workq_bench_item(size_t volatile *done)
+        : done(done)
+    {
+    }
+
+    void invoke() override
+    {
+        atomic_inc(done);
+    }
+
+private:
+    size_t volatile *done;
+};
+
+static size_t volatile workq_bench_done;
+
+static int workq_bench_thread(void *p)
+{
+    size_t count = size_t(p);
+
+    for (size_t i = 0; i < count; ++i) {
+        while (!workq::emplace<workq_bench_item>(&workq_bench_done))
+            thread_yield();
+    }
+
+    return 0;
+}
+
+static void workq_bench()
+{
+    size_t thread_count = thread_get_cpu_count();
+    size_t per_thread = ENABLE_WORKQ_BENCH / thread_count;
+    size_t total = per_thread * thread_count;
+
+    workq_bench_done = 0;
+
+    uint64_t st = cpu_rdtsc();
+
+    thread_t *tids = new thread_t[thread_count];
+    for (size_t i = 0; i < thread_count; ++i)
+        tids[i] = thread_create(workq_bench_thread,
+                                (void*)per_thread, 0, false);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        thread_wait(tids[i]);
+        thread_close(tids[i]);
+    }
+
+    uint64_t queued = cpu_rdtsc();
+
+    while (workq_bench_done < total)
+        thread_yield();
+
+    uint64_t en = cpu_rdtsc();
+
+    delete[] tids;
+
+    printk("Work queue, %zu items from %zu threads: %" PRIu64
+           " cycles per item queued, %" PRIu64 " cycles per item run\n",
+           total, thread_count, (queued - st) / total, (en - st) / total);
+}
+#endif
+
+#if ENABLE_RCU_BENCH > 0 || ENABLE_TIME_BENCH > 0 || \
+    ENABLE_BRLOCK_BENCH > 0 || ENABLE_PREAD_BENCH > 0
+// Scaling benchmarks run fn(arg, index) on one thread on each of the
+// first 1, 2, 4 ... CPUs at once, and print the mean cycles per
+// operation for each CPU count. A read side that shares no written
+// state should cost the same however many CPUs run it
+struct scaling_bench_t {
+    int (*fn)(void *arg, size_t index);
+    void *arg;
+    uint64_t cycles;
+};
+
+struct scaling_bench_thread_t {
+    scaling_bench_t *bench;
+    size_t index;
+};
+
+static int scaling_bench_thread(void *p)
+{
+    scaling_bench_thread_t *thread = (scaling_bench_thread_t*)p;
+    scaling_bench_t *bench = thread->bench;
+
+    uint64_t st = cpu_rdtsc();
+    int result = bench->fn(bench->arg, thread->index);
+    atomic_add(&bench->cycles, cpu_rdtsc() - st);
+
+    return result;
+}
+
+// Each call of fn does ops operations
+static void scaling_bench(char const *name, int (*fn)(void *, size_t),
+                          void *arg, size_t ops)
+{
+    size_t cpu_count = thread_get_cpu_count();
+
+    thread_t *tids = new thread_t[cpu_count];
+    scaling_bench_thread_t *threads = new scaling_bench_thread_t[cpu_count];
+
+    for (size_t n = 1; n <= cpu_count; n <<= 1) {
+        scaling_bench_t bench{ fn, arg, 0 };
+
+        for (size_t i = 0; i < n; ++i) {
+            threads[i] = { &bench, i };
+            tids[i] = thread_create(scaling_bench_thread, threads + i,
+                                    0, false);
+            thread_set_affinity(tids[i], thread_cpu_mask_t(i));
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            thread_wait(tids[i]);
+            thread_close(tids[i]);
+        }
+
+        printk("%s, %zu CPUs: %" PRIu64 " cycles per operation\n",
+               name, n, bench.cycles / (n * ops));
+    }
+
+    delete[] threads;
+    delete[] tids;
+}
+#endif
+
+#if ENABLE_RCU_BENCH > 0
+#include "rcu.h"
+
+// Device mapping lookups. Each thread msyncs a clean page of its own
+// device mapping, so the only state the threads share is the device
+// table that the page fault path also searches
+static int rcu_bench_callback(void *, void *, uint64_t, uint64_t,
+                              bool, bool)
+{
+    return 0;
+}
+
+static int rcu_bench_thread(void *p, size_t index)
+{
+    char *mapping = ((char**)p)[index];
+
+    for (size_t i = 0; i < ENABLE_RCU_BENCH; ++i)
+        msync(mapping, PAGE_SIZE, MS_ASYNC);
+
+    return 0;
+}
+
+static void rcu_bench()
+{
+    size_t cpu_count = thread_get_cpu_count();
+
+    // Never touched, so the callback never runs
+    char **mappings = new char*[cpu_count];
+    for (size_t i = 0; i < cpu_count; ++i) {
+        mappings[i] = (char*)mmap_register_device(
+                    nullptr, 0x10000, 1, PROT_READ, rcu_bench_callback);
+    }
+
+    scaling_bench("Device lookup", rcu_bench_thread, mappings,
+                  ENABLE_RCU_BENCH);
+
+    delete[] mappings;
+
+    uint64_t st = cpu_rdtsc();
+    for (size_t i = 0; i < 100; ++i)
+        synchronize_rcu();
+    uint64_t en = cpu_rdtsc();
+
+    printk("synchronize_rcu, %zu CPUs: %" PRIu64 " cycles\n",
+           cpu_count, (en - st) / 100);
+}
+#endif
+
+#if ENABLE_TIME_BENCH > 0
+// time_ns calls, readers share the clock state without writing to it
+static int time_bench_thread(void *, size_t)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < ENABLE_TIME_BENCH; ++i)
+        sum += time_ns();
+
+    return int(sum & 1);
+}
+
+static void time_bench()
+{
+    scaling_bench("time_ns", time_bench_thread, nullptr, ENABLE_TIME_BENCH);
+}
+#endif
+
+#if ENABLE_BRLOCK_BENCH > 0
+#include "mutex.h"
+
+// Shared acquire and release of a reader-writer lock with no writers,
+// for the shared_mutex and the big-reader lock
+static shared_mutex brlock_bench_rwlock;
+static shared_brlock brlock_bench_brlock;
+static uintptr_t brlock_bench_table[16];
+
+static int brlock_bench_thread(void *p, size_t)
+{
+    bool use_brlock = p != nullptr;
+    uintptr_t sum = 0;
+
+    for (size_t i = 0; i < ENABLE_BRLOCK_BENCH; ++i) {
+        if (use_brlock) {
+            shared_lock<shared_brlock> lock(brlock_bench_brlock);
+            sum += brlock_bench_table[i & 15];
+        } else {
+            shared_lock<shared_mutex> lock(brlock_bench_rwlock);
+            sum += brlock_bench_table[i & 15];
+        }
+    }
+
+    return int(sum & 1);
+}
+
+static void brlock_bench()
+{
+    scaling_bench("rwlock read", brlock_bench_thread, nullptr,
+                  ENABLE_BRLOCK_BENCH);
+    scaling_bench("brlock read", brlock_bench_thread, &brlock_bench_brlock,
+                  ENABLE_BRLOCK_BENCH);
+
+    uint64_t st = cpu_rdtsc();
+    for (size_t i = 0; i < 100; ++i)
+        unique_lock<shared_brlock> lock(brlock_bench_brlock);
+    uint64_t en = cpu_rdtsc();
+
+    printk("brlock write, %zu CPUs: %" PRIu64 " cycles\n",
+           thread_get_cpu_count(), (en - st) / 100);
+}
+#endif
+
+#if ENABLE_RING_BENCH > 0
+#include "ring.h"
+
+// Measures the cycles per item handed from producer CPUs to a consumer
+// on another CPU, through an SPSC ring with one producer, and through
+// an MPSC ring with 1 to N-1 producers
+static spsc_ring<uintptr_t, 256> ring_bench_spsc;
+static mpsc_ring<uintptr_t, 256> ring_bench_mpsc;
+
+struct ring_bench_t {
+    bool use_mpsc;
+    size_t producers;
+};
+
+static int ring_bench_producer(void *p)
+{
+    ring_bench_t *bench = (ring_bench_t*)p;
+
+    for (size_t i = 0; i < ENABLE_RING_BENCH; ++i) {
+        if (bench->use_mpsc) {
+            while (!ring_bench_mpsc.push(i))
+                pause();
+        } else {
+            while (!ring_bench_spsc.push(i))
+                pause();
+        }
+    }
+
+    return 0;
+}
+
+static void ring_bench_run(size_t producers, bool use_mpsc)
+{
+    ring_bench_t bench{ use_mpsc, producers };
+
+    thread_t *tids = new thread_t[producers];
+
+    // Consume on CPU 0, produce on the others
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t(0));
+
+    uint64_t st = cpu_rdtsc();
+
+    for (size_t i = 0; i < producers; ++i) {
+        tids[i] = thread_create(ring_bench_producer, &bench, 0, false);
+        thread_set_affinity(tids[i], thread_cpu_mask_t(i + 1));
+    }
+
+    uintptr_t item;
+    for (size_t n = producers * ENABLE_RING_BENCH; n > 0; ) {
+        if (use_mpsc ? ring_bench_mpsc.pop(item) : ring_bench_spsc.pop(item))
+            --n;
+        else
+            pause();
+    }
+
+    uint64_t en = cpu_rdtsc();
+
+    for (size_t i = 0; i < producers; ++i) {
+        thread_wait(tids[i]);
+        thread_close(tids[i]);
+    }
+
+    delete[] tids;
+
+    printk("%s ring, %zu producers: %" PRIu64 " cycles per item\n",
+           use_mpsc ? "MPSC" : "SPSC", producers,
+           (en - st) / (producers * ENABLE_RING_BENCH));
+}
+
+static void ring_bench()
+{
+    size_t cpu_count = thread_get_cpu_count();
+
+    if (cpu_count < 2) {
+        printk("ring bench needs 2 CPUs\n");
+        return;
+    }
+
+    ring_bench_run(1, false);
+
+    for (size_t n = 1; n < cpu_count; n <<= 1)
+        ring_bench_run(n, true);
+
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t::all());
+}
+#endif
+
+#if ENABLE_PREAD_BENCH > 0
+// preads of the start of one shared open file, which is cached
+static int pread_bench_thread(void *p, size_t)
+{
+    int id = int(intptr_t(p));
+    char buf[64];
+
+    for (size_t i = 0; i < ENABLE_PREAD_BENCH; ++i)
+        file_pread(id, buf, sizeof(buf), 0);
+
+    return 0;
+}
+
+static void pread_bench()
+{
+    int id = file_open("hello.km", O_RDONLY);
+
+    if (id < 0) {
+        printk("pread bench could not open hello.km\n");
+        return;
+    }
+
+    scaling_bench("pread", pread_bench_thread, (void*)intptr_t(id),
+                  ENABLE_PREAD_BENCH);
+
+    file_close(id);
+}
+#endif
+
+#if ENABLE_IPI_BENCH > 0
+#include "cpu/apic.h"
+#include "cpu/thread_impl.h"
+#include "cpu/cpu_broadcast.h"
+
+// Reserved vector, only hooked while the benchmark runs
+#define IPI_BENCH_INTR  43
+
+// Measures the cycles from sending an IPI from CPU 0 until the target
+// acknowledges it through memory, to each other CPU, and multicast to
+// all of them, and for a cross-CPU call to all of them to complete.
+// Then measures the cycles until every other CPU has handled the TLB
+// shootdown sent by an mprotect
+static uint64_t volatile ipi_bench_acks;
+
+static void ipi_bench_call(void *)
+{
+    atomic_inc(&ipi_bench_acks);
+}
+
+static isr_context_t *ipi_bench_handler(int intr, isr_context_t *ctx)
+{
+    apic_eoi(intr);
+    atomic_inc(&ipi_bench_acks);
+    return ctx;
+}
+
+static void ipi_bench()
+{
+    int cpu_count = thread_get_cpu_count();
+
+    if (cpu_count < 2) {
+        printk("ipi bench needs 2 CPUs\n");
+        return;
+    }
+
+    intr_hook(IPI_BENCH_INTR, ipi_bench_handler, "ipi_bench");
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t(0));
+
+    uint32_t apic_ids[MAX_CPUS];
+    size_t apic_id_count = 0;
+
+    for (int cpu = 1; cpu < cpu_count; ++cpu) {
+        apic_ids[apic_id_count++] = thread_get_cpu_apic_id(cpu);
+
+        uint64_t st = cpu_rdtsc();
+        for (size_t i = 0; i < ENABLE_IPI_BENCH; ++i) {
+            uint64_t expect = ipi_bench_acks + 1;
+            thread_send_ipi(cpu, IPI_BENCH_INTR);
+            while (atomic_ld_acq(&ipi_bench_acks) != expect)
+                pause();
+        }
+        uint64_t en = cpu_rdtsc();
+
+        printk("IPI round trip to CPU %d: %" PRIu64 " cycles\n",
+               cpu, (en - st) / ENABLE_IPI_BENCH);
+    }
+
+    uint64_t st = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_IPI_BENCH; ++i) {
+        uint64_t expect = ipi_bench_acks + apic_id_count;
+        apic_send_ipi_multi(apic_ids, apic_id_count, IPI_BENCH_INTR);
+        while (atomic_ld_acq(&ipi_bench_acks) != expect)
+            pause();
+    }
+    uint64_t en = cpu_rdtsc();
+
+    printk("IPI multicast round trip to %zu CPUs: %" PRIu64 " cycles\n",
+           apic_id_count, (en - st) / ENABLE_IPI_BENCH);
+
+    intr_unhook(IPI_BENCH_INTR, ipi_bench_handler);
+
+    thread_cpu_mask_t others = thread_cpu_mask_t::all();
+    others.clr(0);
+
+    st = cpu_rdtsc();
+    for (size_t i = 0; i < ENABLE_IPI_BENCH; ++i)
+        cpu_call_mask(others, ipi_bench_call, nullptr, true);
+    en = cpu_rdtsc();
+
+    printk("Cross-CPU call to %zu CPUs: %" PRIu64 " cycles\n",
+           apic_id_count, (en - st) / ENABLE_IPI_BENCH);
+
+    char *page = (char*)mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_POPULATE, -1, 0);
+    page[0] = 1;
+
+    uint64_t counts[MAX_CPUS];
+    uint64_t cycles = 0;
+
+    for (size_t i = 0; i < ENABLE_IPI_BENCH; ++i) {
+        for (int cpu = 1; cpu < cpu_count; ++cpu)
+            counts[cpu] = thread_shootdown_count(cpu);
+
+        st = cpu_rdtsc();
+
+        mprotect(page, PAGE_SIZE, (i & 1)
+                 ? PROT_READ | PROT_WRITE
+                 : PROT_READ);
+
+        for (int cpu = 1; cpu < cpu_count; ++cpu) {
+            while (thread_shootdown_count(cpu) == counts[cpu])
+                pause();
+        }
+
+        cycles += cpu_rdtsc() - st;
+    }
+
+    munmap(page, PAGE_SIZE);
+
+    printk("TLB shootdown to %d CPUs: %" PRIu64 " cycles\n",
+           cpu_count - 1, cycles / ENABLE_IPI_BENCH);
+
+    thread_set_affinity(thread_get_id(), thread_cpu_mask_t::all());
+}
+#endif
+
 #include "cpu/except.h"
 
 #if 1
@@ -340,6 +1286,67 @@ static int mprotect_test(void *)
 }
 #endif
 
+#if ENABLE_HPET_TEST > 0
+#include "cpu/hpet.h"
+
+// Arms an HPET one-shot timer for delays from 1us up to
+// ENABLE_HPET_TEST ns, and checks that each interrupt arrives on the
+// CPU it targets, no earlier than asked
+static uint64_t volatile hpet_test_fired_ns;
+static int volatile hpet_test_fired_cpu;
+
+static isr_context_t *hpet_test_handler(int, isr_context_t *ctx)
+{
+    hpet_test_fired_cpu = thread_cpu_number();
+    atomic_st_rel(&hpet_test_fired_ns, hpet_time_ns());
+    return ctx;
+}
+
+static void hpet_test()
+{
+    int cpu = thread_get_cpu_count() - 1;
+    int timer = hpet_timer_alloc(cpu, hpet_test_handler, "hpet_test");
+
+    if (timer < 0) {
+        printk("HPET test: no timer, error %d\n", timer);
+        return;
+    }
+
+    for (uint64_t ns = 1000; ns <= ENABLE_HPET_TEST; ns *= 10) {
+        atomic_st_rel(&hpet_test_fired_ns, 0);
+
+        uint64_t st = hpet_time_ns();
+
+        if (hpet_timer_oneshot(timer, ns) < 0) {
+            printk("HPET test: %" PRIu64 "ns, passed before armed\n", ns);
+            continue;
+        }
+
+        // Generous, delivery only needs to happen eventually
+        uint64_t give_up = st + ns * 10 + 1000000;
+
+        uint64_t fired;
+        while (!(fired = atomic_ld_acq(&hpet_test_fired_ns)) &&
+               hpet_time_ns() < give_up)
+            pause();
+
+        if (!fired) {
+            hpet_timer_cancel(timer);
+            printk("HPET test: %" PRIu64 "ns, FAILED, did not fire\n", ns);
+            continue;
+        }
+
+        bool ok = fired - st >= ns && hpet_test_fired_cpu == cpu;
+
+        printk("HPET test: %" PRIu64 "ns, fired after %" PRIu64 "ns"
+               " on CPU %d%s\n", ns, fired - st, hpet_test_fired_cpu,
+               ok ? "" : ", FAILED");
+    }
+
+    hpet_timer_cancel(timer);
+}
+#endif
+
 #if ENABLE_REGISTER_THREAD
 static int register_check(void *p)
 {
@@ -728,6 +1735,54 @@ static int init_thread(void *p)
     condvar_test();
 #endif
 
+#if ENABLE_CONDVAR_BENCH > 0
+    condvar_bench();
+#endif
+
+#if ENABLE_ISOLATION_BENCH > 0
+    isolation_bench();
+#endif
+
+#if ENABLE_INTERACT_BENCH > 0
+    interact_bench();
+#endif
+
+#if ENABLE_THREAD_CREATE_BENCH > 0
+    thread_create_bench();
+#endif
+
+#if ENABLE_WORKQ_BENCH > 0
+    workq_bench();
+#endif
+
+#if ENABLE_RCU_BENCH > 0
+    rcu_bench();
+#endif
+
+#if ENABLE_TIME_BENCH > 0
+    time_bench();
+#endif
+
+#if ENABLE_BRLOCK_BENCH > 0
+    brlock_bench();
+#endif
+
+#if ENABLE_RING_BENCH > 0
+    ring_bench();
+#endif
+
+#if ENABLE_PREAD_BENCH > 0
+    pread_bench();
+#endif
+
+#if ENABLE_IPI_BENCH > 0
+    ipi_bench();
+#endif
+
+#if ENABLE_HPET_TEST > 0
+    hpet_test();
+#endif
+
 #if 0
     //    for (int i = 0; i < 10000; ++i) {
     //        printk("%d=%f\n", i, i / 1000.0);
@@ -798,6 +1853,7 @@ static int init_thread(void *p)
     printk("Running framebuffer stress\n");
     thread_t draw_thread_id = thread_create(draw_test, 0, 0, 0);
     printk("draw thread id=%d\n", draw_thread_id);
+    thread_close(draw_thread_id);
 #endif
 
     modload_init();
@@ -811,21 +1867,27 @@ static int init_thread(void *p)
     }
 
 #if ENABLE_FIND_VBE
-    thread_create(find_vbe, (void*)0xC0000, 0, false);
-    thread_create(find_vbe, (void*)0xF0000, 0, false);
+    thread_close(thread_create(find_vbe, (void*)0xC0000, 0, false));
+    thread_close(thread_create(find_vbe, (void*)0xF0000, 0, false));
 #endif
 
 #if ENABLE_CTXSW_STRESS_THREAD > 0
     printk("Running context switch stress with %d threads\n",
              ENABLE_CTXSW_STRESS_THREAD);
     for (int i = 0; i < ENABLE_CTXSW_STRESS_THREAD; ++i) {
-        thread_create(ctx_sw_thread, 0, 0, false);
+        thread_close(thread_create(ctx_sw_thread, 0, 0, false));
     }
 #endif
 
+#if ENABLE_CTXSW_BENCH > 0
+    ctxsw_bench(false);
+    ctxsw_bench(true);
+#endif
+
 #if ENABLE_SHELL_THREAD > 0
     printk("Running shell thread\n");
-    thread_create(shell_thread, (void*)0xfeedbeeffacef00d, 0, false);
+    thread_close(thread_create(shell_thread, (void*)0xfeedbeeffacef00d,
+                               0, false));
 #endif
 
 #if ENABLE_SLEEP_THREAD
@@ -837,7 +1899,7 @@ static int init_thread(void *p)
     for (int i = 0; i < ENABLE_SLEEP_THREAD; ++i) {
         ttp[i].sleep = i * 100;
         ttp[i].p = (uint16_t*)0xb8000 + 4 + i;
-        thread_create(other_thread, ttp + i, 0, false);
+        thread_close(thread_create(other_thread, ttp + i, 0, false));
     }
 #endif
 
@@ -857,6 +1919,7 @@ static int init_thread(void *p)
             uint16_t *indicator = (uint16_t*)0xb8000 + 80*devid + i;
             thread_t tid = thread->start(devid, indicator);
             printk("(devid %d) Read stress id[%d]=%d\n", devid, i, tid);
+            thread_close(tid);
         }
     }
 #endif
@@ -865,17 +1928,23 @@ static int init_thread(void *p)
     printk("Running register stress with %d threads\n",
              ENABLE_READ_STRESS_THREAD);
     for (int i = 0; i < ENABLE_REGISTER_THREAD; ++i) {
-        thread_create(register_check, (void*)
-                      (0xDEADFEEDF00DD00D +
-                       (1<<ENABLE_READ_STRESS_THREAD)), 0, false);
+        thread_close(thread_create(register_check, (void*)
+                                   (0xDEADFEEDF00DD00D +
+                                    (1<<ENABLE_READ_STRESS_THREAD)),
+                                   0, false));
     }
 #endif
 
+#if ENABLE_MUTEX_BENCH > 0
+    mutex_bench(false);
+    mutex_bench(true);
+#endif
+
 #if ENABLE_MUTEX_THREAD > 0
     printk("Running mutex stress with %d threads\n", ENABLE_MUTEX_THREAD);
     mutex_init(&stress_lock);
     for (int i = 0; i < ENABLE_MUTEX_THREAD; ++i) {
-        thread_create(stress_mutex, 0, 0, false);
+        thread_close(thread_create(stress_mutex, 0, 0, false));
     }
 #endif
 
@@ -883,7 +1952,7 @@ static int init_thread(void *p)
     printk("Running mmap stress with %d threads\n",
              ENABLE_MMAP_STRESS_THREAD);
     for (int i = 0; i < ENABLE_MMAP_STRESS_THREAD; ++i) {
-        thread_create(stress_mmap_thread, nullptr, 0, false);
+        thread_close(thread_create(stress_mmap_thread, nullptr, 0, false));
     }
 #endif
 
@@ -891,7 +1960,7 @@ static int init_thread(void *p)
     printk("Running heap stress with %d threads\n",
              ENABLE_HEAP_STRESS_THREAD);
     for (int i = 0; i < ENABLE_HEAP_STRESS_THREAD; ++i) {
-        thread_create(stress_heap_thread, 0, 0, false);
+        thread_close(thread_create(stress_heap_thread, 0, 0, false));
     }
 #endif
 
@@ -902,7 +1971,7 @@ int debugger_thread(void *)
 {
     printk("Starting GDB stub\n");
     gdb_init();
-    thread_create(init_thread, nullptr, 0, false);
+    thread_close(thread_create(init_thread, nullptr, 0, false));
 
     return 0;
 }
@@ -910,9 +1979,9 @@ int debugger_thread(void *)
 extern "C" _noreturn int main(void)
 {
     if (!kernel_params->wait_gdb)
-        thread_create(init_thread, nullptr, 0, false);
+        thread_close(thread_create(init_thread, nullptr, 0, false));
     else
-        thread_create(debugger_thread, nullptr, 0, false);
+        thread_close(thread_create(debugger_thread, nullptr, 0, false));
 
     thread_idle_set_ready();
 
@@ -74,7 +74,7 @@ int sys_close(int fd)
         return badf_err();
 
     int status = file_close(id);
-    if (status != 0)
+    if (status == 0)
         return 0;
 
     return err(status);
@@ -0,0 +1,356 @@
+#include "sys_futex.h"
+#include "syscall_helper.h"
+#include "thread.h"
+#include "time.h"
+#include "errno.h"
+#include "likely.h"
+#include "printk.h"
+#include "cpu/atomic.h"
+#include "cpu/spinlock.h"
+#include "cpu/except.h"
+
+#define DEBUG_FUTEX 0
+#if DEBUG_FUTEX
+#define FUTEX_TRACE(...) printdbg("futex: " __VA_ARGS__)
+#else
+#define FUTEX_TRACE(...) ((void)0)
+#endif
+
+// Threads waiting on a futex word are kept in a hash table of wait
+// queues, keyed by the address space and the user address of the word.
+// A user mode lock only makes a syscall when it sees contention, so
+// the uncontended paths never enter the kernel.
+
+struct futex_link_t {
+    futex_link_t *next;
+    futex_link_t *prev;
+};
+
+// Lives on the stack of the waiting thread
+struct futex_waiter_t {
+    futex_link_t link;
+
+    process_t *process;
+
+    // Updated by requeue while holding both bucket locks
+    int * volatile uaddr;
+
+    uint32_t bitset;
+    thread_t thread;
+};
+
+struct alignas(64) futex_bucket_t {
+    futex_bucket_t()
+        : link{ &link, &link }
+        , lock(0)
+    {
+    }
+
+    // Circular list of waiters, in arrival order
+    futex_link_t link;
+
+    spinlock_t lock;
+};
+
+#define FUTEX_HASH_LOG2     8
+
+static futex_bucket_t futex_table[1 << FUTEX_HASH_LOG2];
+
+static futex_bucket_t *futex_bucket(process_t *process, int *uaddr)
+{
+    uint64_t key = (uintptr_t(uaddr) >> 2) ^ (uintptr_t(process) >> 6);
+    key *= UINT64_C(0x9E3779B97F4A7C15);
+    return futex_table + (key >> (64 - FUTEX_HASH_LOG2));
+}
+
+static void futex_link_add(futex_link_t *root, futex_link_t *node)
+{
+    node->next = root;
+    node->prev = root->prev;
+    root->prev->next = node;
+    root->prev = node;
+}
+
+// Returns the node that followed the removed node
+static futex_link_t *futex_link_del(futex_link_t *node)
+{
+    futex_link_t *next = node->next;
+    next->prev = node->prev;
+    node->prev->next = next;
+    node->next = nullptr;
+    node->prev = nullptr;
+    return next;
+}
+
+static bool futex_match(futex_waiter_t const *waiter,
+                        process_t const *process, int const *uaddr)
+{
+    return waiter->uaddr == uaddr && waiter->process == process;
+}
+
+static bool futex_check_addr(int *uaddr)
+{
+    if (unlikely(intptr_t(uaddr) <= 0 ||
+                 (uintptr_t(uaddr) & (sizeof(*uaddr) - 1))))
+        return false;
+
+    return verify_accessible(uaddr, sizeof(*uaddr), false);
+}
+
+// Another thread can unmap the word at any time, so it is read with
+// a fault handler. Returns false if it faulted
+static bool futex_load(int const *uaddr, int *value)
+{
+    bool loaded = false;
+
+    __try {
+        *value = atomic_ld_acq(uaddr);
+        loaded = true;
+    }
+    __catch {
+    }
+
+    return loaded;
+}
+
+// A requeue may have moved the waiter to another bucket while it
+// was asleep, follow it until the held lock is the right one
+static futex_bucket_t *futex_relock(futex_bucket_t *held,
+                                    futex_waiter_t *wait)
+{
+    for (;;) {
+        futex_bucket_t *bucket = futex_bucket(wait->process, wait->uaddr);
+
+        if (likely(bucket == held))
+            return held;
+
+        spinlock_unlock(&held->lock);
+        spinlock_lock(&bucket->lock);
+        held = bucket;
+    }
+}
+
+static long futex_wait(process_t *process, int *uaddr, int val,
+                       uint64_t expiry, uint32_t bitset)
+{
+    futex_waiter_t wait;
+    wait.process = process;
+    wait.uaddr = uaddr;
+    wait.bitset = bitset;
+
+    // Fault the page in without holding a lock
+    int value;
+    if (unlikely(!futex_load(uaddr, &value)))
+        return -int(errno_t::EFAULT);
+
+    if (value != val)
+        return -int(errno_t::EAGAIN);
+
+    futex_bucket_t *bucket = futex_bucket(process, uaddr);
+
+    spinlock_lock(&bucket->lock);
+
+    // The value is checked again with the bucket lock held, a waker
+    // that changes the value before waking cannot be missed
+    bool loaded = futex_load(uaddr, &value);
+    if (unlikely(!loaded) || value != val) {
+        spinlock_unlock(&bucket->lock);
+        return loaded ? -int(errno_t::EAGAIN) : -int(errno_t::EFAULT);
+    }
+
+    futex_link_add(&bucket->link, &wait.link);
+
+    FUTEX_TRACE("%p: waiting\n", (void*)uaddr);
+
+    thread_sleep_release(&bucket->lock, &wait.thread, expiry);
+
+    bucket = futex_relock(bucket, &wait);
+
+    // Wakers unlink the waiter, still being linked means it timed out
+    bool timed_out = wait.link.next != nullptr;
+    if (timed_out)
+        futex_link_del(&wait.link);
+
+    spinlock_unlock(&bucket->lock);
+
+    return timed_out ? -int(errno_t::ETIMEDOUT) : 0;
+}
+
+// Expects the bucket to be locked
+static int futex_wake_locked(futex_bucket_t *bucket, process_t *process,
+                             int *uaddr, int count, uint32_t bitset)
+{
+    int woken = 0;
+
+    for (futex_link_t *node = bucket->link.next;
+         node != &bucket->link && woken < count; ) {
+        futex_waiter_t *waiter = (futex_waiter_t*)node;
+
+        if (!futex_match(waiter, process, uaddr) ||
+                !(waiter->bitset & bitset)) {
+            node = node->next;
+            continue;
+        }
+
+        node = futex_link_del(&waiter->link);
+
+        // If the waiter already timed out, it is waiting for the bucket
+        // lock, and will find itself unlinked and report a wakeup
+        thread_wake(waiter->thread);
+        ++woken;
+    }
+
+    return woken;
+}
+
+static long futex_wake(process_t *process, int *uaddr,
+                       int count, uint32_t bitset)
+{
+    futex_bucket_t *bucket = futex_bucket(process, uaddr);
+
+    spinlock_lock(&bucket->lock);
+    int woken = futex_wake_locked(bucket, process, uaddr, count, bitset);
+    spinlock_unlock(&bucket->lock);
+
+    FUTEX_TRACE("%p: woke %d\n", (void*)uaddr, woken);
+
+    return woken;
+}
+
+// Wake up to wake_count waiters on uaddr, and move up to requeue_count
+// of the remaining waiters to uaddr2 without waking them. This avoids
+// the thundering herd when a condition variable is broadcast
+static long futex_requeue(process_t *process, int *uaddr, int *uaddr2,
+                          int wake_count, int requeue_count,
+                          bool compare, int val3)
+{
+    // Fault the page in without holding a lock
+    int value;
+    if (compare) {
+        if (unlikely(!futex_load(uaddr, &value)))
+            return -int(errno_t::EFAULT);
+
+        if (value != val3)
+            return -int(errno_t::EAGAIN);
+    }
+
+    futex_bucket_t *bucket = futex_bucket(process, uaddr);
+    futex_bucket_t *bucket2 = futex_bucket(process, uaddr2);
+
+    // Lock in address order to avoid deadlock
+    futex_bucket_t *first = bucket < bucket2 ? bucket : bucket2;
+    futex_bucket_t *second = bucket < bucket2 ? bucket2 : bucket;
+
+    spinlock_lock(&first->lock);
+    if (second != first)
+        spinlock_lock(&second->lock);
+
+    long result;
+
+    if (compare && unlikely(!futex_load(uaddr, &value))) {
+        result = -int(errno_t::EFAULT);
+    } else if (compare && value != val3) {
+        result = -int(errno_t::EAGAIN);
+    } else {
+        int woken = futex_wake_locked(bucket, process, uaddr,
+                                      wake_count, FUTEX_BITSET_MATCH_ANY);
+        int requeued = 0;
+
+        for (futex_link_t *node = bucket->link.next;
+             node != &bucket->link && requeued < requeue_count; ) {
+            futex_waiter_t *waiter = (futex_waiter_t*)node;
+
+            if (!futex_match(waiter, process, uaddr)) {
+                node = node->next;
+                continue;
+            }
+
+            node = futex_link_del(&waiter->link);
+            waiter->uaddr = uaddr2;
+            futex_link_add(&bucket2->link, &waiter->link);
+            ++requeued;
+        }
+
+        result = woken + requeued;
+    }
+
+    if (second != first)
+        spinlock_unlock(&second->lock);
+    spinlock_unlock(&first->lock);
+
+    return result;
+}
+
+long sys_futex(int *uaddr, int op, int val, timespec const *timeout,
+               int *uaddr2, int val3)
+{
+    if (unlikely(!futex_check_addr(uaddr)))
+        return -int(errno_t::EFAULT);
+
+    process_t *process = thread_current_process();
+
+    int cmd = op & FUTEX_CMD_MASK;
+
+    bool realtime = op & FUTEX_CLOCK_REALTIME;
+
+    // Like Linux, the clock can only be chosen for waits
+    if (unlikely(realtime && cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET))
+        return -int(errno_t::ENOSYS);
+
+    // time_ns is the monotonic clock
+    uint64_t expiry = UINT64_MAX;
+    if ((cmd == FUTEX_WAIT || cmd == FUTEX_WAIT_BITSET) && timeout) {
+        if (unlikely(!verify_accessible(timeout, sizeof(*timeout), false)))
+            return -int(errno_t::EFAULT);
+
+        if (unlikely(timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+                     timeout->tv_nsec >= 1000000000))
+            return -int(errno_t::EINVAL);
+
+        expiry = uint64_t(timeout->tv_sec) * 1000000000 + timeout->tv_nsec;
+
+        // FUTEX_WAIT has a relative timeout, FUTEX_WAIT_BITSET absolute
+        if (cmd == FUTEX_WAIT) {
+            expiry += time_ns();
+        } else if (realtime) {
+            // CLOCK_REALTIME is time_ns plus the boot time
+            uint64_t base = time_realtime_base();
+            expiry = expiry > base ? expiry - base : 0;
+        }
+    }
+
+    switch (cmd) {
+    case FUTEX_WAIT:
+        return futex_wait(process, uaddr, val, expiry,
+                          FUTEX_BITSET_MATCH_ANY);
+
+    case FUTEX_WAIT_BITSET:
+        if (unlikely(!val3))
+            return -int(errno_t::EINVAL);
+        return futex_wait(process, uaddr, val, expiry, uint32_t(val3));
+
+    case FUTEX_WAKE:
+        return futex_wake(process, uaddr, val, FUTEX_BITSET_MATCH_ANY);
+
+    case FUTEX_WAKE_BITSET:
+        if (unlikely(!val3))
+            return -int(errno_t::EINVAL);
+        return futex_wake(process, uaddr, val, uint32_t(val3));
+
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+        // The timeout argument is the requeue count
+        if (unlikely(val < 0 || int(uintptr_t(timeout)) < 0))
+            return -int(errno_t::EINVAL);
+
+        if (unlikely(!futex_check_addr(uaddr2)))
+            return -int(errno_t::EFAULT);
+
+        return futex_requeue(process, uaddr, uaddr2, val,
+                             int(uintptr_t(timeout)),
+                             cmd == FUTEX_CMP_REQUEUE, val3);
+
+    }
+
+    return -int(errno_t::ENOSYS);
+}
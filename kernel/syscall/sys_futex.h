@@ -0,0 +1,27 @@
+#pragma once
+#include "types.h"
+#include "sys_time.h"
+
+__BEGIN_DECLS
+
+// Operations, must match the user mode <sys/futex.h>
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
+#define FUTEX_REQUEUE           3
+#define FUTEX_CMP_REQUEUE       4
+#define FUTEX_WAIT_BITSET       9
+#define FUTEX_WAKE_BITSET       10
+
+// Flags or'ed into the operation
+#define FUTEX_PRIVATE_FLAG      128
+#define FUTEX_CLOCK_REALTIME    256
+#define FUTEX_CMD_MASK          ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
+
+#define FUTEX_BITSET_MATCH_ANY  0xFFFFFFFFU
+
+// For REQUEUE and CMP_REQUEUE, timeout holds the maximum number of
+// waiters to requeue (val2) instead of a pointer
+long sys_futex(int *uaddr, int op, int val, timespec const *timeout,
+               int *uaddr2, int val3);
+
+__END_DECLS
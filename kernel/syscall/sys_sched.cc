@@ -0,0 +1,69 @@
+#include "sys_sched.h"
+#include "syscall_helper.h"
+#include "thread.h"
+#include "errno.h"
+#include "likely.h"
+
+// pid is a thread id, zero means the calling thread. A process
+// may only change the policy of its own threads
+
+int sys_sched_setscheduler(int pid, int policy, sched_param const *param)
+{
+    if (unlikely(pid < 0))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(!verify_accessible(param, sizeof(*param), false)))
+        return -int(errno_t::EFAULT);
+
+    if (pid) {
+        process_t *process = thread_get_process(pid);
+
+        if (unlikely(!process))
+            return -int(errno_t::ESRCH);
+
+        if (unlikely(process != thread_current_process()))
+            return -int(errno_t::EPERM);
+    }
+
+    return thread_set_scheduler(pid ? pid : thread_get_id(), policy,
+                                param->sched_priority, param->sched_runtime,
+                                param->sched_deadline, param->sched_period);
+}
+
+int sys_sched_getscheduler(int pid)
+{
+    if (unlikely(pid < 0))
+        return -int(errno_t::EINVAL);
+
+    return thread_get_scheduler(pid ? pid : thread_get_id());
+}
+
+int sys_sched_get_priority_max(int policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return SCHED_RT_PRIORITY_MAX;
+
+    case SCHED_OTHER:
+    case SCHED_DEADLINE:
+        return 0;
+    }
+
+    return -int(errno_t::EINVAL);
+}
+
+int sys_sched_get_priority_min(int policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return SCHED_RT_PRIORITY_MIN;
+
+    case SCHED_OTHER:
+    case SCHED_DEADLINE:
+        return 0;
+    }
+
+    return -int(errno_t::EINVAL);
+}
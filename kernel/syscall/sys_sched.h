@@ -0,0 +1,21 @@
+#pragma once
+#include "types.h"
+
+__BEGIN_DECLS
+
+// Must match the user mode <sched.h>
+struct sched_param {
+    int sched_priority;
+
+    // SCHED_DEADLINE parameters, in nanoseconds
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+int sys_sched_setscheduler(int pid, int policy, sched_param const *param);
+int sys_sched_getscheduler(int pid);
+int sys_sched_get_priority_max(int policy);
+int sys_sched_get_priority_min(int policy);
+
+__END_DECLS
@@ -2,6 +2,9 @@
 #include "sys_time.h"
 #include "time.h"
 #include "thread.h"
+#include "syscall_helper.h"
+#include "errno.h"
+#include "likely.h"
 
 int sys_nanosleep(timespec const *req, timespec *rem)
 {
@@ -24,3 +27,53 @@ int sys_nanosleep(timespec const *req, timespec *rem)
 
     return ns < 0 ? 0 : -int(errno_t::EINTR);
 }
+
+static int sys_time_ns(clockid_t clk, int64_t *ns)
+{
+    switch (clk) {
+    case CLOCK_REALTIME:
+        *ns = time_ns() + time_realtime_base();
+        return 0;
+
+    case CLOCK_MONOTONIC:
+        *ns = time_ns();
+        return 0;
+
+    default:
+        return -int(errno_t::EINVAL);
+    }
+}
+
+// Used by the vDSO when the TSC cannot be read in user mode
+int sys_clock_gettime(clockid_t clk, timespec *ts)
+{
+    if (unlikely(!verify_accessible(ts, sizeof(*ts), true)))
+        return -int(errno_t::EFAULT);
+
+    int64_t ns;
+    int err = sys_time_ns(clk, &ns);
+
+    if (err < 0)
+        return err;
+
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+
+    return 0;
+}
+
+int sys_gettimeofday(timeval *tv, void *tz)
+{
+    (void)tz;
+
+    if (unlikely(!verify_accessible(tv, sizeof(*tv), true)))
+        return -int(errno_t::EFAULT);
+
+    int64_t ns;
+    sys_time_ns(CLOCK_REALTIME, &ns);
+
+    tv->tv_sec = ns / 1000000000;
+    tv->tv_usec = (ns % 1000000000) / 1000;
+
+    return 0;
+}
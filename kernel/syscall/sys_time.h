@@ -1,3 +1,4 @@
+#pragma once
 #include "types.h"
 #include "sys/sys_types.h"
 
@@ -8,6 +9,16 @@ struct timespec {
     long   tv_nsec;
 };
 
+struct timeval {
+    time_t      tv_sec;
+    suseconds_t tv_usec;
+};
+
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
 int sys_nanosleep(timespec const* req, timespec *rem);
+int sys_clock_gettime(clockid_t clk, timespec *ts);
+int sys_gettimeofday(timeval *tv, void *tz);
 
 __END_DECLS
@@ -0,0 +1,128 @@
+#pragma once
+
+// Error numbers, must match errno_t in the kernel
+
+#define E2BIG           1
+#define EACCES          2
+#define EADDRINUSE      3
+#define EADDRNOTAVAIL   4
+#define EAFNOSUPPORT    5
+#define EAGAIN          6
+#define EALREADY        7
+#define EBADE           8
+#define EBADF           9
+#define EBADFD          10
+#define EBADMSG         11
+#define EBADR           12
+#define EBADRQC         13
+#define EBADSLT         14
+#define EBUSY           15
+#define ECANCELED       16
+#define ECHILD          17
+#define ECHRNG          18
+#define ECOMM           19
+#define ECONNABORTED    20
+#define ECONNREFUSED    21
+#define ECONNRESET      22
+#define EDEADLK         23
+#define EDEADLOCK       EDEADLK
+#define EDESTADDRREQ    24
+#define EDOM            25
+#define EDQUOT          26
+#define EEXIST          27
+#define EFAULT          28
+#define EFBIG           29
+#define EHOSTDOWN       30
+#define EHOSTUNREACH    31
+#define EIDRM           32
+#define EILSEQ          33
+#define EINPROGRESS     34
+#define EINTR           35
+#define EINVAL          36
+#define EIO             37
+#define EISCONN         38
+#define EISDIR          39
+#define EISNAM          40
+#define EKEYEXPIRED     41
+#define EKEYREJECTED    42
+#define EKEYREVOKED     43
+#define EL2HLT          44
+#define EL2NSYNC        45
+#define EL3HLT          46
+#define EL3RST          47
+#define ELIBACC         48
+#define ELIBBAD         49
+#define ELIBMAX         50
+#define ELIBSCN         51
+#define ELIBEXEC        52
+#define ELOOP           53
+#define EMEDIUMTYPE     54
+#define EMFILE          55
+#define EMLINK          56
+#define EMSGSIZE        57
+#define EMULTIHOP       58
+#define ENAMETOOLONG    59
+#define ENETDOWN        60
+#define ENETRESET       61
+#define ENETUNREACH     62
+#define ENFILE          63
+#define ENOBUFS         64
+#define ENODATA         65
+#define ENODEV          66
+#define ENOENT          67
+#define ENOEXEC         68
+#define ENOKEY          69
+#define ENOLCK          70
+#define ENOLINK         71
+#define ENOMEDIUM       72
+#define ENOMEM          73
+#define ENOMSG          74
+#define ENONET          75
+#define ENOPKG          76
+#define ENOPROTOOPT     77
+#define ENOSPC          78
+#define ENOSR           79
+#define ENOSTR          80
+#define ENOSYS          81
+#define ENOTBLK         82
+#define ENOTCONN        83
+#define ENOTDIR         84
+#define ENOTEMPTY       85
+#define ENOTSOCK        86
+#define ENOTSUP         87
+#define ENOTTY          88
+#define ENOTUNIQ        89
+#define ENXIO           90
+#define EOPNOTSUPP      91
+#define EOVERFLOW       92
+#define EPERM           93
+#define EPFNOSUPPORT    94
+#define EPIPE           95
+#define EPROTO          96
+#define EPROTONOSUPPORT 97
+#define EPROTOTYPE      98
+#define ERANGE          99
+#define EREMCHG         100
+#define EREMOTE         101
+#define EREMOTEIO       102
+#define ERESTART        103
+#define EROFS           104
+#define ESHUTDOWN       105
+#define ESPIPE          106
+#define ESOCKTNOSUPPORT 107
+#define ESRCH           108
+#define ESTALE          109
+#define ESTRPIPE        110
+#define ETIME           111
+#define ETIMEDOUT       112
+#define ETXTBSY         113
+#define EUCLEAN         114
+#define EUNATCH         115
+#define EUSERS          116
+#define EWOULDBLOCK     117
+#define EXDEV           118
+#define EXFULL          119
+#define EOVERLOAD       120
+#define EBANDWIDTH      121
+#define ESTOPPED        122
+#define ESHORT          123
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+#define SCHED_OTHER     0
+#define SCHED_FIFO      1
+#define SCHED_RR        2
+#define SCHED_DEADLINE  6
+
+struct sched_param {
+    int sched_priority;
+
+    // SCHED_DEADLINE parameters, in nanoseconds
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+int sched_setscheduler(pid_t pid, int policy, struct sched_param const *param);
+int sched_getscheduler(pid_t pid);
+int sched_get_priority_max(int policy);
+int sched_get_priority_min(int policy);
+
+__END_DECLS
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+struct timeval {
+    time_t tv_sec;
+    suseconds_t tv_usec;
+};
+
+int gettimeofday(struct timeval *restrict tp, void *restrict tzp);
+
+__END_DECLS
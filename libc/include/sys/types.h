@@ -54,22 +54,36 @@ typedef uint32_t pid_t;
 // Used to identify a thread attribute object.
 typedef struct __pthread_attr_t pthread_attr_t;
 
-#if 0   // not implemented yet
+// Used for mutexes.
+// __lock is 0 when unlocked, 1 when locked,
+// and 2 when locked and there may be waiters
+typedef struct __pthread_mutex_t {
+    int volatile __lock;
+    int __flags;
+} pthread_mutex_t;
+
+// Used to identify a mutex attribute object.
+typedef struct __pthread_mutexattr_t {
+    int __flags;
+} pthread_mutexattr_t;
+
 // Used for condition variables.
-typedef _t pthread_cond_t;
+// __seq is advanced by every signal and broadcast
+typedef struct __pthread_cond_t {
+    int volatile __seq;
+    int volatile __waiters;
+    pthread_mutex_t * volatile __mutex;
+} pthread_cond_t;
 
 // Used to identify a condition attribute object.
-typedef _t pthread_condattr_t;
+typedef struct __pthread_condattr_t {
+    int __flags;
+} pthread_condattr_t;
 
+#if 0   // not implemented yet
 // Used for thread-specific data keys.
 typedef _t pthread_key_t;
 
-// Used for mutexes.
-typedef _t pthread_mutex_t;
-
-// Used to identify a mutex attribute object.
-typedef _t pthread_mutexattr_t;
-
 // Used for dynamic package initialisation.
 typedef _t pthread_once_t;
 
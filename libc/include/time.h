@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp);
+time_t time(time_t *tloc);
+
+__END_DECLS
@@ -0,0 +1,16 @@
+#pragma once
+#include <pthread.h>
+#include <sys/futex.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+
+static _always_inline long __futex(int volatile *uaddr, int op, int val,
+                                   timespec const *timeout,
+                                   int volatile *uaddr2, int val3)
+{
+    return syscall6(long(uaddr), long(op), long(val), long(timeout),
+                    long(uaddr2), long(val3), SYS_futex);
+}
+
+// Acquire the mutex, leaving it marked as possibly having waiters
+void __pthread_mutex_lock_wait(pthread_mutex_t *mutex);
@@ -0,0 +1,22 @@
+#include "__pthread.h"
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    int seq = __atomic_add_fetch(&cond->__seq, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&cond->__waiters, __ATOMIC_SEQ_CST))
+        return 0;
+
+    pthread_mutex_t *mutex = cond->__mutex;
+
+    // Wake one waiter and move the rest onto the mutex, so they are
+    // woken one at a time as the mutex is handed off, instead of all
+    // of them waking up only to contend for the mutex. If the sequence
+    // changed again, another signal raced with this one, wake everyone
+    if (__futex(&cond->__seq, FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG,
+                1, (timespec const *)__INT_MAX__, &mutex->__lock, seq) < 0)
+        __futex(&cond->__seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+                __INT_MAX__, nullptr, nullptr, 0);
+
+    return 0;
+}
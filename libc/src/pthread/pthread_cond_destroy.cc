@@ -0,0 +1,7 @@
+#include <pthread.h>
+#include <errno.h>
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return cond->__waiters ? EBUSY : 0;
+}
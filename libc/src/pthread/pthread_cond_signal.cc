@@ -0,0 +1,12 @@
+#include "__pthread.h"
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __atomic_add_fetch(&cond->__seq, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&cond->__waiters, __ATOMIC_SEQ_CST))
+        __futex(&cond->__seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+                1, nullptr, nullptr, 0);
+
+    return 0;
+}
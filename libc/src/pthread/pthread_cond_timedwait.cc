@@ -0,0 +1,31 @@
+#include "__pthread.h"
+#include <errno.h>
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           timespec const *abstime)
+{
+    // Registering as a waiter before sampling the sequence guarantees
+    // that a signaller either sees the waiter, or the waiter sees the
+    // signal's sequence change
+    __atomic_add_fetch(&cond->__waiters, 1, __ATOMIC_SEQ_CST);
+    int seq = __atomic_load_n(&cond->__seq, __ATOMIC_SEQ_CST);
+
+    // Broadcast requeues the waiters onto this mutex
+    cond->__mutex = mutex;
+
+    pthread_mutex_unlock(mutex);
+
+    // abstime is CLOCK_REALTIME, the POSIX default for condvars
+    long status = __futex(&cond->__seq,
+                          FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG |
+                          FUTEX_CLOCK_REALTIME,
+                          seq, abstime, nullptr, FUTEX_BITSET_MATCH_ANY);
+
+    __atomic_sub_fetch(&cond->__waiters, 1, __ATOMIC_SEQ_CST);
+
+    // Requeued waiters are asleep on the mutex word, the unlocker only
+    // wakes someone if the lock is marked as possibly having waiters
+    __pthread_mutex_lock_wait(mutex);
+
+    return status == -ETIMEDOUT ? ETIMEDOUT : 0;
+}
@@ -0,0 +1,6 @@
+#include "__pthread.h"
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return pthread_cond_timedwait(cond, mutex, nullptr);
+}
@@ -0,0 +1,6 @@
+#include <pthread.h>
+
+int pthread_condattr_destroy(pthread_condattr_t *)
+{
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include "__pthread.h"
+
+// The kernel is only entered when the lock is contended
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    if (__sync_bool_compare_and_swap(&mutex->__lock, 0, 1))
+        return 0;
+
+    __pthread_mutex_lock_wait(mutex);
+
+    return 0;
+}
+
+void __pthread_mutex_lock_wait(pthread_mutex_t *mutex)
+{
+    // Whoever gets it this way cannot know whether others are
+    // still waiting, so it takes the lock in the contended state
+    while (__atomic_exchange_n(&mutex->__lock, 2, __ATOMIC_ACQUIRE) != 0)
+        __futex(&mutex->__lock, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+                2, nullptr, nullptr, 0);
+}
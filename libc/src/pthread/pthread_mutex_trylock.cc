@@ -0,0 +1,7 @@
+#include "__pthread.h"
+#include <errno.h>
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    return __sync_bool_compare_and_swap(&mutex->__lock, 0, 1) ? 0 : EBUSY;
+}
@@ -0,0 +1,11 @@
+#include "__pthread.h"
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    // Only make a syscall if another thread may be waiting
+    if (__atomic_exchange_n(&mutex->__lock, 0, __ATOMIC_RELEASE) == 2)
+        __futex(&mutex->__lock, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+                1, nullptr, nullptr, 0);
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+#include <pthread.h>
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *)
+{
+    return 0;
+}
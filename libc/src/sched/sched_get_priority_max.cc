@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+
+int sched_get_priority_max(int policy)
+{
+    return syscall1(long(policy), SYS_sched_get_priority_max);
+}
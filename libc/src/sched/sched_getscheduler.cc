@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+
+int sched_getscheduler(pid_t pid)
+{
+    return syscall1(long(pid), SYS_sched_getscheduler);
+}
@@ -0,0 +1,9 @@
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+
+int sched_setscheduler(pid_t pid, int policy, sched_param const *param)
+{
+    return syscall3(long(pid), long(policy), long(param),
+                    SYS_sched_setscheduler);
+}
@@ -0,0 +1,18 @@
+#include <sys/time.h>
+#include <time.h>
+
+int gettimeofday(struct timeval *restrict tp, void *restrict tzp)
+{
+    (void)tzp;
+
+    struct timespec ts;
+    int err = clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (err < 0)
+        return err;
+
+    tp->tv_sec = ts.tv_sec;
+    tp->tv_usec = ts.tv_nsec / 1000;
+
+    return 0;
+}
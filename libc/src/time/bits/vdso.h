@@ -0,0 +1,13 @@
+#pragma once
+
+#include <time.h>
+
+// The kernel maps its vDSO at this address in every process,
+// see vdso_constants.h in the kernel
+#define __VDSO_BASE                 0x7FFFFFFFD000
+#define __VDSO_CLOCK_GETTIME_OFS    0
+
+typedef int (*__vdso_clock_gettime_t)(clockid_t, struct timespec *);
+
+#define __vdso_clock_gettime \
+    ((__vdso_clock_gettime_t)(__VDSO_BASE + __VDSO_CLOCK_GETTIME_OFS))
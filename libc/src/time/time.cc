@@ -0,0 +1,14 @@
+#include <time.h>
+
+time_t time(time_t *tloc)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+        return -1;
+
+    if (tloc)
+        *tloc = ts.tv_sec;
+
+    return ts.tv_sec;
+}
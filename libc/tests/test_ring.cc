@@ -0,0 +1,64 @@
+#include "testassert.h"
+#include "ring.h"
+
+static spsc_ring<int, 4> test_spsc;
+static mpsc_ring<int, 4> test_mpsc;
+
+TEST_CASE(test_spsc_ring) {
+    spsc_ring<int, 4> &ring = test_spsc;
+
+    EXPECT_EQ(true, ring.empty(), "new spsc_ring is empty");
+
+    bool pushed = true;
+    for (int i = 0; i < 4; ++i)
+        pushed &= ring.push(i);
+
+    EXPECT_EQ(true, pushed, "spsc_ring holds N items");
+    EXPECT_EQ(false, ring.push(4), "spsc_ring push fails when full");
+
+    // Pop and push across several laps, in order
+    bool in_order = true;
+    int next_in = 4;
+    for (int i = 0; i < 64; ++i) {
+        int value = -1;
+        in_order &= ring.pop(value) && value == i;
+        in_order &= ring.push(next_in++);
+    }
+
+    EXPECT_EQ(true, in_order, "spsc_ring is FIFO across laps");
+
+    int value;
+    while (ring.pop(value));
+
+    EXPECT_EQ(true, ring.empty(), "drained spsc_ring is empty");
+}
+
+TEST_CASE(test_mpsc_ring) {
+    mpsc_ring<int, 4> &ring = test_mpsc;
+
+    EXPECT_EQ(true, ring.empty(), "new mpsc_ring is empty");
+
+    int value = -1;
+    EXPECT_EQ(false, ring.pop(value), "mpsc_ring pop fails when empty");
+
+    bool pushed = true;
+    for (int i = 0; i < 4; ++i)
+        pushed &= ring.push(i);
+
+    EXPECT_EQ(true, pushed, "mpsc_ring holds N items");
+    EXPECT_EQ(false, ring.push(4), "mpsc_ring push fails when full");
+    EXPECT_EQ(false, ring.empty(), "full mpsc_ring is not empty");
+
+    bool in_order = true;
+    int next_in = 4;
+    for (int i = 0; i < 64; ++i) {
+        in_order &= ring.pop(value) && value == i;
+        in_order &= ring.push(next_in++);
+    }
+
+    EXPECT_EQ(true, in_order, "mpsc_ring is FIFO across laps");
+
+    while (ring.pop(value));
+
+    EXPECT_EQ(true, ring.empty(), "drained mpsc_ring is empty");
+}
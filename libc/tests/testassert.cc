@@ -1,9 +1,12 @@
 #include "testassert.h"
 #include <stdio.h>
-#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
 
 static bool case_failed;
 static int case_pass;
+static bool any_failed;
 
 static testcase_t::test_fn test_cases[1024];
 static size_t test_cases_count;
@@ -12,6 +15,52 @@ void testcase_t::add(test_fn test)
 {
     test_cases[test_cases_count++] = test;
 }
+
+void test_failed()
+{
+    case_failed = true;
+    any_failed = true;
+}
+
+void output_pack(char const *s)
+{
+    size_t len = 0;
+    while (s[len])
+        ++len;
+
+    write(1, s, len);
+}
+
+void output_pack(uintptr_t v, bool in_hex)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned base = in_hex ? 16 : 10;
+
+    *--p = 0;
+    do {
+        *--p = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+
+    if (in_hex) {
+        *--p = 'x';
+        *--p = '0';
+    }
+
+    output_pack(static_cast<char const *>(p));
+}
+
+void output_pack(intptr_t v, bool in_hex)
+{
+    if (v < 0 && !in_hex) {
+        output_pack("-");
+        output_pack(-uintptr_t(v), false);
+    } else {
+        output_pack(uintptr_t(v), in_hex);
+    }
+}
+
 int main()
 {
     for (size_t i = 0; i < test_cases_count; ++i) {
@@ -21,13 +70,21 @@ int main()
         test_cases[i]();
     }
     
-    return 0;
+    return any_failed;
 }
 
-extern "C" void __do_global_ctors_aux(void);
+// Linked without the C runtime, the test cases register themselves
+// from static constructors
+extern "C" void (*__init_array_start[])();
+extern "C" void (*__init_array_end[])();
 
-extern "C" void _start()
+extern "C" __attribute__((__force_align_arg_pointer__, __noreturn__))
+void _start()
 {
-//    __do_global_ctors_aux();
-    main();
+    for (void (**ctor)() = __init_array_start;
+         ctor != __init_array_end; ++ctor)
+        (*ctor)();
+
+    syscall1(main(), SYS_exit);
+    __builtin_unreachable();
 }
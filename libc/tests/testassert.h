@@ -28,6 +28,13 @@ public:
     static void add(test_fn test);
 };
 
+// Makes the run exit with a failure status
+void test_failed();
+
+static inline void output_pack()
+{
+}
+
 void output_pack(intptr_t v, bool in_hex = false);
 void output_pack(uintptr_t v, bool in_hex = false);
 void output_pack(char const *s);
@@ -38,11 +45,11 @@ void output_pack(T *v)
     output_pack(uintptr_t(v), true);
 }
 
-template<typename T1, typename... Rest>
-void output_pack(T1&& first, Rest&& ...rest)
+template<typename T1, typename T2, typename... Rest>
+void output_pack(T1&& first, T2&& second, Rest&& ...rest)
 {
     output_pack(first);
-    output_pack(rest...);
+    output_pack(second, rest...);
 }
 
 template<typename... Args>
@@ -73,7 +80,7 @@ static _always_inline bool compare(char const *expect, char const *actual)
     return !strcmp(expect, actual);
 }
 
-template<typename TE, typename TA, size_t sz>
+template<typename TE, typename TA>
 bool compare(TE expect, TA actual)
 {
     return expect == actual;
@@ -89,17 +96,22 @@ void are_eq(TE const& expect,
             char const* file, int line)
 {
     bool passed = compare(expect, actual);
-    if (passed) {
+    if (!passed) {
+        test_failed();
         report_failure("Expected ", expect_expr, 
                        ", got ", actual_expr, 
                        ": ", description,
                        " in ", func,
-                       " at ", file, "(", line, ")");
+                       " at ", file, "(", intptr_t(line), ")\n");
     } else {
-        report_success(description);
+        report_success(description, "\n");
     }
 }
 
+#define EXPECT_EQ(expect, actual, description) \
+    are_eq((expect), (actual), #expect, #actual, (description), \
+           __func__, __FILE__, __LINE__)
+
 #define TEST_CASE(name) \
     void test_##name(); \
     testcase_t test_register_##name(test_##name); \